@@ -198,6 +198,22 @@ const uint16_t COM_RX_AF[COMn]    =             {EVAL_COM1_RX_AF};
 #ifdef HAL_SPI_MODULE_ENABLED
 uint32_t SpixTimeout = EVAL_SPIx_TIMEOUT_MAX;        /*<! Value of Timeout when SPI communication fails */
 static SPI_HandleTypeDef heval_Spi;
+DMA_HandleTypeDef heval_SpiDmaTx;
+DMA_HandleTypeDef heval_SpiDmaRx;
+
+/* Completion flag of the current SPI DMA transfer */
+static __IO uint8_t SpixDmaState = 0;
+
+/* Set while a DMA transfer completes through SD_IO_WriteBlockCpltCallback() */
+static __IO uint8_t SpixDmaAsync = 0;
+
+/* Idle pattern clocked out while receiving a block, and sink for the bytes
+   clocked in while sending one */
+static uint8_t SpixDmaTxIdle[EVAL_SPIx_DMA_MAX_SIZE];
+static uint8_t SpixDmaRxSink[EVAL_SPIx_DMA_MAX_SIZE];
+
+/* Timer polling the SD card while it is busy */
+static TIM_HandleTypeDef heval_SdBusyTim;
 #endif /* HAL_SPI_MODULE_ENABLED */
 
 #ifdef HAL_I2C_MODULE_ENABLED
@@ -252,6 +268,12 @@ static void               SPIx_Write(uint8_t Value);
 static uint32_t           SPIx_Read(void);
 static void               SPIx_Error (void);
 static void               SPIx_MspInit(SPI_HandleTypeDef *hspi);
+static HAL_StatusTypeDef  SPIx_TransferDMA(uint8_t *pTxData, uint8_t *pRxData, uint16_t Size);
+static HAL_StatusTypeDef  SPIx_StartDMA(uint8_t *pTxData, uint8_t *pRxData, uint16_t Size);
+static void               SPIx_DMARxCplt(DMA_HandleTypeDef *hdma);
+static void               SPIx_DMAError(DMA_HandleTypeDef *hdma);
+static void               SPIx_DMAEnd(HAL_StatusTypeDef Status);
+static void               SPIx_DMAStop(DMA_HandleTypeDef *hdma);
     
 /* Link function for LCD peripheral over SPI */
 void                      LCD_IO_Init(void);
@@ -275,6 +297,15 @@ HAL_StatusTypeDef         SD_IO_WaitResponse(uint8_t Response);
 void                      SD_IO_WriteDummy(void);
 void                      SD_IO_WriteByte(uint8_t Data);
 uint8_t                   SD_IO_ReadByte(void);
+HAL_StatusTypeDef         SD_IO_WriteBlock(const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef         SD_IO_ReadBlock(uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef         SD_IO_WriteBlock_DMA(const uint8_t *pData, uint16_t Size);
+void                      SD_IO_WriteBlockCpltCallback(HAL_StatusTypeDef Status);
+void                      SD_IO_BusyPollStart(void);
+void                      SD_IO_BusyPollStop(void);
+void                      SD_IO_BusyPollCallback(void);
+void                      BSP_SD_BusyPoll_IRQHandler(void);
+static void               SD_IO_BusyPollInit(void);
 #endif /* HAL_SPI_MODULE_ENABLED */
 
 /**
@@ -788,6 +819,44 @@ static void SPIx_MspInit(SPI_HandleTypeDef *hspi)
   /*** Configure the SPI peripheral ***/ 
   /* Enable SPI clock */
   EVAL_SPIx_CLK_ENABLE();
+
+  /*** Configure the DMA channels used for block transfers ***/
+  EVAL_SPIx_DMA_CLK_ENABLE();
+
+  heval_SpiDmaTx.Instance                 = EVAL_SPIx_TX_DMA_CHANNEL;
+  heval_SpiDmaTx.Init.Direction           = DMA_MEMORY_TO_PERIPH;
+  heval_SpiDmaTx.Init.PeriphInc           = DMA_PINC_DISABLE;
+  heval_SpiDmaTx.Init.MemInc              = DMA_MINC_ENABLE;
+  heval_SpiDmaTx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  heval_SpiDmaTx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+  heval_SpiDmaTx.Init.Mode                = DMA_NORMAL;
+  heval_SpiDmaTx.Init.Priority            = DMA_PRIORITY_MEDIUM;
+  HAL_DMA_DeInit(&heval_SpiDmaTx);
+  HAL_DMA_Init(&heval_SpiDmaTx);
+  __HAL_LINKDMA(hspi, hdmatx, heval_SpiDmaTx);
+
+  /* The receive channel has a higher priority so that no byte is lost */
+  heval_SpiDmaRx.Instance                 = EVAL_SPIx_RX_DMA_CHANNEL;
+  heval_SpiDmaRx.Init.Direction           = DMA_PERIPH_TO_MEMORY;
+  heval_SpiDmaRx.Init.PeriphInc           = DMA_PINC_DISABLE;
+  heval_SpiDmaRx.Init.MemInc              = DMA_MINC_ENABLE;
+  heval_SpiDmaRx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  heval_SpiDmaRx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+  heval_SpiDmaRx.Init.Mode                = DMA_NORMAL;
+  heval_SpiDmaRx.Init.Priority            = DMA_PRIORITY_HIGH;
+  HAL_DMA_DeInit(&heval_SpiDmaRx);
+  HAL_DMA_Init(&heval_SpiDmaRx);
+  __HAL_LINKDMA(hspi, hdmarx, heval_SpiDmaRx);
+
+  /* NVIC configuration for the DMA interrupts: the receive channel ends the
+     transfers, the transmit one only reports errors. Both share their
+     priority with the SD busy poll timer, so the completion of a block and
+     the start of the next one, chained from these interrupts, are never
+     preempted by another step of the same write */
+  HAL_NVIC_SetPriority(EVAL_SPIx_DMA_TX_IRQn, 0x0E, 0);
+  HAL_NVIC_EnableIRQ(EVAL_SPIx_DMA_TX_IRQn);
+  HAL_NVIC_SetPriority(EVAL_SPIx_DMA_RX_IRQn, 0x0E, 0);
+  HAL_NVIC_EnableIRQ(EVAL_SPIx_DMA_RX_IRQn);
 }
 
 /**
@@ -859,6 +928,171 @@ static void SPIx_Write(uint8_t Value)
   }
 }
 
+/**
+  * @brief  Exchanges a buffer with the device by DMA and waits for the end of
+  *         the transfer. The CPU is free while the bytes are being clocked.
+  * @param  pTxData: bytes to send
+  * @param  pRxData: buffer receiving the bytes clocked in
+  * @param  Size: number of bytes, at most EVAL_SPIx_DMA_MAX_SIZE
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SPIx_TransferDMA(uint8_t *pTxData, uint8_t *pRxData, uint16_t Size)
+{
+  HAL_StatusTypeDef status = HAL_OK;
+  uint32_t tickstart;
+
+  SpixDmaState = 0;
+  status = SPIx_StartDMA(pTxData, pRxData, Size);
+
+  if(status == HAL_OK)
+  {
+    /* Wait for the completion signalled by SPIx_DMAEnd() */
+    tickstart = HAL_GetTick();
+    while(SpixDmaState == 0)
+    {
+      if((HAL_GetTick() - tickstart) > SpixTimeout)
+      {
+        status = HAL_TIMEOUT;
+        break;
+      }
+    }
+    if(SpixDmaState != 1)
+    {
+      status = HAL_ERROR;
+    }
+  }
+
+  /* Check the communication status */
+  if(status != HAL_OK)
+  {
+    /* Abort the DMA and re-initialize the bus */
+    HAL_DMA_Abort(&heval_SpiDmaTx);
+    HAL_DMA_Abort(&heval_SpiDmaRx);
+    SPIx_Error();
+  }
+
+  return status;
+}
+
+/**
+  * @brief  Starts exchanging a buffer with the device by DMA.
+  * @note   The DMA channels are driven here rather than through
+  *         HAL_SPI_TransmitReceive_DMA(), so that the end of the transfer is
+  *         caught by the DMA callbacks of the BSP: the HAL_SPI_xxxCallback()
+  *         functions are left to the application.
+  * @param  pTxData: bytes to send
+  * @param  pRxData: buffer receiving the bytes clocked in
+  * @param  Size: number of bytes, at most EVAL_SPIx_DMA_MAX_SIZE
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SPIx_StartDMA(uint8_t *pTxData, uint8_t *pRxData, uint16_t Size)
+{
+  if(heval_Spi.State != HAL_SPI_STATE_READY)
+  {
+    return HAL_BUSY;
+  }
+
+  /* Byte transfers: no data packing, RXNE raised for each byte */
+  CLEAR_BIT(heval_Spi.Instance->CR2, SPI_CR2_LDMATX | SPI_CR2_LDMARX);
+  SET_BIT(heval_Spi.Instance->CR2, SPI_RXFIFO_THRESHOLD);
+
+  /* The transfer ends when the last byte is received: only the receive
+     channel interrupts on completion, the transmit one on errors only */
+  heval_SpiDmaRx.XferHalfCpltCallback = NULL;
+  heval_SpiDmaRx.XferCpltCallback = SPIx_DMARxCplt;
+  heval_SpiDmaRx.XferErrorCallback = SPIx_DMAError;
+  heval_SpiDmaTx.XferHalfCpltCallback = NULL;
+  heval_SpiDmaTx.XferCpltCallback = NULL;
+  heval_SpiDmaTx.XferErrorCallback = SPIx_DMAError;
+
+  SET_BIT(heval_Spi.Instance->CR2, SPI_CR2_RXDMAEN);
+  if(HAL_DMA_Start_IT(&heval_SpiDmaRx, (uint32_t)&heval_Spi.Instance->DR, (uint32_t)pRxData, Size) != HAL_OK)
+  {
+    CLEAR_BIT(heval_Spi.Instance->CR2, SPI_CR2_RXDMAEN);
+    return HAL_BUSY;
+  }
+  if(HAL_DMA_Start(&heval_SpiDmaTx, (uint32_t)pTxData, (uint32_t)&heval_Spi.Instance->DR, Size) != HAL_OK)
+  {
+    HAL_DMA_Abort(&heval_SpiDmaRx);
+    CLEAR_BIT(heval_Spi.Instance->CR2, SPI_CR2_RXDMAEN);
+    return HAL_BUSY;
+  }
+  __HAL_DMA_ENABLE_IT(&heval_SpiDmaTx, DMA_IT_TE);
+
+  /* The handle is kept busy so that the polled transfers are refused */
+  heval_Spi.State = HAL_SPI_STATE_BUSY_TX_RX;
+  __HAL_SPI_ENABLE(&heval_Spi);
+  SET_BIT(heval_Spi.Instance->CR2, SPI_CR2_TXDMAEN);
+
+  return HAL_OK;
+}
+
+/**
+  * @brief  Receive DMA transfer complete callback: every byte was clocked.
+  * @param  hdma: DMA handle
+  * @retval None
+  */
+static void SPIx_DMARxCplt(DMA_HandleTypeDef *hdma)
+{
+  CLEAR_BIT(heval_Spi.Instance->CR2, SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+
+  /* The last byte received was sent before, so the transmit channel is done
+     too: it is released here, before the completion may start the next
+     block, as it raises no interrupt of its own */
+  SPIx_DMAStop(&heval_SpiDmaTx);
+  heval_Spi.State = HAL_SPI_STATE_READY;
+  SPIx_DMAEnd(HAL_OK);
+}
+
+/**
+  * @brief  DMA transfer error callback, either channel.
+  * @param  hdma: DMA handle
+  * @retval None
+  */
+static void SPIx_DMAError(DMA_HandleTypeDef *hdma)
+{
+  CLEAR_BIT(heval_Spi.Instance->CR2, SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+  SPIx_DMAStop(&heval_SpiDmaTx);
+  SPIx_DMAStop(&heval_SpiDmaRx);
+  heval_Spi.ErrorCode |= HAL_SPI_ERROR_DMA;
+  heval_Spi.State = HAL_SPI_STATE_READY;
+  SPIx_DMAEnd(HAL_ERROR);
+}
+
+/**
+  * @brief  Stops a DMA channel of the bus and returns its handle to the ready
+  *         state, with no interrupt left pending.
+  * @param  hdma: DMA handle
+  * @retval None
+  */
+static void SPIx_DMAStop(DMA_HandleTypeDef *hdma)
+{
+  __HAL_DMA_DISABLE(hdma);
+  __HAL_DMA_DISABLE_IT(hdma, DMA_IT_TC | DMA_IT_HT | DMA_IT_TE);
+  __HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma) | __HAL_DMA_GET_HT_FLAG_INDEX(hdma)
+                       | __HAL_DMA_GET_TE_FLAG_INDEX(hdma));
+  hdma->State = HAL_DMA_STATE_READY;
+  __HAL_UNLOCK(hdma);
+}
+
+/**
+  * @brief  Reports the end of a DMA transfer to its initiator.
+  * @param  Status: HAL_OK when every byte was exchanged, HAL_ERROR otherwise
+  * @retval None
+  */
+static void SPIx_DMAEnd(HAL_StatusTypeDef Status)
+{
+  if(SpixDmaAsync != 0)
+  {
+    SpixDmaAsync = 0;
+    SD_IO_WriteBlockCpltCallback(Status);
+  }
+  else
+  {
+    SpixDmaState = (Status == HAL_OK) ? 1 : 2;
+  }
+}
+
 /**
   * @brief SPI error treatment function
   * @retval None
@@ -1021,7 +1255,7 @@ void LCD_Delay (uint32_t Delay)
 void SD_IO_Init(void)
 {
   GPIO_InitTypeDef  GPIO_InitStructureure;
-  uint8_t counter;
+  uint16_t counter;
 
   /* SD_CS_GPIO and SD_DETECT_GPIO Periph clock enable */
   SD_CS_GPIO_CLK_ENABLE();
@@ -1047,6 +1281,13 @@ void SD_IO_Init(void)
   /*------------Put SD in SPI mode--------------*/
   /* SD SPI Config */
   SPIx_Init();
+  SD_IO_BusyPollInit();
+  
+  /* Idle pattern sent while DMA receives a block */
+  for (counter = 0; counter < EVAL_SPIx_DMA_MAX_SIZE; counter++)
+  {
+    SpixDmaTxIdle[counter] = SD_DUMMY_BYTE;
+  }
   
   /* SD chip select high */
   SD_CS_HIGH();
@@ -1079,11 +1320,6 @@ uint8_t SD_IO_ReadByte(void)
 {
   uint8_t data = 0;
   
-  /* Change BaudRate Prescaler 4 for Read */
-  /* Mean SPI baudrate is set to 72/4 = 18 MHz */
-  heval_Spi.Instance->CR1 &= 0xFFC7;
-  heval_Spi.Instance->CR1 |= SPI_BAUDRATEPRESCALER_4;
-
   /* Get the received data */
   data = SPIx_Read();
 
@@ -1112,6 +1348,11 @@ HAL_StatusTypeDef SD_IO_WriteCmd(uint8_t Cmd, uint32_t Arg, uint8_t Crc, uint8_t
   frame[4] = (uint8_t)(Arg); /* Construct byte 5 */
   frame[5] = (Crc); /* Construct CRC: byte 6 */
   
+  /* Change BaudRate Prescaler 4 for the whole SD transaction */
+  /* Mean SPI baudrate is set to 72/4 = 18 MHz */
+  heval_Spi.Instance->CR1 &= 0xFFC7;
+  heval_Spi.Instance->CR1 |= SPI_BAUDRATEPRESCALER_4;
+
   /* SD chip select low */
   SD_CS_LOW();
     
@@ -1156,6 +1397,144 @@ HAL_StatusTypeDef SD_IO_WaitResponse(uint8_t Response)
   }
 }
 
+/**
+  * @brief  Sends a data block to the SD by DMA.
+  * @param  pData: bytes to send
+  * @param  Size: number of bytes, at most EVAL_SPIx_DMA_MAX_SIZE
+  * @retval HAL_StatusTypeDef HAL Status
+  */
+HAL_StatusTypeDef SD_IO_WriteBlock(const uint8_t *pData, uint16_t Size)
+{
+  return SPIx_TransferDMA((uint8_t *)pData, SpixDmaRxSink, Size);
+}
+
+/**
+  * @brief  Receives a data block from the SD by DMA.
+  * @param  pData: buffer receiving the data
+  * @param  Size: number of bytes, at most EVAL_SPIx_DMA_MAX_SIZE
+  * @retval HAL_StatusTypeDef HAL Status
+  */
+HAL_StatusTypeDef SD_IO_ReadBlock(uint8_t *pData, uint16_t Size)
+{
+  return SPIx_TransferDMA(SpixDmaTxIdle, pData, Size);
+}
+
+/**
+  * @brief  Starts sending a data block to the SD by DMA and returns at once.
+  *         The end of the transfer is reported, in interrupt context, through
+  *         SD_IO_WriteBlockCpltCallback().
+  * @param  pData: bytes to send, must stay valid until the callback
+  * @param  Size: number of bytes, at most EVAL_SPIx_DMA_MAX_SIZE
+  * @retval HAL_StatusTypeDef HAL Status
+  */
+HAL_StatusTypeDef SD_IO_WriteBlock_DMA(const uint8_t *pData, uint16_t Size)
+{
+  HAL_StatusTypeDef status;
+
+  SpixDmaAsync = 1;
+  status = SPIx_StartDMA((uint8_t *)pData, SpixDmaRxSink, Size);
+  if(status != HAL_OK)
+  {
+    SpixDmaAsync = 0;
+  }
+
+  return status;
+}
+
+/**
+  * @brief  End of an SD_IO_WriteBlock_DMA() transfer.
+  * @note   This function should not be modified, when the callback is needed,
+  *         the SD_IO_WriteBlockCpltCallback could be implemented in the SD driver.
+  * @param  Status: HAL_OK when the block was sent, HAL_ERROR otherwise
+  * @retval None
+  */
+__weak void SD_IO_WriteBlockCpltCallback(HAL_StatusTypeDef Status)
+{
+}
+
+/**
+  * @brief  Configures the SD busy poll timer, stopped.
+  * @retval None
+  */
+static void SD_IO_BusyPollInit(void)
+{
+  uint32_t clock;
+
+  if(heval_SdBusyTim.State != HAL_TIM_STATE_RESET)
+  {
+    return;
+  }
+
+  EVAL_SD_BUSY_TIM_CLK_ENABLE();
+
+  /* The timer clock is twice PCLK1 when APB1 is divided */
+  clock = HAL_RCC_GetPCLK1Freq();
+  if((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_HCLK_DIV1)
+  {
+    clock *= 2;
+  }
+
+  /* 1 MHz counter, one update every EVAL_SD_BUSY_POLL_US */
+  heval_SdBusyTim.Instance = EVAL_SD_BUSY_TIM;
+  heval_SdBusyTim.Init.Prescaler = (clock / 1000000) - 1;
+  heval_SdBusyTim.Init.Period = EVAL_SD_BUSY_POLL_US - 1;
+  heval_SdBusyTim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  heval_SdBusyTim.Init.CounterMode = TIM_COUNTERMODE_UP;
+  heval_SdBusyTim.Init.RepetitionCounter = 0;
+  HAL_TIM_Base_Init(&heval_SdBusyTim);
+
+  /* Same priority as the SPI DMA interrupts, the two never preempt each
+     other while driving an asynchronous write */
+  HAL_NVIC_SetPriority(EVAL_SD_BUSY_TIM_IRQn, 0x0E, 0);
+  HAL_NVIC_EnableIRQ(EVAL_SD_BUSY_TIM_IRQn);
+}
+
+/**
+  * @brief  Starts calling SD_IO_BusyPollCallback() every EVAL_SD_BUSY_POLL_US.
+  * @retval None
+  */
+void SD_IO_BusyPollStart(void)
+{
+  __HAL_TIM_SET_COUNTER(&heval_SdBusyTim, 0);
+  __HAL_TIM_CLEAR_IT(&heval_SdBusyTim, TIM_IT_UPDATE);
+  HAL_TIM_Base_Start_IT(&heval_SdBusyTim);
+}
+
+/**
+  * @brief  Stops the SD busy poll.
+  * @retval None
+  */
+void SD_IO_BusyPollStop(void)
+{
+  HAL_TIM_Base_Stop_IT(&heval_SdBusyTim);
+}
+
+/**
+  * @brief  Handles the SD busy poll timer interrupt, to be called from
+  *         EVAL_SD_BUSY_TIM_IRQHandler(). The update flag is handled here
+  *         rather than through HAL_TIM_IRQHandler(), so that
+  *         HAL_TIM_PeriodElapsedCallback() is left to the application.
+  * @retval None
+  */
+void BSP_SD_BusyPoll_IRQHandler(void)
+{
+  if(__HAL_TIM_GET_FLAG(&heval_SdBusyTim, TIM_FLAG_UPDATE))
+  {
+    __HAL_TIM_CLEAR_FLAG(&heval_SdBusyTim, TIM_FLAG_UPDATE);
+    SD_IO_BusyPollCallback();
+  }
+}
+
+/**
+  * @brief  SD busy poll, called from the timer interrupt while running.
+  * @note   This function should not be modified, when the callback is needed,
+  *         the SD_IO_BusyPollCallback could be implemented in the SD driver.
+  * @retval None
+  */
+__weak void SD_IO_BusyPollCallback(void)
+{
+}
+
 /**
   * @brief  Sends dummy byte with CS High
   * @retval None
@@ -338,6 +338,30 @@ typedef enum
 #define EVAL_SPIx_MISO_MOSI_GPIO_CLK_DISABLE()  __HAL_RCC_GPIOB_CLK_DISABLE()
 #define EVAL_SPIx_MISO_PIN                      GPIO_PIN_14
 #define EVAL_SPIx_MOSI_PIN                      GPIO_PIN_15
+
+/* Definition for SPIx's DMA, used for SD card block transfers */
+#define EVAL_SPIx_DMA_CLK_ENABLE()              __HAL_RCC_DMA1_CLK_ENABLE()
+#define EVAL_SPIx_TX_DMA_CHANNEL                DMA1_Channel5
+#define EVAL_SPIx_RX_DMA_CHANNEL                DMA1_Channel4
+
+/* Definition for SPIx's DMA NVIC */
+#define EVAL_SPIx_DMA_TX_IRQn                   DMA1_Channel5_IRQn
+#define EVAL_SPIx_DMA_TX_IRQHandler             DMA1_Channel5_IRQHandler
+#define EVAL_SPIx_DMA_RX_IRQn                   DMA1_Channel4_IRQn
+#define EVAL_SPIx_DMA_RX_IRQHandler             DMA1_Channel4_IRQHandler
+
+/* Largest block transferred by DMA (one SD block) */
+#define EVAL_SPIx_DMA_MAX_SIZE                  512
+
+/* Definition for the SD busy poll timer, only running while the card
+   programs a block of an asynchronous write */
+#define EVAL_SD_BUSY_TIM                        TIM7
+#define EVAL_SD_BUSY_TIM_CLK_ENABLE()           __HAL_RCC_TIM7_CLK_ENABLE()
+#define EVAL_SD_BUSY_TIM_IRQn                   TIM7_IRQn
+#define EVAL_SD_BUSY_TIM_IRQHandler             TIM7_IRQHandler
+
+/* Period of the SD busy poll in us */
+#define EVAL_SD_BUSY_POLL_US                    50
 /* Maximum Timeout values for flags waiting loops. These timeouts are not based
    on accurate values, they just guarantee that the application will not remain
    stuck if the SPI communication is corrupted.
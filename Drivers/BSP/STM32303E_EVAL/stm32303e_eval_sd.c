@@ -80,13 +80,28 @@
      o The micro SD card can be accessed with read/write block(s) operations once 
        it is reay for access. The access cand be performed in polling 
        mode by calling the functions SD_ReadBlocks()/SD_WriteBlocks()
+     o Blocks can also be written without waiting by BSP_SD_WriteBlocks_Async().
+       The data phase runs by DMA. The card is checked for busy as soon as it
+       has answered the block, and only while it is still programming is it
+       polled every EVAL_SD_BUSY_POLL_US from the busy poll timer interrupt.
+       The end of the write is reported by BSP_SD_WriteCpltCallback()
+       or BSP_SD_ErrorCallback() and can also be polled with
+       BSP_SD_GetTransferState(). The other SD functions wait for a running
+       asynchronous write to end before accessing the card.
      o The SD erase block(s) is performed using the function SD_Erase() with specifying
-       the number of blocks to erase.
+       the number of blocks to erase. The call returns once the card has
+       finished erasing.
+     o The allocation unit and erase parameters of the card are read from its
+       SD Status register with BSP_SD_GetSDStatus().
      o The SD runtime status is returned when calling the function SD_GetStatus().
+     o Every operation is timed with the DWT cycle counter. The latency
+       histograms of the command, data and busy phases, the longest stalls and
+       the transfer rates are returned by BSP_SD_GetStats().
  
 ------------------------------------------------------------------------------*/ 
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "stm32303e_eval_sd.h"
 
 /** @addtogroup BSP
@@ -107,6 +122,17 @@
   * @{
   */ 
 
+/**
+  * @brief  Phases of an asynchronous write
+  */
+typedef enum
+{
+  SD_ASYNC_IDLE = 0,   /* No asynchronous write running */
+  SD_ASYNC_DATA,       /* Block data phase running by DMA */
+  SD_ASYNC_BUSY,       /* Card programming a block */
+  SD_ASYNC_STOP        /* Card programming after the stop token */
+}SD_AsyncState;
+
 /**
   * @}
   */
@@ -118,6 +144,20 @@
   */
 #define SD_DUMMY_BYTE   0xFF
 #define SD_NO_RESPONSE_EXPECTED 0x80
+
+/* Longest card programming time accepted by an asynchronous write, in ms */
+#define SD_ASYNC_BUSY_TIMEOUT   500
+
+/* Bytes read for the data response of an asynchronous write. The response
+   follows the CRC at once, a few more bytes cover a late card */
+#define SD_ASYNC_RESPONSE_BYTES 4
+
+/* Longest card initialization (ACMD41/CMD1 loop) accepted, in ms */
+#define SD_INIT_TIMEOUT         1000
+
+/* Longest erase accepted, in ms. The card reports its own erase timing in
+   the SD Status register; callers erasing large areas should split them */
+#define SD_ERASE_TIMEOUT        30000
 /**
   * @}
   */
@@ -127,6 +167,8 @@
 /** @defgroup Private_Macros Private_Macros
   * @{
   */  
+/* Start of a timed period, in core clock cycles */
+#define SD_STATS_NOW()          (DWT->CYCCNT)
 
 /**
   * @}
@@ -139,6 +181,35 @@
   */       
 __IO uint8_t SdStatus = SD_PRESENT;
 
+/* Allocation unit sizes of the AU_SIZE codes of the SD Status, in KByte */
+static const uint32_t SdAUSizeKB[16] =
+{
+  0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536
+};
+
+/* Block length last set with CMD16, 0 when unknown */
+static uint16_t SdBlockLen = 0;
+
+/* Type of the initialized card, selects byte or block addressing */
+static uint8_t SdCardType = SD_CARD_SDSC_V1;
+
+/* Timing statistics */
+static SD_Stats SdStats;
+static uint32_t SdCyclesPerUs = 1;
+
+/* Asynchronous write context */
+static __IO SD_AsyncState SdAsyncState = SD_ASYNC_IDLE;
+static __IO uint8_t SdAsyncStatus = SD_TRANSFER_OK;
+static uint8_t SdAsyncResult;        /* Result reported once the card is released */
+static uint8_t SdAsyncMulti;         /* Write started with CMD25 */
+static uint8_t *pSdAsyncData;        /* Next block to send */
+static uint32_t SdAsyncBlocks;       /* Blocks still to send */
+static uint32_t SdAsyncBlocksTotal;  /* Blocks of the whole write */
+static uint16_t SdAsyncBlockSize;
+static uint32_t SdAsyncTickStart;    /* Start of the current busy period */
+static uint32_t SdAsyncPhaseStart;   /* Cycle count at the start of the current phase */
+static uint32_t SdAsyncOpStart;      /* Cycle count at the start of the write */
+
 /**
   * @}
   */ 
@@ -147,8 +218,29 @@ __IO uint8_t SdStatus = SD_PRESENT;
 static uint8_t SD_GetCIDRegister(SD_CID* Cid);
 static uint8_t SD_GetCSDRegister(SD_CSD* Csd);
 static SD_Info SD_GetDataResponse(void);
+static SD_Info SD_GetDataToken(void);
+static void SD_WaitTransferEnd(void);
+static SD_Info SD_AsyncGetDataToken(void);
+static uint8_t SD_AsyncSendBlock(void);
+static void SD_AsyncBusy(SD_AsyncState State);
+static void SD_AsyncBusyEnd(void);
+static void SD_AsyncStop(uint8_t Status);
+static void SD_AsyncComplete(void);
+static uint8_t SD_WriteMultiBlocks(uint8_t *pData, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
+static uint8_t SD_ReadMultiBlocks(uint8_t *pData, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
 static uint8_t SD_GoIdleState(void);
 static uint8_t SD_SendCmd(uint8_t Cmd, uint32_t Arg, uint8_t Crc, uint8_t Response);
+static uint8_t SD_SendCmdR1(uint8_t Cmd, uint32_t Arg, uint8_t Crc);
+static uint32_t SD_GetCardAddress(uint64_t Addr);
+static uint8_t SD_ReadBlocks(uint8_t *pData, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
+static uint8_t SD_WriteBlocks(uint8_t *pData, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
+static HAL_StatusTypeDef SD_SendDataCmd(uint8_t Cmd, uint64_t Addr);
+static HAL_StatusTypeDef SD_WaitDataToken(uint8_t Token);
+static HAL_StatusTypeDef SD_ReadData(uint8_t *pData, uint16_t Size);
+static HAL_StatusTypeDef SD_WriteData(const uint8_t *pData, uint16_t Size);
+static void SD_WaitNotBusy(void);
+static void SD_StatsInit(void);
+static uint32_t SD_StatsRecord(SD_PhaseStats *pPhase, uint32_t Start);
 
 /** @defgroup Private_Function_Prototypes Private_Function_Prototypes
   * @{
@@ -185,6 +277,12 @@ uint8_t BSP_SD_Init(void)
     SdStatus = SD_PRESENT;
   }
   
+  /* A newly inserted card starts with its default block length */
+  SdBlockLen = 0;
+  
+  /* Start the cycle counter used to time the operations */
+  SD_StatsInit();
+  
   /* SD initialized and set to SPI mode properly */
   return (SD_GoIdleState());
 }
@@ -218,19 +316,93 @@ uint8_t BSP_SD_GetCardInfo(SD_CardInfo *pCardInfo)
 {
   uint8_t status = MSD_ERROR;
 
+  SD_WaitTransferEnd();
+  
   SD_GetCSDRegister(&(pCardInfo->Csd));
   status = SD_GetCIDRegister(&(pCardInfo->Cid));
-  pCardInfo->CardCapacity = (pCardInfo->Csd.DeviceSize + 1) ;
-  pCardInfo->CardCapacity *= (1 << (pCardInfo->Csd.DeviceSizeMul + 2));
-  pCardInfo->CardBlockSize = 1 << (pCardInfo->Csd.RdBlockLen);
-  pCardInfo->CardCapacity *= pCardInfo->CardBlockSize;
+  if (pCardInfo->Csd.CSDStruct == 1)
+  {
+    /* CSD Version 2.0: capacity = (C_SIZE + 1) * 512 KByte */
+    pCardInfo->CardCapacity = (uint64_t)(pCardInfo->Csd.DeviceSize + 1) * 512 * 1024;
+    pCardInfo->CardBlockSize = 512;
+  }
+  else
+  {
+    pCardInfo->CardCapacity = (pCardInfo->Csd.DeviceSize + 1) ;
+    pCardInfo->CardCapacity *= (1 << (pCardInfo->Csd.DeviceSizeMul + 2));
+    pCardInfo->CardBlockSize = 1 << (pCardInfo->Csd.RdBlockLen);
+    pCardInfo->CardCapacity *= pCardInfo->CardBlockSize;
+  }
+  pCardInfo->CardType = SdCardType;
 
   /* Returns the reponse */
   return status;
 }
 
+/**
+  * @brief  Reads the SD Status register of the card (ACMD13).
+  * @note   Ver1.x cards and MMC may not support it.
+  * @param  pStatus: pointer to a SD_Status structure receiving the decoded
+  *         register
+  * @retval The SD Response:
+  *         - MSD_ERROR : Sequence failed
+  *         - MSD_OK    : Sequence succeed
+  */
+uint8_t BSP_SD_GetSDStatus(SD_Status *pStatus)
+{
+  uint8_t rvalue = MSD_ERROR;
+  uint8_t response, counter;
+  uint8_t reg[64];
+
+  SD_WaitTransferEnd();
+
+  /* Send CMD55 (APP_CMD) then CMD13 (SD_STATUS): R2 response, then the
+     512-bit register as a data block */
+  response = SD_SendCmdR1(SD_CMD_APP_CMD, 0, 0xFF);
+  SD_IO_WriteDummy();
+  if (response == SD_RESPONSE_NO_ERROR)
+  {
+    response = SD_SendCmdR1(SD_ACMD_SD_STATUS, 0, 0xFF);
+    /* Second byte of the R2 response */
+    SD_IO_ReadByte();
+    if ((response == SD_RESPONSE_NO_ERROR) && (SD_IO_WaitResponse(SD_START_DATA_SINGLE_BLOCK_READ) == HAL_OK))
+    {
+      for (counter = 0; counter < 64; counter++)
+      {
+        reg[counter] = SD_IO_ReadByte();
+      }
+      
+      /* Get CRC bytes (not really needed by us, but required by SD) */
+      SD_IO_WriteByte(SD_DUMMY_BYTE);
+      SD_IO_WriteByte(SD_DUMMY_BYTE);
+      
+      rvalue = MSD_OK;
+    }
+  }
+  /* Send dummy byte: 8 Clock pulses of delay */
+  SD_IO_WriteDummy();
+
+  if (rvalue == MSD_OK)
+  {
+    pStatus->BusWidth = reg[0] >> 6;
+    pStatus->SecuredMode = (reg[0] >> 5) & 0x01;
+    pStatus->CardType = ((uint16_t)reg[2] << 8) | reg[3];
+    pStatus->ProtectedAreaSize = ((uint32_t)reg[4] << 24) | ((uint32_t)reg[5] << 16) | ((uint32_t)reg[6] << 8) | reg[7];
+    pStatus->SpeedClass = reg[8];
+    pStatus->PerformanceMove = reg[9];
+    pStatus->AUSize = reg[10] >> 4;
+    pStatus->AllocationUnit = SdAUSizeKB[pStatus->AUSize] * 1024;
+    pStatus->EraseSize = ((uint16_t)reg[11] << 8) | reg[12];
+    pStatus->EraseTimeout = reg[13] >> 2;
+    pStatus->EraseOffset = reg[13] & 0x03;
+  }
+
+  return rvalue;
+}
+
 /**
   * @brief  Reads block(s) from a specified address in an SD card, in polling mode. 
+  * @note   More than one block is read with CMD18 (READ_MULTIPLE_BLOCK).
   * @param  p32Data: Pointer to the buffer that will contain the data to transmit
   * @param  ReadAddr: Address from where data is to be read  
   * @param  BlockSize: SD card data block size, that should be 512
@@ -239,15 +411,54 @@ uint8_t BSP_SD_GetCardInfo(SD_CardInfo *pCardInfo)
   */
 uint8_t BSP_SD_ReadBlocks(uint32_t* p32Data, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
 {
-  uint32_t counter = 0, offset = 0;
+  uint32_t start;
+  uint8_t rvalue;
+  
+  /* Let a running asynchronous write end first */
+  SD_WaitTransferEnd();
+  
+  start = SD_STATS_NOW();
+  rvalue = SD_ReadBlocks((uint8_t *)p32Data, ReadAddr, BlockSize, NumberOfBlocks);
+  SD_StatsRecord(&SdStats.Read, start);
+  if (rvalue == MSD_OK)
+  {
+    SdStats.BytesRead += (uint64_t)BlockSize * NumberOfBlocks;
+  }
+  
+  return rvalue;
+}
+
+/**
+  * @brief  Reads block(s), see BSP_SD_ReadBlocks().
+  * @param  pData: Pointer to the buffer that will contain the data to transmit
+  * @param  ReadAddr: Address from where data is to be read  
+  * @param  BlockSize: SD card data block size, that should be 512
+  * @param  NumberOfBlocks: Number of SD blocks to read 
+  * @retval SD status
+  */
+static uint8_t SD_ReadBlocks(uint8_t *pData, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
+{
+  uint32_t offset = 0;
   uint8_t rvalue = MSD_ERROR;
-  uint8_t *pData = (uint8_t *)p32Data;
   
   /* Send CMD16 (SD_CMD_SET_BLOCKLEN) to set the size of the block and 
-     Check if the SD acknowledged the set block length command: R1 response (0x00: no errors) */
-  if (SD_IO_WriteCmd(SD_CMD_SET_BLOCKLEN, BlockSize, 0xFF, SD_RESPONSE_NO_ERROR) != HAL_OK)
+     Check if the SD acknowledged the set block length command: R1 response (0x00: no errors).
+     The card keeps the block length, so it is only sent when it changes */
+  if (BlockSize != SdBlockLen)
   {
-    return MSD_ERROR;
+    if (SD_IO_WriteCmd(SD_CMD_SET_BLOCKLEN, BlockSize, 0xFF, SD_RESPONSE_NO_ERROR) != HAL_OK)
+    {
+      SD_IO_WriteDummy();
+      return MSD_ERROR;
+    }
+    SdBlockLen = BlockSize;
+  }
+  
+  /* Contiguous runs are read with one READ_MULTIPLE_BLOCK transaction */
+  if (NumberOfBlocks > 1)
+  {
+    SD_IO_WriteDummy();
+    return SD_ReadMultiBlocks(pData, ReadAddr, BlockSize, NumberOfBlocks);
   }
 
   /* Data transfer */
@@ -258,22 +469,21 @@ uint8_t BSP_SD_ReadBlocks(uint32_t* p32Data, uint64_t ReadAddr, uint16_t BlockSi
 
     /* Send CMD17 (SD_CMD_READ_SINGLE_BLOCK) to read one block */
     /* Check if the SD acknowledged the read block command: R1 response (0x00: no errors) */
-    if (SD_IO_WriteCmd(SD_CMD_READ_SINGLE_BLOCK, ReadAddr + offset, 0xFF, SD_RESPONSE_NO_ERROR) != HAL_OK)
+    if (SD_SendDataCmd(SD_CMD_READ_SINGLE_BLOCK, ReadAddr + offset) != HAL_OK)
     {
       return MSD_ERROR;
     }
 
     /* Now look for the data token to signify the start of the data */
-    if (SD_IO_WaitResponse(SD_START_DATA_SINGLE_BLOCK_READ) == HAL_OK)
+    if (SD_WaitDataToken(SD_START_DATA_SINGLE_BLOCK_READ) == HAL_OK)
     {
-      /* Read the SD block data : read NumByteToRead data */
-      for (counter = 0; counter < BlockSize; counter++)
+      /* Read the SD block data by DMA */
+      if (SD_ReadData(pData, BlockSize) != HAL_OK)
       {
-        /* Read the pointed data */
-        *pData = SD_IO_ReadByte();
-        /* Point to the next location where the byte read will be saved */
-        pData++;
+        SD_IO_WriteDummy();
+        return MSD_ERROR;
       }
+      pData += BlockSize;
       /* Set next read address*/
       offset += BlockSize;
       /* get CRC bytes (not really needed by us, but required by SD) */
@@ -295,8 +505,71 @@ uint8_t BSP_SD_ReadBlocks(uint32_t* p32Data, uint64_t ReadAddr, uint16_t BlockSi
   return rvalue;
 }
 
+/**
+  * @brief  Reads consecutive blocks with a single READ_MULTIPLE_BLOCK command.
+  *         The card streams the blocks, each behind a start token, until it
+  *         is stopped with STOP_TRANSMISSION (CMD12).
+  * @param  pData: Pointer to the buffer that will contain the data read
+  * @param  ReadAddr: Address from where data is to be read  
+  * @param  BlockSize: SD card data block size, that should be 512
+  * @param  NumberOfBlocks: Number of SD blocks to read 
+  * @retval SD status
+  */
+static uint8_t SD_ReadMultiBlocks(uint8_t *pData, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
+{
+  uint8_t rvalue = MSD_OK;
+  
+  /* Send CMD18 (SD_CMD_READ_MULT_BLOCK) to read blocks and
+     Check if the SD acknowledged the read block command: R1 response (0x00: no errors) */
+  if (SD_SendDataCmd(SD_CMD_READ_MULT_BLOCK, ReadAddr) != HAL_OK)
+  {
+    SD_IO_WriteDummy();
+    return MSD_ERROR;
+  }
+  
+  /* Data transfer */
+  while ((NumberOfBlocks--) && (rvalue == MSD_OK))
+  {
+    /* Now look for the data token to signify the start of the data */
+    if (SD_WaitDataToken(SD_START_DATA_MULTIPLE_BLOCK_READ) == HAL_OK)
+    {
+      /* Read the SD block data by DMA */
+      if (SD_ReadData(pData, BlockSize) != HAL_OK)
+      {
+        rvalue = MSD_ERROR;
+      }
+      pData += BlockSize;
+      /* get CRC bytes (not really needed by us, but required by SD) */
+      SD_IO_ReadByte();
+      SD_IO_ReadByte();
+    }
+    else
+    {
+      /* Set response value to failure */
+      rvalue = MSD_ERROR;
+    }
+  }
+  
+  /* Send CMD12 (SD_CMD_STOP_TRANSMISSION) to end the transfer. The card
+     answers after one stuff byte and may then hold the line busy */
+  SD_IO_WriteCmd(SD_CMD_STOP_TRANSMISSION, 0, 0xFF, SD_NO_RESPONSE_EXPECTED);
+  SD_IO_ReadByte();
+  if (SD_IO_WaitResponse(SD_RESPONSE_NO_ERROR) != HAL_OK)
+  {
+    rvalue = MSD_ERROR;
+  }
+  SD_WaitNotBusy();
+  
+  /* Send dummy byte: 8 Clock pulses of delay */
+  SD_IO_WriteDummy();
+  
+  /* Returns the reponse */
+  return rvalue;
+}
+
 /**
   * @brief  Writes block(s) to a specified address in an SD card, in polling mode. 
+  * @note   More than one block is written with CMD25 (WRITE_MULTIPLE_BLOCK).
   * @param  p32Data: Pointer to the buffer that will contain the data to transmit
   * @param  WriteAddr: Address from where data is to be written  
   * @param  BlockSize: SD card data block size, that should be 512
@@ -305,16 +578,48 @@ uint8_t BSP_SD_ReadBlocks(uint32_t* p32Data, uint64_t ReadAddr, uint16_t BlockSi
   */
 uint8_t BSP_SD_WriteBlocks(uint32_t* p32Data, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
 {
-  uint32_t counter = 0, offset = 0;
+  uint32_t start;
+  uint8_t rvalue;
+  
+  /* Let a running asynchronous write end first */
+  SD_WaitTransferEnd();
+  
+  start = SD_STATS_NOW();
+  rvalue = SD_WriteBlocks((uint8_t *)p32Data, WriteAddr, BlockSize, NumberOfBlocks);
+  SD_StatsRecord(&SdStats.Write, start);
+  if (rvalue == MSD_OK)
+  {
+    SdStats.BytesWritten += (uint64_t)BlockSize * NumberOfBlocks;
+  }
+  
+  return rvalue;
+}
+
+/**
+  * @brief  Writes block(s), see BSP_SD_WriteBlocks().
+  * @param  pData: Pointer to the buffer that will contain the data to transmit
+  * @param  WriteAddr: Address from where data is to be written  
+  * @param  BlockSize: SD card data block size, that should be 512
+  * @param  NumberOfBlocks: Number of SD blocks to write
+  * @retval SD status
+  */
+static uint8_t SD_WriteBlocks(uint8_t *pData, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
+{
+  uint32_t offset = 0;
   uint8_t rvalue = MSD_ERROR;
-  uint8_t *pData = (uint8_t *)p32Data;
+  
+  /* Contiguous runs are sent as one WRITE_MULTIPLE_BLOCK transaction */
+  if (NumberOfBlocks > 1)
+  {
+    return SD_WriteMultiBlocks(pData, WriteAddr, BlockSize, NumberOfBlocks);
+  }
   
   /* Data transfer */
   while (NumberOfBlocks--)
   {
     /* Send CMD24 (SD_CMD_WRITE_SINGLE_BLOCK) to write blocks  and
        Check if the SD acknowledged the write block command: R1 response (0x00: no errors) */
-    if (SD_IO_WriteCmd(SD_CMD_WRITE_SINGLE_BLOCK, WriteAddr + offset, 0xFF, SD_RESPONSE_NO_ERROR) != HAL_OK)
+    if (SD_SendDataCmd(SD_CMD_WRITE_SINGLE_BLOCK, WriteAddr + offset) != HAL_OK)
     {
       return MSD_ERROR;
     }
@@ -325,15 +630,13 @@ uint8_t BSP_SD_WriteBlocks(uint32_t* p32Data, uint64_t WriteAddr, uint16_t Block
     /* Send the data token to signify the start of the data */
     SD_IO_WriteByte(SD_START_DATA_SINGLE_BLOCK_WRITE);
 
-    /* Write the block data to SD : write count data by block */
-    for (counter = 0; counter < BlockSize; counter++)
+    /* Write the block data to SD by DMA */
+    if (SD_WriteData(pData, BlockSize) != HAL_OK)
     {
-      /* Send the pointed byte */
-      SD_IO_WriteByte(*pData);
-      
-      /* Point to the next location where the byte read will be saved */
-      pData++;
+      SD_IO_WriteDummy();
+      return MSD_ERROR;
     }
+    pData += BlockSize;
 
     /* Set next write address */
     offset += BlockSize;
@@ -362,6 +665,403 @@ uint8_t BSP_SD_WriteBlocks(uint32_t* p32Data, uint64_t WriteAddr, uint16_t Block
   return rvalue;
 }
 
+/**
+  * @brief  Writes consecutive blocks with a single WRITE_MULTIPLE_BLOCK command.
+  *         The card is told the block count beforehand (ACMD23) so it can
+  *         pre-erase the area, then each block is sent behind a multiple
+  *         block start token and the transfer is ended with a stop token.
+  * @param  pData: Pointer to the buffer that will contain the data to transmit
+  * @param  WriteAddr: Address from where data is to be written  
+  * @param  BlockSize: SD card data block size, that should be 512
+  * @param  NumberOfBlocks: Number of SD blocks to write
+  * @retval SD status
+  */
+static uint8_t SD_WriteMultiBlocks(uint8_t *pData, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
+{
+  uint8_t rvalue = MSD_OK;
+  
+  /* Send ACMD23 (SD_ACMD_SET_WR_BLK_ERASE_COUNT) to let the card pre-erase the
+     blocks to be written. This is only a performance hint: a card rejecting
+     it is still written correctly */
+  if (SD_SendCmd(SD_CMD_APP_CMD, 0, 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
+  {
+    SD_SendCmd(SD_ACMD_SET_WR_BLK_ERASE_COUNT, NumberOfBlocks, 0xFF, SD_RESPONSE_NO_ERROR);
+  }
+  
+  /* Send CMD25 (SD_CMD_WRITE_MULT_BLOCK) to write blocks and
+     Check if the SD acknowledged the write block command: R1 response (0x00: no errors) */
+  if (SD_SendDataCmd(SD_CMD_WRITE_MULT_BLOCK, WriteAddr) != HAL_OK)
+  {
+    SD_IO_WriteDummy();
+    return MSD_ERROR;
+  }
+  
+  /* Data transfer */
+  while ((NumberOfBlocks--) && (rvalue == MSD_OK))
+  {
+    /* Send dummy byte */
+    SD_IO_WriteByte(SD_DUMMY_BYTE);
+    
+    /* Send the data token to signify the start of the data */
+    SD_IO_WriteByte(SD_START_DATA_MULTIPLE_BLOCK_WRITE);
+    
+    /* Write the block data to SD by DMA */
+    if (SD_WriteData(pData, BlockSize) != HAL_OK)
+    {
+      /* Set response value to failure, the stop token is still sent */
+      rvalue = MSD_ERROR;
+      break;
+    }
+    pData += BlockSize;
+    
+    /* Put CRC bytes (not really needed by us, but required by SD) */
+    SD_IO_ReadByte();
+    SD_IO_ReadByte();
+    
+    /* Read data response, the card is no longer busy once it returns */
+    if (SD_GetDataResponse() != SD_DATA_OK)
+    {
+      /* Set response value to failure */
+      rvalue = MSD_ERROR;
+    }
+  }
+  
+  /* Send the stop token to end the transfer, also after an error as the card
+     is still in receive-data state */
+  SD_IO_WriteByte(SD_STOP_DATA_MULTIPLE_BLOCK_WRITE);
+  
+  /* Skip the byte following the stop token, then wait while the card is busy
+     programming the last block */
+  SD_IO_ReadByte();
+  SD_WaitNotBusy();
+  
+  /* Send dummy byte: 8 Clock pulses of delay */
+  SD_IO_WriteDummy();
+  
+  /* Returns the reponse */
+  return rvalue;
+}
+
+/**
+  * @brief  Starts writing block(s) to a specified address in an SD card and
+  *         returns without waiting for the card.
+  * @note   The data phase runs by DMA and the programming busy time is polled
+  *         from the busy poll timer. The end of the write is reported by
+  *         BSP_SD_WriteCpltCallback() or BSP_SD_ErrorCallback(), from
+  *         interrupt context, and by BSP_SD_GetTransferState().
+  *         The buffer must not be modified before the write has ended.
+  * @param  p32Data: Pointer to the buffer that will contain the data to transmit
+  * @param  WriteAddr: Address from where data is to be written  
+  * @param  BlockSize: SD card data block size, that should be 512
+  * @param  NumberOfBlocks: Number of SD blocks to write
+  * @retval SD status: MSD_OK when the write has been started, MSD_ERROR when
+  *         a write is already running or the card rejected the command.
+  */
+uint8_t BSP_SD_WriteBlocks_Async(uint32_t* p32Data, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
+{
+  uint8_t cmd = SD_CMD_WRITE_SINGLE_BLOCK;
+  
+  if ((SdAsyncState != SD_ASYNC_IDLE) || (NumberOfBlocks == 0))
+  {
+    return MSD_ERROR;
+  }
+  
+  pSdAsyncData = (uint8_t *)p32Data;
+  SdAsyncBlocks = NumberOfBlocks;
+  SdAsyncBlocksTotal = NumberOfBlocks;
+  SdAsyncBlockSize = BlockSize;
+  SdAsyncMulti = (NumberOfBlocks > 1);
+  
+  if (SdAsyncMulti)
+  {
+    /* Pre-erase hint, see SD_WriteMultiBlocks() */
+    if (SD_SendCmd(SD_CMD_APP_CMD, 0, 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
+    {
+      SD_SendCmd(SD_ACMD_SET_WR_BLK_ERASE_COUNT, NumberOfBlocks, 0xFF, SD_RESPONSE_NO_ERROR);
+    }
+    cmd = SD_CMD_WRITE_MULT_BLOCK;
+  }
+  
+  /* Send CMD24 or CMD25 and Check if the SD acknowledged the write block
+     command: R1 response (0x00: no errors) */
+  if (SD_SendDataCmd(cmd, WriteAddr) != HAL_OK)
+  {
+    SD_IO_WriteDummy();
+    return MSD_ERROR;
+  }
+  
+  /* From here on the result is reported through the callbacks */
+  SdAsyncOpStart = SD_STATS_NOW();
+  SdAsyncStatus = SD_TRANSFER_BUSY;
+  if (SD_AsyncSendBlock() != MSD_OK)
+  {
+    SD_AsyncStop(MSD_ERROR);
+  }
+  
+  return MSD_OK;
+}
+
+/**
+  * @brief  Returns the state of the asynchronous write.
+  * @retval SD_TRANSFER_BUSY while a write is running, otherwise the result of
+  *         the last write: SD_TRANSFER_OK or SD_TRANSFER_ERROR.
+  */
+uint8_t BSP_SD_GetTransferState(void)
+{
+  return SdAsyncStatus;
+}
+
+/**
+  * @brief  Polls the card while it is busy programming an asynchronous write,
+  *         called from the busy poll timer interrupt.
+  * @retval None
+  */
+void SD_IO_BusyPollCallback(void)
+{
+  if ((SdAsyncState != SD_ASYNC_BUSY) && (SdAsyncState != SD_ASYNC_STOP))
+  {
+    SD_IO_BusyPollStop();
+    return;
+  }
+  
+  /* The card holds MISO low while it programs */
+  if (SD_IO_ReadByte() != 0)
+  {
+    SD_IO_BusyPollStop();
+    SD_AsyncBusyEnd();
+  }
+  else if ((HAL_GetTick() - SdAsyncTickStart) > SD_ASYNC_BUSY_TIMEOUT)
+  {
+    SD_IO_BusyPollStop();
+    if (SdAsyncState == SD_ASYNC_STOP)
+    {
+      SdAsyncResult = MSD_ERROR;
+      SD_AsyncComplete();
+    }
+    else
+    {
+      SD_AsyncStop(MSD_ERROR);
+    }
+  }
+}
+
+/**
+  * @brief  End of the DMA data phase of an asynchronous write, called from
+  *         the SPI DMA interrupt.
+  * @param  Status: HAL_OK when the block was sent
+  * @retval None
+  */
+void SD_IO_WriteBlockCpltCallback(HAL_StatusTypeDef Status)
+{
+  if (SdAsyncState != SD_ASYNC_DATA)
+  {
+    return;
+  }
+  
+  if (Status != HAL_OK)
+  {
+    SD_AsyncStop(MSD_ERROR);
+    return;
+  }
+  
+  SD_StatsRecord(&SdStats.Data, SdAsyncPhaseStart);
+  pSdAsyncData += SdAsyncBlockSize;
+  SdAsyncBlocks--;
+  
+  /* Put CRC bytes (not really needed by us, but required by SD) */
+  SD_IO_ReadByte();
+  SD_IO_ReadByte();
+  
+  /* Read the data response, then wait for the end of the programming */
+  if (SD_AsyncGetDataToken() != SD_DATA_OK)
+  {
+    SD_AsyncStop(MSD_ERROR);
+    return;
+  }
+  
+  SD_AsyncBusy(SD_ASYNC_BUSY);
+}
+
+/**
+  * @brief  Asynchronous write completed callback.
+  * @note   This function should not be modified, when the callback is needed,
+  *         the BSP_SD_WriteCpltCallback could be implemented in the user file.
+  * @retval None
+  */
+__weak void BSP_SD_WriteCpltCallback(void)
+{
+}
+
+/**
+  * @brief  Asynchronous write error callback.
+  * @note   This function should not be modified, when the callback is needed,
+  *         the BSP_SD_ErrorCallback could be implemented in the user file.
+  * @retval None
+  */
+__weak void BSP_SD_ErrorCallback(void)
+{
+}
+
+/**
+  * @brief  Reads the data response token of an asynchronous write. Runs in
+  *         interrupt context, so only a few bytes are read.
+  * @retval The SD status, see SD_GetDataResponse()
+  */
+static SD_Info SD_AsyncGetDataToken(void)
+{
+  uint32_t counter;
+  uint8_t response;
+  
+  for (counter = 0; counter < SD_ASYNC_RESPONSE_BYTES; counter++)
+  {
+    /* A response token reads xxx0sss1, the bus idles high */
+    response = SD_IO_ReadByte();
+    if ((response & 0x11) == 0x01)
+    {
+      return (SD_Info)(response & 0x1F);
+    }
+  }
+  
+  return SD_DATA_OTHER_ERROR;
+}
+
+/**
+  * @brief  Sends the start token of the next block of an asynchronous write
+  *         and starts its data phase by DMA.
+  * @retval SD status
+  */
+static uint8_t SD_AsyncSendBlock(void)
+{
+  /* Send dummy byte */
+  SD_IO_WriteByte(SD_DUMMY_BYTE);
+  
+  /* Send the data token to signify the start of the data */
+  SD_IO_WriteByte(SdAsyncMulti ? SD_START_DATA_MULTIPLE_BLOCK_WRITE : SD_START_DATA_SINGLE_BLOCK_WRITE);
+  
+  /* The state is set first as the DMA may complete before the call returns */
+  SdAsyncPhaseStart = SD_STATS_NOW();
+  SdAsyncState = SD_ASYNC_DATA;
+  if (SD_IO_WriteBlock_DMA(pSdAsyncData, SdAsyncBlockSize) != HAL_OK)
+  {
+    return MSD_ERROR;
+  }
+  
+  return MSD_OK;
+}
+
+/**
+  * @brief  Enters a busy phase of an asynchronous write. The card is checked
+  *         right away, as it has often finished programming by the time
+  *         its response has been read; otherwise it is polled by the timer.
+  * @param  State: SD_ASYNC_BUSY after a block, SD_ASYNC_STOP after the stop
+  *         token
+  * @retval None
+  */
+static void SD_AsyncBusy(SD_AsyncState State)
+{
+  SdAsyncTickStart = HAL_GetTick();
+  SdAsyncPhaseStart = SD_STATS_NOW();
+  SdAsyncState = State;
+  
+  if (SD_IO_ReadByte() != 0)
+  {
+    SD_AsyncBusyEnd();
+  }
+  else
+  {
+    SD_IO_BusyPollStart();
+  }
+}
+
+/**
+  * @brief  Card released after a busy phase: sends the next block, the stop
+  *         token, or ends the write.
+  * @retval None
+  */
+static void SD_AsyncBusyEnd(void)
+{
+  SD_StatsRecord(&SdStats.Busy, SdAsyncPhaseStart);
+  
+  if (SdAsyncState == SD_ASYNC_STOP)
+  {
+    SD_AsyncComplete();
+  }
+  else if (SdAsyncBlocks != 0)
+  {
+    if (SD_AsyncSendBlock() != MSD_OK)
+    {
+      SD_AsyncStop(MSD_ERROR);
+    }
+  }
+  else
+  {
+    SD_AsyncStop(MSD_OK);
+  }
+}
+
+/**
+  * @brief  Ends an asynchronous write. A multiple block write is first stopped
+  *         with the stop token and completes once the card is released.
+  * @param  Status: result of the write
+  * @retval None
+  */
+static void SD_AsyncStop(uint8_t Status)
+{
+  SdAsyncResult = Status;
+  
+  if (SdAsyncMulti)
+  {
+    /* Send the stop token and skip the byte following it */
+    SD_IO_WriteByte(SD_STOP_DATA_MULTIPLE_BLOCK_WRITE);
+    SD_IO_ReadByte();
+    
+    SD_AsyncBusy(SD_ASYNC_STOP);
+  }
+  else
+  {
+    SD_AsyncComplete();
+  }
+}
+
+/**
+  * @brief  Releases the card and reports the end of an asynchronous write.
+  * @retval None
+  */
+static void SD_AsyncComplete(void)
+{
+  /* Send dummy byte: 8 Clock pulses of delay */
+  SD_IO_WriteDummy();
+  
+  SD_StatsRecord(&SdStats.Write, SdAsyncOpStart);
+  
+  SdAsyncState = SD_ASYNC_IDLE;
+  if (SdAsyncResult == MSD_OK)
+  {
+    SdStats.BytesWritten += (uint64_t)SdAsyncBlockSize * SdAsyncBlocksTotal;
+    SdAsyncStatus = SD_TRANSFER_OK;
+    BSP_SD_WriteCpltCallback();
+  }
+  else
+  {
+    SdAsyncStatus = SD_TRANSFER_ERROR;
+    BSP_SD_ErrorCallback();
+  }
+}
+
+/**
+  * @brief  Waits for the end of a running asynchronous write.
+  * @note   Must not be called with an interrupt priority at or above the
+  *         SPI DMA and busy poll timer ones, which drive the write to its
+  *         end.
+  * @retval None
+  */
+static void SD_WaitTransferEnd(void)
+{
+  while (SdAsyncState != SD_ASYNC_IDLE)
+  {
+  }
+}
+
 /**
   * @brief  Read the CSD card register.
   *         Reading the contents of the CSD register in SPI mode is a simple 
@@ -427,23 +1127,45 @@ uint8_t SD_GetCSDRegister(SD_CSD* Csd)
     Csd->DSRImpl = (CSD_Tab[6] & 0x10) >> 4;
     Csd->Reserved2 = 0; /*!< Reserved */
 
-    Csd->DeviceSize = (CSD_Tab[6] & 0x03) << 10;
+    if (Csd->CSDStruct == 1)
+    {
+      /* CSD Version 2.0 (SDHC/SDXC): 22-bit C_SIZE in 512 KByte units, no
+         current or size multiplier fields */
+      /* Byte 7 */
+      Csd->DeviceSize = (CSD_Tab[7] & 0x3F) << 16;
+
+      /* Byte 8 */
+      Csd->DeviceSize |= (CSD_Tab[8] << 8);
+
+      /* Byte 9 */
+      Csd->DeviceSize |= CSD_Tab[9];
+
+      Csd->MaxRdCurrentVDDMin = 0;
+      Csd->MaxRdCurrentVDDMax = 0;
+      Csd->MaxWrCurrentVDDMin = 0;
+      Csd->MaxWrCurrentVDDMax = 0;
+      Csd->DeviceSizeMul = 0;
+    }
+    else
+    {
+      Csd->DeviceSize = (CSD_Tab[6] & 0x03) << 10;
 
-    /* Byte 7 */
-    Csd->DeviceSize |= (CSD_Tab[7]) << 2;
+      /* Byte 7 */
+      Csd->DeviceSize |= (CSD_Tab[7]) << 2;
 
-    /* Byte 8 */
-    Csd->DeviceSize |= (CSD_Tab[8] & 0xC0) >> 6;
+      /* Byte 8 */
+      Csd->DeviceSize |= (CSD_Tab[8] & 0xC0) >> 6;
 
-    Csd->MaxRdCurrentVDDMin = (CSD_Tab[8] & 0x38) >> 3;
-    Csd->MaxRdCurrentVDDMax = (CSD_Tab[8] & 0x07);
+      Csd->MaxRdCurrentVDDMin = (CSD_Tab[8] & 0x38) >> 3;
+      Csd->MaxRdCurrentVDDMax = (CSD_Tab[8] & 0x07);
 
-    /* Byte 9 */
-    Csd->MaxWrCurrentVDDMin = (CSD_Tab[9] & 0xE0) >> 5;
-    Csd->MaxWrCurrentVDDMax = (CSD_Tab[9] & 0x1C) >> 2;
-    Csd->DeviceSizeMul = (CSD_Tab[9] & 0x03) << 1;
-    /* Byte 10 */
-    Csd->DeviceSizeMul |= (CSD_Tab[10] & 0x80) >> 7;
+      /* Byte 9 */
+      Csd->MaxWrCurrentVDDMin = (CSD_Tab[9] & 0xE0) >> 5;
+      Csd->MaxWrCurrentVDDMax = (CSD_Tab[9] & 0x1C) >> 2;
+      Csd->DeviceSizeMul = (CSD_Tab[9] & 0x03) << 1;
+      /* Byte 10 */
+      Csd->DeviceSizeMul |= (CSD_Tab[10] & 0x80) >> 7;
+    }
       
     Csd->EraseGrSize = (CSD_Tab[10] & 0x40) >> 6;
     Csd->EraseGrMul = (CSD_Tab[10] & 0x3F) << 1;
@@ -604,6 +1326,24 @@ static uint8_t SD_SendCmd(uint8_t Cmd, uint32_t Arg, uint8_t Crc, uint8_t Respon
   *         - status 111: Data rejected due to other error.
   */
 static SD_Info SD_GetDataResponse(void)
+{
+  SD_Info response;
+
+  response = SD_GetDataToken();
+
+  /* Wait null data */
+  SD_WaitNotBusy();
+
+  /* Return response */
+  return response;
+}
+
+/**
+  * @brief  Reads the data response token sent after a data block, without
+  *         waiting for the end of the card programming.
+  * @retval The SD status, see SD_GetDataResponse()
+  */
+static SD_Info SD_GetDataToken(void)
 {
   uint32_t counter = 0;
   SD_Info response, rvalue;
@@ -638,9 +1378,6 @@ static SD_Info SD_GetDataResponse(void)
     counter++;
   }
 
-  /* Wait null data */
-  while (SD_IO_ReadByte() == 0);
-
   /* Return response */
   return response;
 }
@@ -655,11 +1392,22 @@ uint8_t BSP_SD_GetStatus(void)
 }
 
 /**
-  * @brief  Put SD in Idle state.
+  * @brief  Put SD in Idle state, then initializes it and detects its type.
+  * @note   Ver2.00 cards answer CMD8 and are initialized with ACMD41 and the
+  *         HCS bit; CMD58 then tells from the CCS bit whether the card is a
+  *         block addressed SDHC/SDXC card. Ver1.x cards are initialized with
+  *         ACMD41, or CMD1 when they do not support application commands.
   * @retval SD status
   */
 static uint8_t SD_GoIdleState(void)
 {
+  uint8_t response, counter;
+  uint8_t reg[4];
+  uint32_t hcs = 0;
+  uint32_t tickstart;
+  
+  SdCardType = SD_CARD_SDSC_V1;
+  
   /* Send CMD0 (SD_CMD_GO_IDLE_STATE) to put SD in SPI mode and 
      Wait for In Idle State Response (R1 Format) equal to 0x01 */
   if (SD_SendCmd(SD_CMD_GO_IDLE_STATE, 0, 0x95, SD_IN_IDLE_STATE) != MSD_OK)
@@ -668,36 +1416,322 @@ static uint8_t SD_GoIdleState(void)
     return MSD_ERROR;
   }
 
+  /* Send CMD8 (SD_CMD_SEND_IF_COND) with the supply voltage and a check
+     pattern. Only Ver2.00 or later cards know it and answer with R7 */
+  response = SD_SendCmdR1(SD_CMD_SEND_IF_COND, SD_CHECK_PATTERN, SD_CHECK_PATTERN_CRC);
+  if (response == SD_IN_IDLE_STATE)
+  {
+    for (counter = 0; counter < 4; counter++)
+    {
+      reg[counter] = SD_IO_ReadByte();
+    }
+    SD_IO_WriteDummy();
+    
+    /* The card must accept the voltage and echo the check pattern */
+    if (((reg[2] & 0x0F) != (uint8_t)(SD_CHECK_PATTERN >> 8)) || (reg[3] != (uint8_t)SD_CHECK_PATTERN))
+    {
+      return MSD_ERROR;
+    }
+    SdCardType = SD_CARD_SDSC_V2;
+    hcs = SD_OCR_HCS;
+  }
+  else
+  {
+    SD_IO_WriteDummy();
+  }
+
   /*----------Activates the card initialization process-----------*/
-  /* Send CMD1 (Activates the card process) until response equal to 0x0 and
-     Wait for no error Response (R1 Format) equal to 0x00 */
-  while (SD_SendCmd(SD_CMD_SEND_OP_COND, 0, 0xFF, SD_RESPONSE_NO_ERROR) != MSD_OK);
+  /* Send ACMD41 (SD_ACMD_SD_SEND_OP_COND) until the card leaves the idle
+     state: R1 response equal to 0x00 */
+  tickstart = HAL_GetTick();
+  do
+  {
+    response = SD_SendCmdR1(SD_CMD_APP_CMD, 0, 0xFF);
+    SD_IO_WriteDummy();
+    if (response > SD_IN_IDLE_STATE)
+    {
+      /* Application commands not supported */
+      break;
+    }
+    response = SD_SendCmdR1(SD_ACMD_SD_SEND_OP_COND, hcs, 0xFF);
+    SD_IO_WriteDummy();
+  }
+  while ((response == SD_IN_IDLE_STATE) && ((HAL_GetTick() - tickstart) < SD_INIT_TIMEOUT));
+  
+  if (response != SD_RESPONSE_NO_ERROR)
+  {
+    if (SdCardType != SD_CARD_SDSC_V1)
+    {
+      return MSD_ERROR;
+    }
+    
+    /* Send CMD1 (Activates the card process) until response equal to 0x0 and
+       Wait for no error Response (R1 Format) equal to 0x00 */
+    tickstart = HAL_GetTick();
+    while (SD_SendCmd(SD_CMD_SEND_OP_COND, 0, 0xFF, SD_RESPONSE_NO_ERROR) != MSD_OK)
+    {
+      if ((HAL_GetTick() - tickstart) >= SD_INIT_TIMEOUT)
+      {
+        return MSD_ERROR;
+      }
+    }
+  }
+  
+  if (SdCardType == SD_CARD_SDSC_V2)
+  {
+    /* Send CMD58 (SD_CMD_READ_OCR) and check the card capacity status */
+    response = SD_SendCmdR1(SD_CMD_READ_OCR, 0, 0xFF);
+    for (counter = 0; counter < 4; counter++)
+    {
+      reg[counter] = SD_IO_ReadByte();
+    }
+    SD_IO_WriteDummy();
+    
+    if (response != SD_RESPONSE_NO_ERROR)
+    {
+      return MSD_ERROR;
+    }
+    if (reg[0] & (uint8_t)(SD_OCR_CCS >> 24))
+    {
+      SdCardType = SD_CARD_SDHC;
+    }
+  }
   
   return MSD_OK;
 }
+
+/**
+  * @brief  Sends a command and returns its R1 response, for commands whose
+  *         response is not known in advance. The card stays selected so that
+  *         the rest of a longer response can be read.
+  * @param  Cmd: The user expected command to send to SD card.
+  * @param  Arg: The command argument.
+  * @param  Crc: The CRC.
+  * @retval R1 response, 0xFF when the card did not answer
+  */
+static uint8_t SD_SendCmdR1(uint8_t Cmd, uint32_t Arg, uint8_t Crc)
+{
+  uint8_t response;
+  uint32_t counter = 0;
+  
+  SD_IO_WriteCmd(Cmd, Arg, Crc, SD_NO_RESPONSE_EXPECTED);
+  
+  /* The R1 response comes within 8 bytes and has its MSB cleared */
+  do
+  {
+    response = SD_IO_ReadByte();
+  }
+  while ((response & 0x80) && (++counter < 8));
+  
+  return response;
+}
+
+/**
+  * @brief  Returns the SD driver timing statistics.
+  * @note   Durations are measured with the DWT cycle counter and reported in
+  *         microseconds. The Busy phase also counts the wait for the data of
+  *         a read, which is the card access time.
+  * @param  pStats: statistics output
+  * @retval None
+  */
+void BSP_SD_GetStats(SD_Stats *pStats)
+{
+  *pStats = SdStats;
+  
+  pStats->WriteRate = 0;
+  if (pStats->Write.TotalTime != 0)
+  {
+    pStats->WriteRate = (uint32_t)((pStats->BytesWritten * 1000000) / pStats->Write.TotalTime);
+  }
+  pStats->ReadRate = 0;
+  if (pStats->Read.TotalTime != 0)
+  {
+    pStats->ReadRate = (uint32_t)((pStats->BytesRead * 1000000) / pStats->Read.TotalTime);
+  }
+}
+
+/**
+  * @brief  Clears the SD driver timing statistics.
+  * @retval None
+  */
+void BSP_SD_ResetStats(void)
+{
+  memset(&SdStats, 0, sizeof(SdStats));
+}
+
+/**
+  * @brief  Enables the DWT cycle counter used to time the operations.
+  * @retval None
+  */
+static void SD_StatsInit(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  
+  SdCyclesPerUs = SystemCoreClock / 1000000;
+}
+
+/**
+  * @brief  Accounts a timed period in the statistics of a phase.
+  * @param  pPhase: phase statistics
+  * @param  Start: cycle count at the start of the period
+  * @retval Cycle count at the end of the period
+  */
+static uint32_t SD_StatsRecord(SD_PhaseStats *pPhase, uint32_t Start)
+{
+  uint32_t now = SD_STATS_NOW();
+  uint32_t time = (now - Start) / SdCyclesPerUs;
+  uint32_t bucket = 32 - __CLZ(time);
+  
+  if (bucket >= SD_STATS_BUCKETS)
+  {
+    bucket = SD_STATS_BUCKETS - 1;
+  }
+  
+  pPhase->Count++;
+  pPhase->TotalTime += time;
+  pPhase->Histogram[bucket]++;
+  if (time > pPhase->MaxTime)
+  {
+    pPhase->MaxTime = time;
+    pPhase->MaxTick = HAL_GetTick();
+  }
+  
+  return now;
+}
+
+/**
+  * @brief  Sends a read or write command, timed as the Cmd phase.
+  * @param  Cmd: read or write command
+  * @param  Addr: byte address of the first block
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SD_SendDataCmd(uint8_t Cmd, uint64_t Addr)
+{
+  uint32_t start = SD_STATS_NOW();
+  HAL_StatusTypeDef status;
+  
+  status = SD_IO_WriteCmd(Cmd, SD_GetCardAddress(Addr), 0xFF, SD_RESPONSE_NO_ERROR);
+  SD_StatsRecord(&SdStats.Cmd, start);
+  
+  return status;
+}
+
+/**
+  * @brief  Waits for the start token of a read block, timed as the Busy phase.
+  * @param  Token: expected start token
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SD_WaitDataToken(uint8_t Token)
+{
+  uint32_t start = SD_STATS_NOW();
+  HAL_StatusTypeDef status;
+  
+  status = SD_IO_WaitResponse(Token);
+  SD_StatsRecord(&SdStats.Busy, start);
+  
+  return status;
+}
+
+/**
+  * @brief  Receives a block, timed as the Data phase.
+  * @param  pData: buffer receiving the data
+  * @param  Size: block size
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SD_ReadData(uint8_t *pData, uint16_t Size)
+{
+  uint32_t start = SD_STATS_NOW();
+  HAL_StatusTypeDef status;
+  
+  status = SD_IO_ReadBlock(pData, Size);
+  SD_StatsRecord(&SdStats.Data, start);
+  
+  return status;
+}
+
+/**
+  * @brief  Sends a block, timed as the Data phase.
+  * @param  pData: data to send
+  * @param  Size: block size
+  * @retval HAL status
+  */
+static HAL_StatusTypeDef SD_WriteData(const uint8_t *pData, uint16_t Size)
+{
+  uint32_t start = SD_STATS_NOW();
+  HAL_StatusTypeDef status;
+  
+  status = SD_IO_WriteBlock(pData, Size);
+  SD_StatsRecord(&SdStats.Data, start);
+  
+  return status;
+}
+
+/**
+  * @brief  Waits while the card holds the line low, timed as the Busy phase.
+  * @retval None
+  */
+static void SD_WaitNotBusy(void)
+{
+  uint32_t start = SD_STATS_NOW();
+  
+  while (SD_IO_ReadByte() == 0);
+  SD_StatsRecord(&SdStats.Busy, start);
+}
+
+/**
+  * @brief  Converts a byte address to the address argument of the card:
+  *         SDHC/SDXC cards are addressed in 512-byte blocks, standard
+  *         capacity cards in bytes.
+  * @param  Addr: byte address
+  * @retval Command address argument
+  */
+static uint32_t SD_GetCardAddress(uint64_t Addr)
+{
+  if (SdCardType == SD_CARD_SDHC)
+  {
+    return (uint32_t)(Addr / 512);
+  }
+  return (uint32_t)Addr;
+}
 /**
   * @brief  Erases the specified memory area of the given SD card. 
+  * @note   Erased blocks read back as all 0x00 or all 0xFF depending on the
+  *         card.
   * @param  StartAddr: Start byte address
-  * @param  EndAddr: End byte address
+  * @param  EndAddr: Byte address of the last block to erase
   * @retval SD status
   */
-uint8_t BSP_SD_Erase(uint32_t StartAddr, uint32_t EndAddr)
+uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr)
 {
   uint8_t rvalue = MSD_ERROR;
+  uint32_t tickstart;
+
+  SD_WaitTransferEnd();
 
   /* Send CMD32 (Erase group start) and check if the SD acknowledged the erase command: R1 response (0x00: no errors) */
-  if (SD_SendCmd(SD_CMD_SD_ERASE_GRP_START, StartAddr, 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
+  if (SD_SendCmd(SD_CMD_SD_ERASE_GRP_START, SD_GetCardAddress(StartAddr), 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
   {
     /* Send CMD33 (Erase group end) and Check if the SD acknowledged the erase command: R1 response (0x00: no errors) */
-    if (SD_SendCmd(SD_CMD_SD_ERASE_GRP_END, EndAddr, 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
+    if (SD_SendCmd(SD_CMD_SD_ERASE_GRP_END, SD_GetCardAddress(EndAddr), 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
     {
       /* Send CMD38 (Erase) and Check if the SD acknowledged the erase command: R1 response (0x00: no errors) */
-      if (SD_SendCmd(SD_CMD_ERASE, 0, 0xFF, SD_RESPONSE_NO_ERROR) == MSD_OK)
+      if (SD_IO_WriteCmd(SD_CMD_ERASE, 0, 0xFF, SD_RESPONSE_NO_ERROR) == HAL_OK)
       {
-        /* Verify that SD card is ready to use after the specific command ERASE */
-        if (SD_IO_WaitResponse(SD_RESPONSE_NO_ERROR) == HAL_OK)
-          rvalue = MSD_OK;
+        /* The card holds the line low until the erase is complete, it
+           must stay selected meanwhile */
+        tickstart = HAL_GetTick();
+        rvalue = MSD_OK;
+        while (SD_IO_ReadByte() == 0)
+        {
+          if ((HAL_GetTick() - tickstart) >= SD_ERASE_TIMEOUT)
+          {
+            rvalue = MSD_ERROR;
+            break;
+          }
+        }
       }
+      SD_IO_WriteDummy();
     }
   }
   
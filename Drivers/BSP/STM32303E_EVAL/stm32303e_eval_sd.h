@@ -70,6 +70,13 @@
 #define MSD_OK         0x00
 #define MSD_ERROR      0x01
 
+/** 
+  * @brief  SD asynchronous write state
+  */
+#define SD_TRANSFER_OK     0x00  /* No transfer running, the last one succeeded */
+#define SD_TRANSFER_BUSY   0x01  /* Transfer or card programming in progress */
+#define SD_TRANSFER_ERROR  0x02  /* The last transfer failed */
+
 typedef enum
 {
 /**
@@ -162,10 +169,66 @@ typedef struct
 {
   SD_CSD Csd;
   SD_CID Cid;
-  uint32_t CardCapacity;  /* Card Capacity */
+  uint64_t CardCapacity;  /* Card Capacity in bytes */
   uint32_t CardBlockSize; /* Card Block Size */
+  uint8_t  CardType;      /* Card Type, see SD_CARD_xxx */
 } SD_CardInfo;
 
+/** 
+  * @brief SD Status register (ACMD13), allocation unit and erase parameters
+  */
+typedef struct
+{
+  uint8_t  BusWidth;              /* DAT_BUS_WIDTH */
+  uint8_t  SecuredMode;           /* SECURED_MODE */
+  uint16_t CardType;              /* SD_CARD_TYPE */
+  uint32_t ProtectedAreaSize;     /* SIZE_OF_PROTECTED_AREA */
+  uint8_t  SpeedClass;            /* SPEED_CLASS */
+  uint8_t  PerformanceMove;       /* PERFORMANCE_MOVE in MB/s */
+  uint8_t  AUSize;                /* AU_SIZE code, 0 when not defined */
+  uint32_t AllocationUnit;        /* Allocation unit in bytes, 0 when not defined */
+  uint16_t EraseSize;             /* ERASE_SIZE: AUs erased in ERASE_TIMEOUT */
+  uint8_t  EraseTimeout;          /* ERASE_TIMEOUT in s */
+  uint8_t  EraseOffset;           /* ERASE_OFFSET in s */
+} SD_Status;
+
+/**
+  * @brief  Number of log2 buckets of the latency histograms, the last one
+  *         collects all periods of 2^(SD_STATS_BUCKETS-2) us (4 s) or more
+  */
+#ifndef SD_STATS_BUCKETS
+#define SD_STATS_BUCKETS         24
+#endif
+
+/** 
+  * @brief  Timing statistics of one phase of the SD operations
+  */
+typedef struct
+{
+  uint32_t Count;                         /* Number of timed periods */
+  uint64_t TotalTime;                     /* Sum of the periods in us */
+  uint32_t MaxTime;                       /* Longest period in us */
+  uint32_t MaxTick;                       /* HAL tick at which MaxTime ended */
+  uint32_t Histogram[SD_STATS_BUCKETS];   /* Bucket n counts periods of [2^(n-1), 2^n) us,
+                                             bucket 0 periods under 1 us */
+} SD_PhaseStats;
+
+/** 
+  * @brief  SD driver timing statistics, see BSP_SD_GetStats()
+  */
+typedef struct
+{
+  SD_PhaseStats Cmd;      /* Command up to its R1 response */
+  SD_PhaseStats Data;     /* Block data transfer */
+  SD_PhaseStats Busy;     /* Card busy: write programming, read access time */
+  SD_PhaseStats Write;    /* Whole write operations */
+  SD_PhaseStats Read;     /* Whole read operations */
+  uint64_t BytesWritten;
+  uint64_t BytesRead;
+  uint32_t WriteRate;     /* Bytes/s while writing: BytesWritten / Write.TotalTime */
+  uint32_t ReadRate;      /* Bytes/s while reading: BytesRead / Read.TotalTime */
+} SD_Stats;
+
 /**
   * @}
   */
@@ -182,7 +245,7 @@ typedef struct
 #define SD_START_DATA_SINGLE_BLOCK_READ    0xFE  /* Data token start byte, Start Single Block Read */
 #define SD_START_DATA_MULTIPLE_BLOCK_READ  0xFE  /* Data token start byte, Start Multiple Block Read */
 #define SD_START_DATA_SINGLE_BLOCK_WRITE   0xFE  /* Data token start byte, Start Single Block Write */
-#define SD_START_DATA_MULTIPLE_BLOCK_WRITE 0xFD  /* Data token start byte, Start Multiple Block Write */
+#define SD_START_DATA_MULTIPLE_BLOCK_WRITE 0xFC  /* Data token start byte, Start Multiple Block Write */
 #define SD_STOP_DATA_MULTIPLE_BLOCK_WRITE  0xFD  /* Data toke stop byte, Stop Multiple Block Write */
 
 /**
@@ -190,12 +253,32 @@ typedef struct
   */
 #define SD_PRESENT               ((uint8_t)0x01)
 #define SD_NOT_PRESENT           ((uint8_t)0x00)
+
+/**
+  * @brief  SD card types
+  */
+#define SD_CARD_SDSC_V1          ((uint8_t)0x00)  /* Ver1.x standard capacity card or MMC */
+#define SD_CARD_SDSC_V2          ((uint8_t)0x01)  /* Ver2.00 or later standard capacity card */
+#define SD_CARD_SDHC             ((uint8_t)0x02)  /* High or extended capacity card (SDHC/SDXC) */
+
+/**
+  * @brief  OCR register bits
+  */
+#define SD_OCR_CCS               ((uint32_t)0x40000000)  /* Card capacity status, set by SDHC/SDXC */
+#define SD_OCR_HCS               SD_OCR_CCS              /* Host capacity support, ACMD41 argument */
+
+/**
+  * @brief  CMD8 argument: 2.7-3.6V supply and check pattern, and its CRC
+  */
+#define SD_CHECK_PATTERN         ((uint32_t)0x000001AA)
+#define SD_CHECK_PATTERN_CRC     0x87
    
 /**
   * @brief  Commands: CMDxx = CMD-number | 0x40
   */
 #define SD_CMD_GO_IDLE_STATE          0   /* CMD0 = 0x40 */
 #define SD_CMD_SEND_OP_COND           1   /* CMD1 = 0x41 */
+#define SD_CMD_SEND_IF_COND           8   /* CMD8 = 0x48 */
 #define SD_CMD_SEND_CSD               9   /* CMD9 = 0x49 */
 #define SD_CMD_SEND_CID               10  /* CMD10 = 0x4A */
 #define SD_CMD_STOP_TRANSMISSION      12  /* CMD12 = 0x4C */
@@ -217,6 +300,15 @@ typedef struct
 #define SD_CMD_ERASE_GRP_END          36  /* CMD36 = 0x64 */
 #define SD_CMD_UNTAG_ERASE_GROUP      37  /* CMD37 = 0x65 */
 #define SD_CMD_ERASE                  38  /* CMD38 = 0x66 */
+#define SD_CMD_APP_CMD                55  /* CMD55 = 0x77 */
+#define SD_CMD_READ_OCR               58  /* CMD58 = 0x7A */
+
+/**
+  * @brief  Application specific commands: sent after SD_CMD_APP_CMD
+  */
+#define SD_ACMD_SD_STATUS              13 /* ACMD13 = 0x4D */
+#define SD_ACMD_SET_WR_BLK_ERASE_COUNT 23 /* ACMD23 = 0x57 */
+#define SD_ACMD_SD_SEND_OP_COND        41 /* ACMD41 = 0x69 */
 
    
 /**
@@ -238,9 +330,16 @@ uint8_t BSP_SD_Init(void);
 uint8_t  BSP_SD_IsDetected(void);
 uint8_t BSP_SD_ReadBlocks(uint32_t* p32Data, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
 uint8_t BSP_SD_WriteBlocks(uint32_t* p32Data, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
-uint8_t BSP_SD_Erase(uint32_t StartAddr, uint32_t EndAddr);
+uint8_t BSP_SD_WriteBlocks_Async(uint32_t* p32Data, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks);
+uint8_t BSP_SD_GetTransferState(void);
+void    BSP_SD_WriteCpltCallback(void);
+void    BSP_SD_ErrorCallback(void);
+uint8_t BSP_SD_Erase(uint64_t StartAddr, uint64_t EndAddr);
 uint8_t BSP_SD_GetStatus(void);
 uint8_t BSP_SD_GetCardInfo(SD_CardInfo *pCardInfo);
+uint8_t BSP_SD_GetSDStatus(SD_Status *pStatus);
+void    BSP_SD_GetStats(SD_Stats *pStats);
+void    BSP_SD_ResetStats(void);
    
 /* Link functions for SD Card peripheral*/
 void                    SD_IO_Init(void); 
@@ -249,6 +348,14 @@ uint8_t                 SD_IO_ReadByte(void);
 HAL_StatusTypeDef       SD_IO_WriteCmd(uint8_t Cmd, uint32_t Arg, uint8_t Crc, uint8_t Response);
 HAL_StatusTypeDef       SD_IO_WaitResponse(uint8_t Response);
 void                    SD_IO_WriteDummy(void);
+HAL_StatusTypeDef       SD_IO_WriteBlock(const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef       SD_IO_ReadBlock(uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef       SD_IO_WriteBlock_DMA(const uint8_t *pData, uint16_t Size);
+void                    SD_IO_WriteBlockCpltCallback(HAL_StatusTypeDef Status);
+void                    SD_IO_BusyPollStart(void);
+void                    SD_IO_BusyPollStop(void);
+void                    SD_IO_BusyPollCallback(void);
+void                    BSP_SD_BusyPoll_IRQHandler(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,110 @@
+/**
+ ******************************************************************************
+ * @file    decimator.h
+ * @brief   Header for decimator.c module
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __DECIMATOR_H
+#define __DECIMATOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f3xx_hal.h"
+#include "arm_math.h"
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Channels of a decimator */
+#define DECIMATOR_MAX_CHANNELS          8
+
+/* Resolution of the input codes in bits */
+#define DECIMATOR_INPUT_BITS            12
+
+/* Extra bits of resolution the q15 filter output can carry */
+#define DECIMATOR_MAX_EXTRA_BITS        (15 - DECIMATOR_INPUT_BITS)
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  Low-pass filter design of a decimator
+ */
+typedef enum {
+	DECIMATOR_DESIGN_BOXCAR = 0, /*!< Moving average over the filter length  */
+	DECIMATOR_DESIGN_HAMMING, /*!< Windowed sinc, Hamming window: narrow
+	 transition band, about 50 dB of stop band attenuation           */
+	DECIMATOR_DESIGN_BLACKMAN /*!< Windowed sinc, Blackman window: wider
+	 transition band, about 70 dB of stop band attenuation           */
+} Decimator_DesignTypeDef;
+
+/**
+ * @brief  Decimator configuration
+ */
+typedef struct {
+	uint32_t Channels; /*!< Samples per frame, 1..DECIMATOR_MAX_CHANNELS    */
+	uint32_t Ratio; /*!< Input frames per output frame, 1..255              */
+	uint32_t TapsPerPhase; /*!< Filter length in output periods, the filter
+	 has Ratio * TapsPerPhase taps                                   */
+	uint32_t BlockFrames; /*!< Input frames filtered at once, a multiple of
+	 Ratio                                                           */
+	Decimator_DesignTypeDef Design; /*!< Low-pass filter design             */
+	uint8_t ExtraBits; /*!< Bits of resolution added to the input codes by
+	 the filter, 0..DECIMATOR_MAX_EXTRA_BITS                         */
+	uint8_t Fast; /*!< Non-zero for arm_fir_decimate_fast_q15(), 32-bit
+	 accumulator                                                     */
+} Decimator_InitTypeDef;
+
+/**
+ * @brief  Polyphase FIR decimator of interleaved ADC frames.
+ *         Input frames are staged per channel until BlockFrames are
+ *         available, then each channel is filtered and decimated by the
+ *         CMSIS-DSP q15 FIR decimator and the output frames are interleaved
+ *         again.
+ */
+typedef struct {
+	arm_fir_decimate_instance_q15 aFilter[DECIMATOR_MAX_CHANNELS]; /*!< One
+	 filter per channel, sharing the coefficients                    */
+	uint32_t Channels; /*!< Samples per frame                               */
+	uint32_t BlockFrames; /*!< Input frames filtered at once               */
+	uint32_t OutputFrames; /*!< Output frames per filtered block           */
+	uint32_t Ratio; /*!< Input frames per output frame                       */
+	uint32_t Fill; /*!< Input frames staged                                */
+	uint32_t Skip; /*!< Input frames still dropped after a gap to get back
+	 in phase with the output frames                                 */
+	uint8_t Prime; /*!< Non-zero until the filter histories are primed with
+	 the first frame after a gap                                     */
+	q15_t *pInput; /*!< Staged input, BlockFrames per channel               */
+	q15_t *pFiltered; /*!< Filter output of one channel                     */
+	uint16_t *pOutput; /*!< Interleaved output frames                        */
+	uint8_t Shift; /*!< Right shift from q15 to output codes                */
+	uint8_t Fast; /*!< Non-zero for the fast filter variant                 */
+} Decimator_TypeDef;
+
+/* Exported macro ------------------------------------------------------------*/
+
+/**
+ * @brief  Work buffer of a decimator in q15 entries: the coefficients, the
+ *         filter states, the staged input and the output.
+ */
+#define DECIMATOR_BUFFER_SIZE(Channels, Ratio, TapsPerPhase, BlockFrames) \
+	((Ratio) * (TapsPerPhase) \
+	+ (Channels) * ((Ratio) * (TapsPerPhase) + (BlockFrames) - 1) \
+	+ (Channels) * (BlockFrames) \
+	+ ((Channels) + 1) * ((BlockFrames) / (Ratio)))
+
+/* Exported functions ------------------------------------------------------- */
+HAL_StatusTypeDef Decimator_Init(Decimator_TypeDef *dec,
+		const Decimator_InitTypeDef *Init, q15_t *pBuffer, uint32_t BufferSize);
+uint32_t Decimator_Reset(Decimator_TypeDef *dec, uint32_t Missed);
+uint32_t Decimator_Process(Decimator_TypeDef *dec, const uint16_t *pData,
+		uint32_t Count, const uint16_t **ppOutput, uint32_t *pOutputCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DECIMATOR_H */
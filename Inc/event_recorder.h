@@ -0,0 +1,92 @@
+/**
+ ******************************************************************************
+ * @file    event_recorder.h
+ * @brief   Header for event_recorder.c module
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __EVENT_RECORDER_H
+#define __EVENT_RECORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f3xx_hal.h"
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  Event recorder state
+ */
+typedef enum {
+	EVENT_RECORDER_DISARMED = 0, /*!< Samples are not kept                */
+	EVENT_RECORDER_ARMED, /*!< Pre-trigger history kept, waiting for a
+	 trigger                                                         */
+	EVENT_RECORDER_TRIGGERED, /*!< Post-trigger samples being kept        */
+	EVENT_RECORDER_COMPLETE /*!< Window frozen until the recorder is armed
+	 again                                                           */
+} EventRecorder_StateTypeDef;
+
+/**
+ * @brief  Pre/post-trigger recorder over a circular window of samples.
+ *         The producer (DMA interrupt) hands it every block of samples
+ *         acquired and a trigger source (watchdog interrupt) triggers it;
+ *         the two must run at the same interrupt priority. The consumer
+ *         (main loop) takes the complete window and re-arms the recorder.
+ */
+typedef struct {
+	uint16_t *pBuffer; /*!< Window storage, Size entries                   */
+	uint32_t Size; /*!< Window length in samples, whole frames            */
+	uint32_t FrameSize; /*!< Samples per frame                              */
+	uint32_t PostCount; /*!< Samples kept from the trigger frame on, whole
+	 frames, less than Size                                          */
+	uint32_t Position; /*!< Next write position in pBuffer                  */
+	__IO uint32_t Head; /*!< Acquisition index of the next sample (free
+	 running)                                                        */
+	__IO uint32_t ArmIndex; /*!< Acquisition index of the oldest sample that
+	 may be part of the window                                       */
+	uint32_t TriggerIndex; /*!< Acquisition index of the trigger frame      */
+	const uint16_t *pTrigger; /*!< Sample that caused the trigger, located in
+	 the next block put                                              */
+	uint8_t TriggerPending; /*!< Set until the trigger frame is located     */
+	uint32_t TriggerSource; /*!< Tag of the trigger source                  */
+	uint32_t TriggerTick; /*!< HAL tick of the trigger                      */
+	__IO EventRecorder_StateTypeDef State; /*!< EVENT_RECORDER_xxx         */
+} EventRecorder_TypeDef;
+
+/**
+ * @brief  Complete window of a recorder
+ */
+typedef struct {
+	uint32_t First; /*!< Position of the first sample in pBuffer           */
+	uint32_t Count; /*!< Number of samples, wrapping around pBuffer        */
+	uint32_t FirstIndex; /*!< Acquisition index of the first sample        */
+	uint32_t TriggerIndex; /*!< Acquisition index of the trigger frame      */
+	uint32_t TriggerSource; /*!< Tag given to EventRecorder_Trigger()       */
+	uint32_t TriggerTick; /*!< HAL tick of the trigger                      */
+} EventRecorder_WindowTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+/* Exported macro ------------------------------------------------------------*/
+/* Exported functions ------------------------------------------------------- */
+void EventRecorder_Init(EventRecorder_TypeDef *rec, uint16_t *pBuffer,
+		uint32_t Size, uint32_t FrameSize, uint32_t PostCount);
+void EventRecorder_Arm(EventRecorder_TypeDef *rec);
+void EventRecorder_Disarm(EventRecorder_TypeDef *rec);
+void EventRecorder_Put(EventRecorder_TypeDef *rec, const uint16_t *pData,
+		uint32_t Count);
+void EventRecorder_Skip(EventRecorder_TypeDef *rec, uint32_t Count);
+void EventRecorder_Trigger(EventRecorder_TypeDef *rec,
+		const uint16_t *pSample, uint32_t Source);
+EventRecorder_StateTypeDef EventRecorder_GetState(EventRecorder_TypeDef *rec);
+uint8_t EventRecorder_GetWindow(EventRecorder_TypeDef *rec,
+		EventRecorder_WindowTypeDef *pWindow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EVENT_RECORDER_H */
@@ -23,6 +23,31 @@
 /  data transfer. */
 
 
+#define _FS_CACHE_SECTORS    4      /* 0:Disable or 1-255:Number of sectors */
+#define _FS_CACHE_ATTR       __attribute__((section(".ccmbss")))
+/* This option sets the number of sectors kept in a write-back LRU cache behind
+/  the disk access window of each volume, so that FAT, FSINFO and directory
+/  sectors accessed alternately are not written and read back on each switch.
+/  Dirty sectors are written at f_sync() and f_close(), or when evicted.
+/  The cache buffers are never passed to disk_read()/disk_write() and can be
+/  placed in memory the disk driver cannot access by DMA, as selected by
+/  _FS_CACHE_ATTR (here the CCM RAM, in a NOLOAD section that takes no room
+/  in the flash image). Each volume takes _FS_CACHE_SECTORS * _MAX_SS bytes.
+/  Not available at tiny configuration. */
+
+
+#define _FS_FREEMAP          512    /* 0:Disable or bytes per volume */
+/* This option sets the size of the free cluster map of each volume. Each bit
+/  of the map covers a group of clusters, the smallest power of two that lets
+/  the map span the whole FAT, and is cleared once the group is known to have
+/  no free cluster. Cluster allocation in create_chain() and f_expand() skips
+/  those groups without reading their FAT sectors. The map starts all set at
+/  mount, learns the full groups as allocation scans them, is made exact by
+/  the first f_getfree() FAT scan and is kept conservative by put_fat(). With
+/  512 bytes, a volume of 1M clusters is mapped in groups of 256 clusters.
+/  This option must be 0 at read-only configuration. */
+
+
 #define _FS_READONLY         0      /* 0:Read/Write or 1:Read only */
 /* This option switches read-only configuration. (0:Read/Write or 1:Read-only)
 /  Read-only configuration removes writing API functions, f_write(), f_sync(),
@@ -58,6 +83,12 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
+#define	_MKFS_NFATS             1
+/* Number of FAT copies created by f_mkfs(). (1 or 2)
+/  A single FAT halves the FAT writes while formatting and while allocating
+/  clusters, at the cost of the redundant copy that few implementations use. */
+
+
 #define	_USE_FASTSEEK           1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
@@ -71,6 +102,26 @@
 /* This option switches f_forward() function. (0:Disable or 1:Enable)
 /  To enable it, also _FS_TINY need to be set to 1. */
 
+
+#define	_USE_EXPAND             1
+/* This option switches f_expand() function. (0:Disable or 1:Enable) */
+
+
+#define	_USE_STREAM             1
+/* This option switches the streaming writer functions, f_stream_open(),
+/  f_stream_buffer(), f_stream_commit(), f_stream_sync(), f_stream_flush(),
+/  f_stream_close() and f_stream_recover().
+/  (0:Disable or 1:Enable) To enable it, also _USE_EXPAND need to be set to 1. */
+
+
+#define	_USE_STREAM_ASYNC       1
+/* This option makes the streaming writer double buffered. (0:Disable or
+/  1:Enable) The sector buffer is used as two halves: a full half is passed
+/  to disk_ioctl(CTRL_WRITE_START) and written by the disk while the other
+/  half is filled, f_stream_commit() then only waits for the previous write.
+/  To enable it, also _USE_STREAM need to be set to 1 and the disk_ioctl()
+/  function needs to implement CTRL_WRITE_START and CTRL_WRITE_WAIT. */
+
 #define _USE_BUFF_WO_ALIGNMENT  0
 /* This option is available only for usbh diskio interface and allow to disable
 /  the management of the unaligned buffer.
@@ -83,6 +134,24 @@
 /  (0: default value or 1: unaligned buffer return an error). */
 
 
+#define _SD_WRITE_BUFFER_SECTORS  8
+/* This option is available only for the SD diskio interface and sets the size
+/  of its write-back buffer in sectors (0:Disable). Writes to consecutive
+/  sectors are collected in the buffer and sent to the card as one multiple
+/  block write when the run is full or broken, on a read of a buffered sector
+/  and on CTRL_SYNC (f_sync() and f_close()). The buffer takes
+/  _SD_WRITE_BUFFER_SECTORS * 512 bytes of DMA capable RAM. */
+
+
+#define _SD_READ_AHEAD_SECTORS    8
+/* This option is available only for the SD diskio interface and sets the size
+/  of its read-ahead buffer in sectors (0:Disable). A read shorter than the
+/  buffer that continues the previous one fetches this many sectors at once
+/  with a multiple block read, and the following reads of those sectors are
+/  served from RAM. Writes to prefetched sectors discard them. The buffer
+/  takes _SD_READ_AHEAD_SECTORS * 512 bytes of DMA capable RAM. */
+
+
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
@@ -198,10 +267,12 @@
 /  disk_ioctl() function. */
 
 
-#define	_USE_TRIM                0
+#define	_USE_TRIM                1
 /* This option switches ATA-TRIM feature. (0:Disable or 1:Enable)
 /  To enable Trim feature, also CTRL_TRIM command should be implemented to the
-/  disk_ioctl() function. */
+/  disk_ioctl() function. The clusters of removed files are trimmed as they are
+/  freed, and f_trimfree() trims the free space left by earlier removals.
+/  The SD diskio driver erases trimmed sectors. */
 
 
 #define _FS_NOFSINFO            0
@@ -216,6 +287,15 @@
 */
 
 
+#define _FS_LAZY_FSINFO         1
+/* When _FS_LAZY_FSINFO is set to 1, f_sync() and f_stream_sync() do not rewrite
+/  the FSINFO sector of a FAT32 volume each time the free cluster count changes.
+/  The first of them records the count as unknown instead, and the correct count
+/  is written by f_close() or any other function that updates the volume. After
+/  a power loss the count is rebuilt by f_getfree() with a FAT scan.
+/  (0:Disable or 1:Enable) */
+
+
 
 /*---------------------------------------------------------------------------/
 / System Configurations
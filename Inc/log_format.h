@@ -0,0 +1,206 @@
+/**
+ ******************************************************************************
+ * @file    log_format.h
+ * @brief   On-card layout of the binary sample log.
+ *          This header is shared with the host-side reader and must only
+ *          depend on <stdint.h>.
+ *
+ *          A log file is a sequence of LOG_BLOCK_SIZE byte blocks:
+ *            - block 0 is the file header (LogFileHeader_TypeDef)
+ *            - every following block is a data block (LogBlock_TypeDef)
+ *              holding LOG_BLOCK_SAMPLES packed 12-bit samples, or
+ *              LOG_BLOCK_SAMPLES16 16-bit samples for the stream blocks of
+ *              a file whose Resolution is above 12 bits.
+ *          Multi-byte fields are little-endian. Multi-channel samples are
+ *          stored interleaved by frame, in the order of the header ChannelMap.
+ *
+ *          Records are stored between the stream blocks as a description
+ *          block followed by the blocks of their samples, whose FirstSample
+ *          counts from the start of the record:
+ *            - a burst capture is a LOG_BLOCK_TYPE_BURST_INFO block
+ *              (LogBurstInfo_TypeDef in Data) and LOG_BLOCK_TYPE_BURST blocks
+ *            - an event is a LOG_BLOCK_TYPE_EVENT_INFO block
+ *              (LogEventInfo_TypeDef in Data) and LOG_BLOCK_TYPE_EVENT
+ *              blocks, holding frames of the stream at its acquisition
+ *              rate, before decimation.
+ *          Record samples are 12-bit ADC codes whatever the Resolution of
+ *          the stream; the stream gains apply to them multiplied by
+ *          2^(Resolution - 12).
+ *
+ *          Data block n is at offset (n + 1) * LOG_BLOCK_SIZE and carries
+ *          Sequence n and the Session tag of the header. A file cut short by
+ *          a power failure may extend past its last block; the data ends at
+ *          the first block that breaks this rule.
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LOG_FORMAT_H
+#define __LOG_FORMAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Exported constants --------------------------------------------------------*/
+
+/* File header magic: "BCLG" */
+#define LOG_FILE_MAGIC                  0x474C4342UL
+#define LOG_FILE_VERSION                1
+
+/* Block sync word, marks the start of every data block */
+#define LOG_BLOCK_SYNC                  0xB10C5A5AUL
+
+/* Block size, one SD sector */
+#define LOG_BLOCK_SIZE                  512
+#define LOG_BLOCK_HEADER_SIZE           24
+
+/* Samples per data block, two 12-bit samples are packed in three bytes */
+#define LOG_BLOCK_SAMPLES               324
+#define LOG_BLOCK_DATA_SIZE             (LOG_BLOCK_SAMPLES * 3 / 2)
+
+/* Samples per data block of a stream stored with more than 12 bits */
+#define LOG_BLOCK_SAMPLES16             (LOG_BLOCK_DATA_SIZE / 2)
+
+/* Maximum number of channels described by the file header */
+#define LOG_MAX_CHANNELS                8
+
+/* File header flags */
+#define LOG_FLAG_PAIRED                 0x0001 /* Slots 2n and 2n+1 of a frame
+                                                  are sampled at the same
+                                                  instant (dual ADC mode) */
+
+/* Data block types */
+#define LOG_BLOCK_TYPE_SAMPLES          0x0001 /* Continuous sample stream */
+#define LOG_BLOCK_TYPE_BURST_INFO       0x0002 /* Start of a burst record    */
+#define LOG_BLOCK_TYPE_BURST            0x0003 /* Samples of a burst record  */
+#define LOG_BLOCK_TYPE_EVENT_INFO       0x0004 /* Start of an event record   */
+#define LOG_BLOCK_TYPE_EVENT            0x0005 /* Samples of an event record */
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  File header, first block of a log file
+ */
+typedef struct {
+	uint32_t Magic; /*!< LOG_FILE_MAGIC                                      */
+	uint16_t Version; /*!< LOG_FILE_VERSION                                  */
+	uint16_t HeaderSize; /*!< Size of this header in bytes                   */
+	uint16_t BlockSize; /*!< Size of the data blocks in bytes               */
+	uint16_t SamplesPerBlock; /*!< Samples in a full data block            */
+	uint32_t SampleRateHz; /*!< Frame rate of the continuous stream, after
+	 decimation                                                      */
+	uint32_t StartTick; /*!< HAL tick (ms) of the first sample              */
+	uint32_t StartTime; /*!< FAT date/time of the first sample (get_fattime) */
+	uint8_t Resolution; /*!< Resolution of the stream samples in bits, the ADC
+	 resolution plus the bits added by decimation                    */
+	uint8_t ChannelCount; /*!< Number of interleaved channels per frame    */
+	uint16_t Session; /*!< Tag repeated in every data block of the file     */
+	uint8_t ChannelMap[LOG_MAX_CHANNELS]; /*!< ADC channel of each slot     */
+	float Gain[LOG_MAX_CHANNELS]; /*!< Physical value = raw * Gain + Offset */
+	float Offset[LOG_MAX_CHANNELS];
+	uint16_t Flags; /*!< LOG_FLAG_xxx                                        */
+	uint16_t Decimation; /*!< Acquired frames per stream frame, 0 or 1 for
+	 a stream stored as acquired                                     */
+	uint8_t Reserved2[LOG_BLOCK_SIZE - 104];
+} LogFileHeader_TypeDef;
+
+/**
+ * @brief  Data block
+ */
+typedef struct {
+	uint32_t Sync; /*!< LOG_BLOCK_SYNC                                       */
+	uint16_t Type; /*!< LOG_BLOCK_TYPE_xxx                                   */
+	uint16_t Count; /*!< Valid samples in Data, LOG_BLOCK_SAMPLES but the last */
+	uint32_t Sequence; /*!< Block sequence number, starting at 0            */
+	uint32_t Dropped; /*!< Stream samples lost since file start, to ring
+	 overflow or while a burst was captured                         */
+	uint64_t FirstSample; /*!< Stream index of the first sample of the block */
+	uint8_t Data[LOG_BLOCK_DATA_SIZE]; /*!< Packed 12-bit or 16-bit samples */
+	uint16_t Session; /*!< Session tag of the file header                  */
+} LogBlock_TypeDef;
+
+/**
+ * @brief  Description of a burst record, Data of its
+ *         LOG_BLOCK_TYPE_BURST_INFO block
+ */
+typedef struct {
+	uint32_t Id; /*!< Burst number in the file, starting at 0              */
+	uint32_t SampleRateHz; /*!< Frame rate of the burst                     */
+	uint32_t SampleCount; /*!< Samples in the following burst blocks        */
+	uint32_t StartTick; /*!< HAL tick (ms) of the first burst sample        */
+	uint64_t StreamSample; /*!< Stream index of the first sample acquired after
+	 the burst, the stream is interrupted while the burst runs       */
+	uint8_t ChannelCount; /*!< Number of interleaved channels per frame    */
+	uint8_t Reserved;
+	uint16_t Flags; /*!< LOG_FLAG_xxx                                        */
+	uint8_t ChannelMap[LOG_MAX_CHANNELS]; /*!< ADC channel of each slot     */
+	float Gain[LOG_MAX_CHANNELS]; /*!< Physical value = raw * Gain + Offset */
+	float Offset[LOG_MAX_CHANNELS];
+} LogBurstInfo_TypeDef;
+
+/**
+ * @brief  Description of an event record, Data of its
+ *         LOG_BLOCK_TYPE_EVENT_INFO block.
+ *         Events are located by their acquisition index: the number of
+ *         samples acquired since the start of the file. Acquired frame n
+ *         was sampled n / (SampleRateHz * Decimation) seconds after the
+ *         first one. Without decimation, the acquisition index of a stream
+ *         sample is its stream index plus the Dropped count of its block.
+ */
+typedef struct {
+	uint32_t Id; /*!< Event number in the file, starting at 0              */
+	uint32_t SampleCount; /*!< Samples in the following event blocks, whole
+	 frames laid out as in the stream                                */
+	uint32_t FirstSample; /*!< Acquisition index of the first sample        */
+	uint32_t TriggerSample; /*!< Acquisition index of the first sample of the
+	 frame that tripped the watchdog                                 */
+	uint32_t TriggerTick; /*!< HAL tick (ms) of the trigger                 */
+	uint8_t Channel; /*!< Slot in the frame (index in the header ChannelMap)
+	 of the watched channel that tripped                             */
+	uint8_t Reserved[3];
+} LogEventInfo_TypeDef;
+
+/* Layout checks, both structures must exactly fill one block */
+typedef char LogFileHeader_SizeCheck[
+		(sizeof(LogFileHeader_TypeDef) == LOG_BLOCK_SIZE) ? 1 : -1];
+typedef char LogBlock_SizeCheck[
+		(sizeof(LogBlock_TypeDef) == LOG_BLOCK_SIZE) ? 1 : -1];
+typedef char LogBurstInfo_SizeCheck[
+		(sizeof(LogBurstInfo_TypeDef) <= LOG_BLOCK_DATA_SIZE) ? 1 : -1];
+typedef char LogEventInfo_SizeCheck[
+		(sizeof(LogEventInfo_TypeDef) <= LOG_BLOCK_DATA_SIZE) ? 1 : -1];
+
+/* Exported macro ------------------------------------------------------------*/
+
+/**
+ * @brief  Packs samples 2*n and 2*n+1 into three bytes:
+ *         b0 = s0[7:0], b1 = s1[3:0] << 4 | s0[11:8], b2 = s1[11:4]
+ */
+#define LOG_PACK12(p, s0, s1) do { \
+	(p)[0] = (uint8_t) (s0); \
+	(p)[1] = (uint8_t) ((((s0) >> 8) & 0x0F) | (((s1) & 0x0F) << 4)); \
+	(p)[2] = (uint8_t) ((s1) >> 4); \
+} while (0)
+
+#define LOG_UNPACK12_0(p)   ((uint16_t) ((p)[0] | (((p)[1] & 0x0F) << 8)))
+#define LOG_UNPACK12_1(p)   ((uint16_t) (((p)[1] >> 4) | ((p)[2] << 4)))
+
+/**
+ * @brief  Stores a 16-bit sample in two bytes, little-endian
+ */
+#define LOG_PACK16(p, s) do { \
+	(p)[0] = (uint8_t) (s); \
+	(p)[1] = (uint8_t) ((s) >> 8); \
+} while (0)
+
+#define LOG_UNPACK16(p)     ((uint16_t) ((p)[0] | ((p)[1] << 8)))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_FORMAT_H */
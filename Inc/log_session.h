@@ -0,0 +1,42 @@
+/**
+ ******************************************************************************
+ * @file    log_session.h
+ * @brief   Header for log_session.c module
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LOG_SESSION_H
+#define __LOG_SESSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+#include "ff.h"
+
+/* Exported types ------------------------------------------------------------*/
+/* Exported constants --------------------------------------------------------*/
+
+/* File holding the index of the next session, in the root directory */
+#define LOG_SESSION_INDEX_FILE          "LOGINDEX.DAT"
+
+/* Session files are named LOGnnnnn.BIN, the name buffer must hold
+   LOG_SESSION_NAME_SIZE characters including the terminating null */
+#define LOG_SESSION_NAME_SIZE           13
+#define LOG_SESSION_MAX_INDEX           99999
+
+/* Exported macro ------------------------------------------------------------*/
+/* Exported functions ------------------------------------------------------- */
+FRESULT LogSession_Mount(FATFS *fs, const TCHAR *path, uint8_t Format);
+FRESULT LogSession_NextName(TCHAR *name, uint32_t *pIndex);
+FRESULT LogSession_Close(void);
+FRESULT LogSession_EraseFree(uint32_t Clusters, uint8_t *pDone);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_SESSION_H */
@@ -0,0 +1,111 @@
+/**
+ ******************************************************************************
+ * @file    log_storage.h
+ * @brief   Header for log_storage.c module
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __LOG_STORAGE_H
+#define __LOG_STORAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "ff.h"
+#include "sample_ring.h"
+#include "log_format.h"
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  Description of the logged stream, written to the file header
+ */
+typedef struct {
+	uint32_t SampleRateHz; /*!< Frame rate of the stream                    */
+	uint8_t Resolution; /*!< Resolution of the stream samples in bits, 1..16;
+	 above 12 the stream blocks hold 16-bit samples                  */
+	uint8_t ChannelCount; /*!< Channels per frame, 1..LOG_MAX_CHANNELS      */
+	uint8_t ChannelMap[LOG_MAX_CHANNELS]; /*!< ADC channel of each slot     */
+	float Gain[LOG_MAX_CHANNELS]; /*!< Physical value = raw * Gain + Offset */
+	float Offset[LOG_MAX_CHANNELS];
+	uint16_t Flags; /*!< LOG_FLAG_xxx, written to the header                */
+	uint16_t Decimation; /*!< Acquired frames per stream frame, written to
+	 the header                                                      */
+	uint32_t PreallocSize; /*!< Bytes reserved as one contiguous block when the
+	 file is created, 0 to let the file grow cluster by cluster      */
+	uint32_t SyncBytes; /*!< Commit the file once this many bytes were
+	 written since the last commit, 0 to disable                     */
+	uint32_t SyncPeriod; /*!< Commit written data at the latest this many ms
+	 after it was written, 0 to disable                              */
+	uint16_t Session; /*!< Tag written in the header and every block, tells
+	 the blocks of this file from stale data on the card             */
+	uint8_t AppendOnly; /*!< Non-zero to keep commits inside the pre-allocated
+	 extent from updating the directory, see LogStorage_Recover()     */
+} LogStorage_InitTypeDef;
+
+/**
+ * @brief  Record handed to the storage stage, e.g. a burst capture or an
+ *         event: a description block followed by sample blocks. The
+ *         description and the samples are not copied, they must stay
+ *         untouched until LogStorage_IsRecordPending() returns 0.
+ */
+typedef struct {
+	uint16_t InfoType; /*!< LOG_BLOCK_TYPE_xxx of the description block     */
+	uint16_t DataType; /*!< LOG_BLOCK_TYPE_xxx of the sample blocks         */
+	const void *pInfo; /*!< Description, stored in the Data of its block    */
+	uint32_t InfoSize; /*!< Size of the description, up to
+	 LOG_BLOCK_DATA_SIZE                                             */
+	const uint16_t *pBuffer; /*!< Samples of the record                      */
+	uint32_t BufferSize; /*!< Entries of pBuffer, the samples wrap around to
+	 its start past the last one                                     */
+	uint32_t First; /*!< Position of the first sample in pBuffer           */
+	uint32_t SampleCount; /*!< Number of samples                           */
+} LogStorage_RecordTypeDef;
+
+/**
+ * @brief  Storage stage statistics
+ */
+typedef struct {
+	uint32_t SamplesWritten; /*!< Samples handed to FatFs                 */
+	uint32_t BytesWritten; /*!< Bytes handed to FatFs                      */
+	uint32_t Writes; /*!< Number of blocks handed to FatFs               */
+	uint32_t MaxWriteTime; /*!< Longest block write in ms                   */
+	uint32_t Syncs; /*!< Number of commits                                 */
+	uint32_t SyncTime; /*!< Total time spent in commits in ms               */
+	uint32_t MaxSyncTime; /*!< Longest commit in ms                         */
+	uint32_t UnsyncedBytes; /*!< Bytes written but not committed yet, lost on
+	 a power failure                                                 */
+	uint32_t Records; /*!< Records (bursts, events) completely written    */
+} LogStorage_StatsTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+
+/* Size of the streaming buffer in blocks. The buffer is used as two halves:
+ * a pre-allocated log is written to the card in runs of half this many
+ * blocks, while the other half is filled */
+#ifndef LOG_STREAM_BLOCKS
+#define LOG_STREAM_BLOCKS               8
+#endif
+
+/* Exported macro ------------------------------------------------------------*/
+/* Exported functions ------------------------------------------------------- */
+FRESULT LogStorage_Open(SampleRing_TypeDef *ring, const TCHAR *path,
+		const LogStorage_InitTypeDef *Init);
+FRESULT LogStorage_Process(void);
+FRESULT LogStorage_Sync(void);
+void LogStorage_RequestSync(void);
+FRESULT LogStorage_QueueRecord(const LogStorage_RecordTypeDef *Record);
+uint8_t LogStorage_IsRecordPending(void);
+FRESULT LogStorage_Close(void);
+FRESULT LogStorage_Recover(const TCHAR *path, uint32_t *pBlocks);
+uint32_t LogStorage_GetSampleCount(void);
+void LogStorage_GetStats(LogStorage_StatsTypeDef *pStats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_STORAGE_H */
@@ -39,7 +39,37 @@
 #include "ff_gen_drv.h"
 #include "sd_diskio.h"
 
+/* Logger includes component */
+#include "sample_ring.h"
+#include "log_storage.h"
+#include "log_session.h"
+#include "event_recorder.h"
+#include "decimator.h"
+
 /* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  Entry of the ADC scan table: one rank of the regular sequence
+ */
+typedef struct {
+	uint32_t Channel; /*!< ADC_CHANNEL_x                                     */
+	uint32_t SamplingTime; /*!< ADC_SAMPLETIME_x, long enough for the source
+	 impedance of the input                                         */
+	float Gain; /*!< Physical value = raw * Gain + Offset                   */
+	float Offset;
+} ADC_ScanChannelTypeDef;
+
+/**
+ * @brief  Analog watchdog triggering the event recorder
+ */
+typedef struct {
+	uint32_t ScanIndex; /*!< Entry of the scan table watched, in dual mode odd
+	 entries are watched by ADCx_SLAVE                               */
+	uint32_t WatchdogNumber; /*!< ADC_ANALOGWATCHDOG_x of that ADC         */
+	float Low; /*!< Lowest physical value inside the window                 */
+	float High; /*!< Highest physical value inside the window               */
+} ADC_EventWatchTypeDef;
+
 /* Exported constants --------------------------------------------------------*/
 /* User can use this section to tailor ADCx instance used and associated
  resources */
@@ -52,17 +82,92 @@
 #define ADCx_FORCE_RESET()              __HAL_RCC_ADC12_FORCE_RESET()
 #define ADCx_RELEASE_RESET()            __HAL_RCC_ADC12_RELEASE_RESET()
 
-/* Definition for ADCx Channel Pin */
-#define ADCx_CHANNEL_PIN                GPIO_PIN_2
+/* Definition for ADCx Channel Pins: PC1 (ADC1_IN7), PC2 (ADC1_IN8) and
+ PC3 (ADC1_IN9) */
+#define ADCx_CHANNEL_PINS               (GPIO_PIN_1 | GPIO_PIN_2 | GPIO_PIN_3)
 #define ADCx_CHANNEL_GPIO_PORT          GPIOC
 
-/* Definition for ADCx's Channel */
-#define ADCx_CHANNEL                    ADC_CHANNEL_8
+/* Definition for ADCx's Channels */
+#define ADCx_VBAT_CHANNEL               ADC_CHANNEL_8 /* Pack voltage divider  */
+#define ADCx_IBAT_CHANNEL               ADC_CHANNEL_9 /* Charge current sense  */
+#define ADCx_TEMP_CHANNEL               ADC_CHANNEL_7 /* Cell thermistor       */
+
+/* 1: ADCx_SLAVE converts together with ADCx in dual regular simultaneous
+ mode, so that the pack voltage and the charge current are sampled at the
+ same instant. The DMA of ADCx stores each pair of results as one 32-bit
+ word, ADCx in the low half-word, and the scan table alternates ADCx and
+ ADCx_SLAVE entries. 0: ADCx scans all the channels alone */
+#define ADC_DUAL_MODE                   1
+#define ADCx_SLAVE                      ADC2
+
+/* Number of entries of the scan table in main.c: channels converted at each
+ trigger, i.e. samples per frame, and number of ranks of each ADC */
+#if ADC_DUAL_MODE
+#define ADC_SCAN_CHANNELS               4
+#define ADC_SCAN_RANKS                  (ADC_SCAN_CHANNELS / 2)
+#else
+#define ADC_SCAN_CHANNELS               3
+#define ADC_SCAN_RANKS                  ADC_SCAN_CHANNELS
+#endif
 
 /* Definition for ADCx's NVIC */
 #define ADCx_IRQn                       ADC1_2_IRQn
 #define ADCx_IRQHandler                 ADC1_2_IRQHandler
 
+/* Definition for ADCx's DMA1_CHANNEL1 */
+#define ADCx_DMA_CLK_ENABLE()           __HAL_RCC_DMA1_CLK_ENABLE()
+#define ADCx_DMA_INSTANCE               DMA1_Channel1
+
+/* Definition for ADCx's DMA NVIC */
+#define ADCx_DMA_IRQn                   DMA1_Channel1_IRQn
+#define ADCx_DMA_IRQHandler             DMA1_Channel1_IRQHandler
+
+/* Size of the circular ADC DMA buffer in samples. The DMA raises one
+ interrupt per half buffer, i.e. every ADC_DMA_FRAMES frames, so that each
+ half holds whole frames */
+#define ADC_DMA_FRAMES                  128
+#define ADC_DMA_BUFFER_SIZE             (2 * ADC_DMA_FRAMES * ADC_SCAN_CHANNELS)
+
+/* Burst capture: on a KEY press the ADC leaves the TIM triggered profile and
+ converts the channels of the first rank of the scan table back to back, at
+ the minimum sampling time and from the HCLK ADC clock, until
+ ADC_BURST_FRAMES frames are in the burst buffer. The stream is then
+ restarted and the burst is written to the session file as a tagged record.
+ The stream frames missed meanwhile are accounted as dropped. The minimum
+ sampling time needs a low impedance source, as the buffered voltage and
+ current inputs */
+#define ADC_BURST_FRAMES                4096
+#if ADC_DUAL_MODE
+#define ADC_BURST_CHANNELS              2
+#else
+#define ADC_BURST_CHANNELS              1
+#endif
+#define ADC_BURST_SAMPLES               (ADC_BURST_FRAMES * ADC_BURST_CHANNELS)
+#define ADC_BURST_SAMPLETIME            ADC_SAMPLETIME_1CYCLE_5
+
+/* 72 MHz ADC clock, 1.5 sampling + 12.5 conversion cycles per frame */
+#define ADC_BURST_RATE_HZ               (72000000 / 14)
+
+/* A burst not complete after this time, e.g. after a DMA overrun, is
+ abandoned and the stream restarted */
+#define ADC_BURST_TIMEOUT_MS            10
+
+/* Event recorder: the analog watchdogs compare every conversion of the
+ watched channels with a window in hardware; the first conversion outside
+ raises an interrupt that triggers a record of EVENT_PRE_FRAMES frames
+ before the frame of that conversion and EVENT_POST_FRAMES from it on, at
+ the acquisition rate, before decimation. The watchdogs stay disarmed until
+ the record is on the card */
+#define EVENT_PRE_FRAMES                512
+#define EVENT_POST_FRAMES               256
+#define EVENT_WINDOW_SAMPLES            ((EVENT_PRE_FRAMES + EVENT_POST_FRAMES) * ADC_SCAN_CHANNELS)
+
+/* Watch windows: pack overvoltage and charge current spikes */
+#define EVENT_VBAT_LOW_VOLTS            0.0f
+#define EVENT_VBAT_HIGH_VOLTS           30.0f
+#define EVENT_IBAT_LOW_AMPS             -3.0f
+#define EVENT_IBAT_HIGH_AMPS            3.0f
+
 /* Definition for TIMx clock resources */
 #define TIMx                            TIM2
 #define TIMx_CLK_ENABLE()               __HAL_RCC_TIM2_CLK_ENABLE()
@@ -70,6 +175,85 @@
 #define TIMx_FORCE_RESET()              __HAL_RCC_TIM2_FORCE_RESET()
 #define TIMx_RELEASE_RESET()            __HAL_RCC_TIM2_RELEASE_RESET()
 
+/* TIMx update period in timer clock cycles: 72 MHz / 1800 = 40 kHz trigger,
+ each trigger converts one frame. The scan table converts in about 13 us (dual
+ mode) or 15 us, shorter sampling times allow 100 kHz and more */
+#define TIMx_PERIOD                     1800
+#define ADC_SAMPLE_RATE_HZ              (72000000 / TIMx_PERIOD)
+
+/* Decimation stage: the stream is low-pass filtered and stored at
+ LOG_SAMPLE_RATE_HZ, one frame every ADC_DECIMATION acquired frames (1 stores
+ every frame unfiltered, at most 255). The filter spans
+ ADC_DECIMATION_TAPS stored frames and runs on blocks of
+ ADC_DECIMATION_BLOCK_FRAMES acquired frames. ADC_DECIMATION_EXTRA_BITS
+ (0..3) bits of the averaged signal are kept beyond the 12 bits of the ADC,
+ the stream is then stored as 16-bit samples. Burst and event records keep
+ the acquired frames */
+#define ADC_DECIMATION                  40
+#define ADC_DECIMATION_DESIGN           DECIMATOR_DESIGN_BLACKMAN
+#define ADC_DECIMATION_TAPS             8
+#define ADC_DECIMATION_BLOCK_FRAMES     (4 * ADC_DECIMATION)
+#define ADC_DECIMATION_EXTRA_BITS       2
+#define ADC_DECIMATION_FAST             1
+#define ADC_DECIMATION_BUFFER_SIZE      DECIMATOR_BUFFER_SIZE(ADC_SCAN_CHANNELS, ADC_DECIMATION, ADC_DECIMATION_TAPS, ADC_DECIMATION_BLOCK_FRAMES)
+
+#define LOG_SAMPLE_RATE_HZ              (ADC_SAMPLE_RATE_HZ / ADC_DECIMATION)
+#if ADC_DECIMATION > 1
+#define LOG_RESOLUTION                  (12 + ADC_DECIMATION_EXTRA_BITS)
+#else
+#define LOG_RESOLUTION                  12
+#endif
+
+/* User can use this section to tailor the sample logger */
+/* Depth of the ADC to storage sample ring, in samples (power of two) */
+#define SAMPLE_RING_SIZE                4096
+
+/* Number of frames logged to a session file before it is closed, and the
+   corresponding number of samples */
+#define LOG_FRAME_LIMIT                 100000
+#define LOG_SAMPLE_LIMIT                (LOG_FRAME_LIMIT * ADC_SCAN_CHANNELS)
+
+/* Contiguous space reserved for a session file when it is created: the header and
+   the data blocks of LOG_SAMPLE_LIMIT samples */
+#if LOG_RESOLUTION > 12
+#define LOG_PREALLOC_SIZE               ((LOG_SAMPLE_LIMIT / LOG_BLOCK_SAMPLES16 + 2) * LOG_BLOCK_SIZE)
+#else
+#define LOG_PREALLOC_SIZE               ((LOG_SAMPLE_LIMIT / LOG_BLOCK_SAMPLES + 2) * LOG_BLOCK_SIZE)
+#endif
+
+/* Group commit of the session file: written data is committed to the card
+   after LOG_SYNC_BYTES bytes or LOG_SYNC_PERIOD_MS ms, whichever comes first,
+   bounding what a power failure can lose. 0 disables either limit */
+#define LOG_SYNC_BYTES                  (64 * LOG_BLOCK_SIZE)
+#define LOG_SYNC_PERIOD_MS              1000
+
+/* 1: commits inside the reserved space only flush data, the length of a
+   session cut short is recovered from its blocks at the next boot */
+#define LOG_APPEND_ONLY                 1
+
+/* Free clusters scanned by each step of the free space erase run after a
+   session is closed */
+#define LOG_ERASE_CLUSTERS              1024
+
+/* Level read on the KEY button while it is pressed, holding it at reset
+   formats the card, pressing it while logging captures a burst */
+#define KEY_PRESSED                     GPIO_PIN_SET
+
+/* Time the KEY button level must be stable before another press or release
+   is taken into account */
+#define KEY_DEBOUNCE_MS                 50
+
+/* ADC full scale, used for the calibration written to the log header */
+#define ADC_VREF_VOLTS                  3.3f
+#define ADC_FULL_SCALE                  4096
+
+/* Front end of the scanned channels: pack voltage divider ratio, current
+   sense amplifier output (V/A) and its output at zero current (V). The
+   thermistor divider is logged in volts */
+#define ADC_VBAT_DIVIDER                11.0f
+#define ADC_IBAT_VOLTS_PER_AMP          0.5f
+#define ADC_IBAT_ZERO_VOLTS             1.65f
+
 /* User can use this section to tailor DACx instance used and associated
  resources */
 /* Definition for DACx clock resources */
@@ -0,0 +1,70 @@
+/**
+ ******************************************************************************
+ * @file    sample_ring.h
+ * @brief   Header for sample_ring.c module
+ ******************************************************************************
+ */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SAMPLE_RING_H
+#define __SAMPLE_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "stm32f3xx_hal.h"
+
+/* Exported types ------------------------------------------------------------*/
+
+/**
+ * @brief  Single-producer/single-consumer sample ring.
+ *         Head is only written by the producer (ADC interrupt) and Tail only
+ *         by the consumer (storage stage in the main loop), so neither side
+ *         needs to mask interrupts. Both indexes run freely and are reduced
+ *         modulo Size on access, Size must therefore be a power of two.
+ */
+typedef struct {
+	uint16_t *pBuffer; /*!< Sample storage, Size entries                  */
+	uint32_t Size; /*!< Number of entries, power of two                   */
+	uint32_t FrameSize; /*!< Samples per frame, frames are queued or dropped
+	 as a whole                                                      */
+	__IO uint32_t Head; /*!< Producer index (free running)                */
+	__IO uint32_t Tail; /*!< Consumer index (free running)                */
+	__IO uint32_t Overflows; /*!< Samples dropped because the ring was full,
+	 or skipped                                                      */
+	__IO uint32_t HighWater; /*!< Highest fill level seen since last reset */
+} SampleRing_TypeDef;
+
+/**
+ * @brief  Ring statistics snapshot
+ */
+typedef struct {
+	uint32_t Size; /*!< Capacity in samples                               */
+	uint32_t Level; /*!< Samples currently queued                          */
+	uint32_t Overflows; /*!< Samples dropped because the ring was full, or
+	 skipped                                                         */
+	uint32_t HighWater; /*!< Highest fill level seen since last reset      */
+} SampleRing_StatsTypeDef;
+
+/* Exported constants --------------------------------------------------------*/
+/* Exported macro ------------------------------------------------------------*/
+/* Exported functions ------------------------------------------------------- */
+void SampleRing_Init(SampleRing_TypeDef *ring, uint16_t *pBuffer,
+		uint32_t Size, uint32_t FrameSize);
+uint32_t SampleRing_Put(SampleRing_TypeDef *ring, const uint16_t *pData,
+		uint32_t Count);
+void SampleRing_Skip(SampleRing_TypeDef *ring, uint32_t Count);
+uint32_t SampleRing_Get(SampleRing_TypeDef *ring, uint16_t *pData,
+		uint32_t Count);
+uint32_t SampleRing_Level(SampleRing_TypeDef *ring);
+void SampleRing_GetStats(SampleRing_TypeDef *ring,
+		SampleRing_StatsTypeDef *pStats);
+void SampleRing_ResetStats(SampleRing_TypeDef *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SAMPLE_RING_H */
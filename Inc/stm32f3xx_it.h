@@ -49,7 +49,11 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 void EXTI9_5_IRQHandler(void);
+void ADCx_DMA_IRQHandler(void);
 void ADCx_IRQHandler(void);
+void EVAL_SPIx_DMA_TX_IRQHandler(void);
+void EVAL_SPIx_DMA_RX_IRQHandler(void);
+void EVAL_SD_BUSY_TIM_IRQHandler(void);
 #ifdef __cplusplus
 }
 #endif
@@ -39,6 +39,13 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 DWORD get_fattime (void);
 
+/* Parameters of CTRL_WRITE_START */
+typedef struct {
+	const BYTE*	buff;	/* Data to be written, left untouched until CTRL_WRITE_WAIT */
+	DWORD	sector;		/* Start sector */
+	UINT	count;		/* Number of sectors */
+} DWRITE;
+
 /* Disk Status Bits (DSTATUS) */
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
@@ -60,6 +67,9 @@ DWORD get_fattime (void);
 #define CTRL_LOCK			6	/* Lock/Unlock media removal */
 #define CTRL_EJECT			7	/* Eject media */
 #define CTRL_FORMAT			8	/* Create physical format on the media */
+#define CTRL_ERASE			9	/* Erase a block of sectors (DWORD[2]: start, end) */
+#define CTRL_WRITE_START	17	/* Start writing sectors and return at once (DWRITE, needed at _USE_STREAM_ASYNC == 1) */
+#define CTRL_WRITE_WAIT		18	/* Wait for the end of the write started by CTRL_WRITE_START (needed at _USE_STREAM_ASYNC == 1) */
 
 /* MMC/SDC specific ioctl command */
 #define MMC_GET_TYPE		10	/* Get card type */
@@ -67,6 +77,8 @@ DWORD get_fattime (void);
 #define MMC_GET_CID			12	/* Get CID */
 #define MMC_GET_OCR			13	/* Get OCR */
 #define MMC_GET_SDSTAT		14	/* Get SD status */
+#define MMC_GET_STATS		15	/* Get driver timing statistics */
+#define MMC_RESET_STATS		16	/* Clear driver timing statistics */
 
 /* ATA/CF specific ioctl command */
 #define ATA_GET_REV			20	/* Get F/W revision */
@@ -33,11 +33,30 @@
 /* Private define ------------------------------------------------------------*/
 /* Block Size in Bytes */
 #define BLOCK_SIZE                512
+/* Largest range in blocks erased by one erase command, keeps each command well
+   within the erase timeout of the BSP */
+#define ERASE_MAX_BLOCKS          65536
 
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
 
+#if (_USE_WRITE == 1) && (_SD_WRITE_BUFFER_SECTORS > 0)
+/* Write-back buffer: a run of consecutive sectors not yet written to the card */
+static uint32_t WrBuffer[_SD_WRITE_BUFFER_SECTORS * BLOCK_SIZE / 4];
+static DWORD WrSector;
+static UINT WrCount;
+#endif
+
+#if _SD_READ_AHEAD_SECTORS > 0
+/* Read-ahead buffer: sectors fetched past the end of a sequential read */
+static uint32_t RdBuffer[_SD_READ_AHEAD_SECTORS * BLOCK_SIZE / 4];
+static DWORD RdSector;
+static UINT RdCount;
+static DWORD RdNext;        /* Sector following the last read request */
+static DWORD CardSectors;   /* Card size, bounds the read-ahead */
+#endif
+
 /* Private function prototypes -----------------------------------------------*/
 DSTATUS SD_initialize (BYTE);
 DSTATUS SD_status (BYTE);
@@ -48,6 +67,14 @@ DRESULT SD_read (BYTE, BYTE*, DWORD, UINT);
 #if _USE_IOCTL == 1
   DRESULT SD_ioctl (BYTE, BYTE, void*);
 #endif  /* _USE_IOCTL == 1 */
+static DRESULT SD_ReadCard(BYTE *buff, DWORD sector, UINT count);
+#if (_USE_WRITE == 1) && (_SD_WRITE_BUFFER_SECTORS > 0)
+static DRESULT SD_FlushWrites(void);
+#endif
+#if _USE_WRITE == 1
+static DRESULT SD_Erase(DWORD start, DWORD end);
+static DRESULT SD_WriteStart(const DWRITE *wr);
+#endif
   
 const Diskio_drvTypeDef  SD_Driver =
 {
@@ -72,12 +99,32 @@ const Diskio_drvTypeDef  SD_Driver =
   */
 DSTATUS SD_initialize(BYTE lun)
 {
+#if _SD_READ_AHEAD_SECTORS > 0
+  SD_CardInfo CardInfo;
+  
+#endif
   Stat = STA_NOINIT;
+#if (_USE_WRITE == 1) && (_SD_WRITE_BUFFER_SECTORS > 0)
+  /* A run still buffered goes to the card before it is initialized again,
+     the init fails if it cannot be written */
+  if(SD_FlushWrites() != RES_OK)
+  {
+    return Stat;
+  }
+#endif
+#if _SD_READ_AHEAD_SECTORS > 0
+  RdCount = 0;
+  RdNext = 0;
+#endif
   
   /* Configure the uSD device */
   if(BSP_SD_Init() == MSD_OK)
   {
     Stat &= ~STA_NOINIT;
+#if _SD_READ_AHEAD_SECTORS > 0
+    BSP_SD_GetCardInfo(&CardInfo);
+    CardSectors = CardInfo.CardCapacity / BLOCK_SIZE;
+#endif
   }
 
   return Stat;
@@ -106,14 +153,94 @@ DSTATUS SD_status(BYTE lun)
   * @param  *buff: Data buffer to store read data
   * @param  sector: Sector address (LBA)
   * @param  count: Number of sectors to read (1..128)
+  * @note   The whole run is passed in one call so that the BSP can read it
+  *         with a single READ_MULTIPLE_BLOCK transaction.
+  * @note   With _SD_READ_AHEAD_SECTORS, sectors already read ahead are copied
+  *         from RAM, and a short read that continues the previous one reads
+  *         a whole buffer of sectors from the card.
   * @retval DRESULT: Operation result
   */
 DRESULT SD_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_OK;
+#if _SD_READ_AHEAD_SECTORS > 0
+  UINT n;
+  
+  /* Leading sectors already read ahead */
+  if((RdCount != 0) && (sector >= RdSector) && (sector < RdSector + RdCount))
+  {
+    n = RdSector + RdCount - sector;
+    if(n > count)
+    {
+      n = count;
+    }
+    memcpy(buff, (BYTE*)RdBuffer + (sector - RdSector) * BLOCK_SIZE, n * BLOCK_SIZE);
+    buff += n * BLOCK_SIZE;
+    sector += n;
+    count -= n;
+  }
+  
+  /* Sequential access, read the next sectors along with the request */
+  if((count != 0) && (count < _SD_READ_AHEAD_SECTORS) && (sector < CardSectors) &&
+     ((sector == RdNext) || ((RdCount != 0) && (sector == RdSector + RdCount))))
+  {
+    n = _SD_READ_AHEAD_SECTORS;
+    if(n > CardSectors - sector)
+    {
+      n = CardSectors - sector;
+    }
+    if(n > count)
+    {
+      RdCount = 0;
+      res = SD_ReadCard((BYTE*)RdBuffer, sector, n);
+      if(res == RES_OK)
+      {
+        RdSector = sector;
+        RdCount = n;
+        memcpy(buff, RdBuffer, count * BLOCK_SIZE);
+        sector += count;
+        count = 0;
+      }
+    }
+  }
+  
+  if((res == RES_OK) && (count != 0))
+  {
+    res = SD_ReadCard(buff, sector, count);
+    sector += count;
+  }
+  RdNext = sector;
+#else
+  res = SD_ReadCard(buff, sector, count);
+#endif /* _SD_READ_AHEAD_SECTORS > 0 */
+  
+  return res;
+}
+
+/**
+  * @brief  Reads Sector(s) from the card
+  * @param  *buff: Data buffer to store read data
+  * @param  sector: Sector address (LBA)
+  * @param  count: Number of sectors to read
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_ReadCard(BYTE *buff, DWORD sector, UINT count)
+{
+  DRESULT res = RES_OK;
+  
+#if (_USE_WRITE == 1) && (_SD_WRITE_BUFFER_SECTORS > 0)
+  /* The card must see the buffered sectors before they are read back */
+  if((WrCount != 0) && (sector < WrSector + WrCount) && (sector + count > WrSector))
+  {
+    if(SD_FlushWrites() != RES_OK)
+    {
+      return RES_ERROR;
+    }
+  }
+#endif
   
   if(BSP_SD_ReadBlocks((uint32_t*)buff, 
-                       (uint64_t) (sector * BLOCK_SIZE), 
+                       (uint64_t)sector * BLOCK_SIZE, 
                        BLOCK_SIZE, 
                        count) != MSD_OK)
   {
@@ -129,6 +256,10 @@ DRESULT SD_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
   * @param  *buff: Data to be written
   * @param  sector: Sector address (LBA)
   * @param  count: Number of sectors to write (1..128)
+  * @note   With _SD_WRITE_BUFFER_SECTORS, writes that rewrite or extend the
+  *         buffered run are only copied to the buffer. Any other write
+  *         flushes the run first, then starts a new one or, when it is as
+  *         large as the buffer, goes to the card directly.
   * @retval DRESULT: Operation result
   */
 #if _USE_WRITE == 1
@@ -136,12 +267,167 @@ DRESULT SD_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_OK;
   
+#if _SD_READ_AHEAD_SECTORS > 0
+  /* Sectors read ahead are stale once written */
+  if((RdCount != 0) && (sector < RdSector + RdCount) && (sector + count > RdSector))
+  {
+    RdCount = 0;
+  }
+#endif
+  
+#if _SD_WRITE_BUFFER_SECTORS > 0
+  if((WrCount != 0) && (sector >= WrSector) && (sector <= WrSector + WrCount) &&
+     (sector - WrSector + count <= _SD_WRITE_BUFFER_SECTORS))
+  {
+    /* Rewrite or continuation of the buffered run */
+    memcpy((BYTE*)WrBuffer + (sector - WrSector) * BLOCK_SIZE, buff, count * BLOCK_SIZE);
+    if(sector - WrSector + count > WrCount)
+    {
+      WrCount = sector - WrSector + count;
+    }
+  }
+  else
+  {
+    res = SD_FlushWrites();
+    if((res == RES_OK) && (count < _SD_WRITE_BUFFER_SECTORS))
+    {
+      /* Start a new run */
+      memcpy(WrBuffer, buff, count * BLOCK_SIZE);
+      WrSector = sector;
+      WrCount = count;
+    }
+    else if(res == RES_OK)
+    {
+      if(BSP_SD_WriteBlocks((uint32_t*)buff, 
+                            (uint64_t)sector * BLOCK_SIZE, 
+                            BLOCK_SIZE, count) != MSD_OK)
+      {
+        res = RES_ERROR;
+      }
+    }
+  }
+  
+  /* A full buffer cannot be extended any further */
+  if(WrCount == _SD_WRITE_BUFFER_SECTORS)
+  {
+    res = SD_FlushWrites();
+  }
+#else
   if(BSP_SD_WriteBlocks((uint32_t*)buff, 
-                        (uint64_t)(sector * BLOCK_SIZE), 
+                        (uint64_t)sector * BLOCK_SIZE, 
                         BLOCK_SIZE, count) != MSD_OK)
   {
     res = RES_ERROR;
   }
+#endif /* _SD_WRITE_BUFFER_SECTORS > 0 */
+  
+  return res;
+}
+
+#if _SD_WRITE_BUFFER_SECTORS > 0
+/**
+  * @brief  Writes the buffered run of sectors to the card
+  * @note   The run is dropped even if the write fails, the error is reported
+  *         to FatFs which marks the file object as failed.
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_FlushWrites(void)
+{
+  DRESULT res = RES_OK;
+  
+  if(WrCount != 0)
+  {
+    if(BSP_SD_WriteBlocks(WrBuffer, 
+                          (uint64_t)WrSector * BLOCK_SIZE, 
+                          BLOCK_SIZE, WrCount) != MSD_OK)
+    {
+      res = RES_ERROR;
+    }
+    WrCount = 0;
+  }
+  
+  return res;
+}
+#endif /* _SD_WRITE_BUFFER_SECTORS > 0 */
+
+/**
+  * @brief  Starts writing Sector(s) and returns without waiting for the card
+  * @param  wr: buffer, first sector and number of sectors. The buffer must
+  *         stay untouched until the end of the write, see CTRL_WRITE_WAIT.
+  * @note   The card keeps programming in the background; any other access
+  *         through the BSP waits for the write to end first.
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_WriteStart(const DWRITE *wr)
+{
+  DRESULT res = RES_OK;
+  
+#if _SD_READ_AHEAD_SECTORS > 0
+  /* Sectors read ahead are stale once written */
+  if((RdCount != 0) && (wr->sector < RdSector + RdCount) && (wr->sector + wr->count > RdSector))
+  {
+    RdCount = 0;
+  }
+#endif
+#if _SD_WRITE_BUFFER_SECTORS > 0
+  /* Buffered sectors go to the card first, in order */
+  res = SD_FlushWrites();
+#endif
+  
+  if((res == RES_OK) &&
+     (BSP_SD_WriteBlocks_Async((uint32_t*)wr->buff, 
+                               (uint64_t)wr->sector * BLOCK_SIZE, 
+                               BLOCK_SIZE, wr->count) != MSD_OK))
+  {
+    res = RES_ERROR;
+  }
+  
+  return res;
+}
+
+/**
+  * @brief  Erases Sector(s)
+  * @param  start: First sector address (LBA)
+  * @param  end: Last sector address (LBA)
+  * @note   Erased sectors read back as all 0x00 or all 0xFF depending on the
+  *         card. Large ranges are erased in several commands.
+  * @retval DRESULT: Operation result
+  */
+static DRESULT SD_Erase(DWORD start, DWORD end)
+{
+  DRESULT res = RES_OK;
+  DWORD last;
+  
+  if(end < start)
+  {
+    return RES_PARERR;
+  }
+  
+#if _SD_READ_AHEAD_SECTORS > 0
+  /* Sectors read ahead are stale once erased */
+  if((RdCount != 0) && (start < RdSector + RdCount) && (end >= RdSector))
+  {
+    RdCount = 0;
+  }
+#endif
+#if _SD_WRITE_BUFFER_SECTORS > 0
+  /* Buffered sectors were written before the erase */
+  res = SD_FlushWrites();
+#endif
+  
+  while(res == RES_OK)
+  {
+    last = ((end - start) < ERASE_MAX_BLOCKS) ? end : (start + ERASE_MAX_BLOCKS - 1);
+    if(BSP_SD_Erase((uint64_t)start * BLOCK_SIZE, (uint64_t)last * BLOCK_SIZE) != MSD_OK)
+    {
+      res = RES_ERROR;
+    }
+    if(last == end)
+    {
+      break;
+    }
+    start = last + 1;
+  }
   
   return res;
 }
@@ -159,6 +445,7 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
 {
   DRESULT res = RES_ERROR;
   SD_CardInfo CardInfo;
+  SD_Status SDStatus;
   
   if (Stat & STA_NOINIT) return RES_NOTRDY;
   
@@ -166,7 +453,11 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
   {
   /* Make sure that no pending write process */
   case CTRL_SYNC :
+#if (_USE_WRITE == 1) && (_SD_WRITE_BUFFER_SECTORS > 0)
+    res = SD_FlushWrites();
+#else
     res = RES_OK;
+#endif
     break;
   
   /* Get number of sectors on the disk (DWORD) */
@@ -182,9 +473,66 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
     res = RES_OK;
     break;
   
-  /* Get erase block size in unit of sector (DWORD) */
+  /* Get erase block size in unit of sector (DWORD): the allocation unit of
+     the card, or its erase sector for cards without SD Status */
   case GET_BLOCK_SIZE :
-    *(DWORD*)buff = BLOCK_SIZE;
+    if((BSP_SD_GetSDStatus(&SDStatus) == MSD_OK) && (SDStatus.AllocationUnit != 0))
+    {
+      *(DWORD*)buff = SDStatus.AllocationUnit / BLOCK_SIZE;
+    }
+    else
+    {
+      BSP_SD_GetCardInfo(&CardInfo);
+      *(DWORD*)buff = (((DWORD)CardInfo.Csd.EraseGrMul + 1) << CardInfo.Csd.MaxWrBlockLen) / BLOCK_SIZE;
+      if(*(DWORD*)buff == 0)
+      {
+        *(DWORD*)buff = 1;
+      }
+    }
+    res = RES_OK;
+    break;
+  
+#if _USE_WRITE == 1
+  /* Erase a block of sectors (DWORD[2]: first and last sector) */
+  case CTRL_ERASE :
+    res = SD_Erase(((DWORD*)buff)[0], ((DWORD*)buff)[1]);
+    break;
+  
+  /* Sectors no longer in use (DWORD[2]: first and last sector): erasing them
+     now saves the card an erase when they are written again */
+  case CTRL_TRIM :
+    res = SD_Erase(((DWORD*)buff)[0], ((DWORD*)buff)[1]);
+    break;
+  
+  /* Start writing sectors and return at once (DWRITE) */
+  case CTRL_WRITE_START :
+    res = SD_WriteStart((const DWRITE*)buff);
+    break;
+  
+  /* Wait for the end of the write started by CTRL_WRITE_START */
+  case CTRL_WRITE_WAIT :
+    while(BSP_SD_GetTransferState() == SD_TRANSFER_BUSY)
+    {
+    }
+    res = (BSP_SD_GetTransferState() == SD_TRANSFER_OK) ? RES_OK : RES_ERROR;
+    break;
+#endif /* _USE_WRITE == 1 */
+  
+  /* Get the SD Status register (SD_Status) */
+  case MMC_GET_SDSTAT :
+    res = (BSP_SD_GetSDStatus((SD_Status*)buff) == MSD_OK) ? RES_OK : RES_ERROR;
+    break;
+  
+  /* Get the driver timing statistics (SD_Stats) */
+  case MMC_GET_STATS :
+    BSP_SD_GetStats((SD_Stats*)buff);
+    res = RES_OK;
+    break;
+  
+  /* Clear the driver timing statistics */
+  case MMC_RESET_STATS :
+    BSP_SD_ResetStats();
+    res = RES_OK;
     break;
   
   default:
@@ -176,6 +176,30 @@
 
 
 /* File access control feature */
+#if _FS_CACHE_SECTORS && _FS_TINY
+#error _FS_CACHE_SECTORS cannot be used at tiny configuration
+#endif
+
+#if _USE_STREAM && (!_USE_EXPAND || _FS_READONLY)
+#error _USE_STREAM requires _USE_EXPAND and a writable configuration
+#endif
+
+#if _USE_STREAM_ASYNC && !_USE_STREAM
+#error _USE_STREAM_ASYNC requires _USE_STREAM
+#endif
+
+#if _FS_FREEMAP
+#if _FS_READONLY
+#error _FS_FREEMAP must be 0 at read-only configuration
+#endif
+#define	FMAP_BIT(fs, c)		((c) >> (fs)->fmshift)
+#define	FMAP_TEST(fs, c)	((fs)->fmap[FMAP_BIT(fs, c) / 8] & (1 << FMAP_BIT(fs, c) % 8))
+#define	FMAP_SET(fs, c)		((fs)->fmap[FMAP_BIT(fs, c) / 8] |= (BYTE)(1 << FMAP_BIT(fs, c) % 8))
+#define	FMAP_CLR(fs, c)		((fs)->fmap[FMAP_BIT(fs, c) / 8] &= (BYTE)~(1 << FMAP_BIT(fs, c) % 8))
+#endif
+
+
+
 #if _FS_LOCK
 #if _FS_READONLY
 #error _FS_LOCK must be 0 at read-only configuration
@@ -518,6 +542,10 @@ static BYTE CurrVol;			/* Current drive */
 static FILESEM Files[_FS_LOCK];	/* Open object lock semaphores */
 #endif
 
+#if _FS_CACHE_SECTORS
+static UINT CacheBuf[_VOLUMES][_FS_CACHE_SECTORS][_MAX_SS / 4] _FS_CACHE_ATTR;	/* Sector cache buffers */
+#endif
+
 #if _USE_LFN == 0			/* Non LFN feature */
 #define	DEFINE_NAMEBUF		BYTE sfn[12]
 #define INIT_BUF(dobj)		(dobj).fn = sfn
@@ -765,6 +793,76 @@ void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Sector cache behind the disk access window                            */
+/*-----------------------------------------------------------------------*/
+/* The cache slots and the window always hold different sectors. A sector
+/  enters the window by exchanging contents with its slot on a hit, or with
+/  the least recently used slot on a miss, and the sector leaving the window
+/  stays cached with its dirty flag. Only the window is ever transferred to
+/  or from the disk. */
+#if _FS_CACHE_SECTORS
+static
+void cache_swap (
+	FATFS* fs,		/* File system object */
+	UINT i			/* Cache slot to exchange with the window */
+)
+{
+	UINT *s = fs->cbuf + i * (_MAX_SS / 4), t, n;
+	DWORD sect;
+	BYTE flag;
+
+
+	for (n = 0; n < SS(fs) / 4; n++) {
+		t = fs->win.d32[n]; fs->win.d32[n] = s[n]; s[n] = t;
+	}
+	sect = fs->csect[i]; fs->csect[i] = fs->winsect; fs->winsect = sect;
+	flag = fs->cflag[i]; fs->cflag[i] = fs->wflag; fs->wflag = flag;
+	fs->cstamp[i] = ++fs->ctick;
+}
+
+
+static
+UINT cache_slot (	/* Cache slot holding the sector, else the slot to be reused */
+	FATFS* fs,		/* File system object */
+	DWORD sect		/* Sector# to look up */
+)
+{
+	UINT i, lru = 0;
+
+
+	for (i = 0; i < _FS_CACHE_SECTORS; i++) {
+		if (fs->csect[i] == sect) return i;
+		if (fs->csect[lru] != 0xFFFFFFFF
+			&& (fs->csect[i] == 0xFFFFFFFF || fs->ctick - fs->cstamp[i] > fs->ctick - fs->cstamp[lru]))
+			lru = i;	/* Empty or least recently used slot */
+	}
+	return lru;
+}
+
+
+static
+void cache_invalidate (
+	FATFS* fs,		/* File system object */
+	DWORD sect,		/* First sector# to discard */
+	DWORD nsect		/* Number of sectors */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_CACHE_SECTORS; i++) {
+		if (fs->csect[i] - sect < nsect) {
+			fs->csect[i] = 0xFFFFFFFF;
+			fs->cflag[i] = 0;
+		}
+	}
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the file system object               */
 /*-----------------------------------------------------------------------*/
@@ -785,6 +883,9 @@ FRESULT sync_window (
 			res = FR_DISK_ERR;
 		} else {
 			fs->wflag = 0;
+#if _FS_CACHE_SECTORS
+			cache_invalidate(fs, wsect, 1);		/* Discard an older cached copy */
+#endif
 			if (wsect - fs->fatbase < fs->fsize) {		/* Is it in the FAT area? */
 				for (nf = fs->n_fats; nf >= 2; nf--) {	/* Reflect the change to all FAT copies */
 					wsect += fs->fsize;
@@ -795,6 +896,28 @@ FRESULT sync_window (
 	}
 	return res;
 }
+
+
+#if _FS_CACHE_SECTORS
+static
+FRESULT cache_flush (	/* Write back the window and all dirty cache slots */
+	FATFS* fs		/* File system object */
+)
+{
+	FRESULT res;
+	UINT i;
+
+
+	res = sync_window(fs);
+	for (i = 0; i < _FS_CACHE_SECTORS && res == FR_OK; i++) {
+		if (fs->cflag[i]) {
+			cache_swap(fs, i);		/* Bring the dirty sector into the window */
+			res = sync_window(fs);	/* and write it from there */
+		}
+	}
+	return res;
+}
+#endif
 #endif
 
 
@@ -805,9 +928,20 @@ FRESULT move_window (
 )
 {
 	FRESULT res = FR_OK;
+#if _FS_CACHE_SECTORS
+	UINT i;
+#endif
 
 
 	if (sector != fs->winsect) {	/* Window offset changed? */
+#if _FS_CACHE_SECTORS
+		i = cache_slot(fs, sector);
+		if (fs->csect[i] == sector) {	/* Cache hit? */
+			cache_swap(fs, i);
+			return FR_OK;
+		}
+		cache_swap(fs, i);			/* Park the window, the evicted sector comes in */
+#endif
 #if !_FS_READONLY
 		res = sync_window(fs);		/* Write-back changes */
 #endif
@@ -835,28 +969,52 @@ FRESULT sync_fs (	/* FR_OK: successful, FR_DISK_ERR: failed */
 )
 {
 	FRESULT res;
+	DWORD nfree;
 
 
+#if _FS_CACHE_SECTORS
+	res = cache_flush(fs);
+#else
 	res = sync_window(fs);
+#endif
 	if (res == FR_OK) {
 		/* Update FSINFO sector if needed */
+#if _FS_LAZY_FSINFO
+		if (fs->fs_type == FS_FAT32 && !(fs->fsi_flag & 0x80) && (fs->fsi_flag & 3)
+			&& (fs->fsi_flag & 6) != 6) {
+#else
 		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
+#endif
+			nfree = fs->free_clust;
+#if _FS_LAZY_FSINFO
+			if (fs->fsi_flag & 4) nfree = 0xFFFFFFFF;	/* Checkpoint of an open file: the count is left unknown */
+#endif
 			/* Create FSINFO structure */
 			mem_set(fs->win.d8, 0, SS(fs));
 			ST_WORD(fs->win.d8 + BS_55AA, 0xAA55);
 			ST_DWORD(fs->win.d8 + FSI_LeadSig, 0x41615252);
 			ST_DWORD(fs->win.d8 + FSI_StrucSig, 0x61417272);
-			ST_DWORD(fs->win.d8 + FSI_Free_Count, fs->free_clust);
+			ST_DWORD(fs->win.d8 + FSI_Free_Count, nfree);
 			ST_DWORD(fs->win.d8 + FSI_Nxt_Free, fs->last_clust);
 			/* Write it into the FSINFO sector */
 			fs->winsect = fs->volbase + 1;
+#if _FS_CACHE_SECTORS
+			cache_invalidate(fs, fs->winsect, 1);
+#endif
 			disk_write(fs->drv, fs->win.d8, fs->winsect, 1);
+#if _FS_LAZY_FSINFO
+			fs->fsi_flag = (fs->fsi_flag & 4) ? 2 : 0;	/* bit1: the count on the volume is unknown */
+#else
 			fs->fsi_flag = 0;
+#endif
 		}
 		/* Make sure that no pending write process in the physical drive */
 		if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK)
 			res = FR_DISK_ERR;
 	}
+#if _FS_LAZY_FSINFO
+	fs->fsi_flag &= ~4;
+#endif
 
 	return res;
 }
@@ -993,6 +1151,10 @@ FRESULT put_fat (
 		default :
 			res = FR_INT_ERR;
 		}
+#if _FS_FREEMAP
+		if (res == FR_OK && (val & 0x0FFFFFFF) == 0)
+			FMAP_SET(fs, clst);		/* The group has a free cluster now */
+#endif
 	}
 
 	return res;
@@ -1030,6 +1192,9 @@ FRESULT remove_chain (
 			if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }	/* Disk error? */
 			res = put_fat(fs, clst, 0);			/* Mark the cluster "empty" */
 			if (res != FR_OK) break;
+#if _FS_CACHE_SECTORS
+			cache_invalidate(fs, clust2sect(fs, clst), fs->csize);	/* Drop cached sectors of the freed cluster */
+#endif
 			if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
 				fs->free_clust++;
 				fs->fsi_flag |= 1;
@@ -1067,6 +1232,10 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 {
 	DWORD cs, ncl, scl;
 	FRESULT res;
+#if _FS_FREEMAP
+	DWORD n;
+	BYTE gscan = 0;
+#endif
 
 
 	if (clst == 0) {		/* Create a new chain */
@@ -1088,10 +1257,26 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 			ncl = 2;
 			if (ncl > scl) return 0;	/* No free cluster */
 		}
+#if _FS_FREEMAP
+		if (!FMAP_TEST(fs, ncl)) {		/* Skip a group known to be full */
+			n = (FMAP_BIT(fs, ncl) + 1) << fs->fmshift;
+			if (scl - ncl < n - ncl) return 0;	/* No free cluster (start point skipped) */
+			ncl = n - 1;
+			continue;
+		}
+		if (ncl == 2 || !(ncl & ((1UL << fs->fmshift) - 1)))
+			gscan = 1;					/* Scanning a group from its first cluster */
+#endif
 		cs = get_fat(fs, ncl);			/* Get the cluster status */
 		if (cs == 0) break;				/* Found a free cluster */
 		if (cs == 0xFFFFFFFF || cs == 1)/* An error occurred */
 			return cs;
+#if _FS_FREEMAP
+		if (gscan && (!((ncl + 1) & ((1UL << fs->fmshift) - 1)) || ncl + 1 == fs->n_fatent)) {
+			FMAP_CLR(fs, ncl);			/* Whole group scanned without a free cluster */
+			gscan = 0;
+		}
+#endif
 		if (ncl == scl) return 0;		/* No free cluster */
 	}
 
@@ -2251,6 +2436,10 @@ BYTE check_fs (	/* 0:FAT boor sector, 1:Valid boor sector but not FAT, 2:Not a b
 )
 {
 	fs->wflag = 0; fs->winsect = 0xFFFFFFFF;	/* Invaidate window */
+#if _FS_CACHE_SECTORS
+	mem_set(fs->csect, 0xFF, sizeof fs->csect);	/* Invalidate sector cache */
+	mem_set(fs->cflag, 0, sizeof fs->cflag);
+#endif
 	if (move_window(fs, sect) != FR_OK)			/* Load boot record */
 		return 3;
 
@@ -2383,6 +2572,10 @@ FRESULT find_volume (	/* FR_OK(0): successful, !=0: any error occurred */
 	fs->volbase = bsect;								/* Volume start sector */
 	fs->fatbase = bsect + nrsv; 						/* FAT start sector */
 	fs->database = bsect + sysect;						/* Data start sector */
+#if _FS_FREEMAP
+	for (fs->fmshift = 0; (fs->n_fatent - 1) >> fs->fmshift >= _FS_FREEMAP * 8; fs->fmshift++) ;
+	mem_set(fs->fmap, 0xFF, _FS_FREEMAP);				/* Every group may have a free cluster */
+#endif
 	if (fmt == FS_FAT32) {
 		if (fs->n_rootdir) return FR_NO_FILESYSTEM;		/* (BPB_RootEntCnt must be 0) */
 		fs->dirbase = LD_DWORD(fs->win.d8 + BPB_RootClus);	/* Root directory start cluster */
@@ -2500,6 +2693,9 @@ FRESULT f_mount (
 
 	if (fs) {
 		fs->fs_type = 0;				/* Clear new fs object */
+#if _FS_CACHE_SECTORS
+		fs->cbuf = CacheBuf[vol][0];	/* Attach the sector cache of the volume */
+#endif
 #if _FS_REENTRANT						/* Create sync object for the new volume */
 		if (!ff_cre_syncobj((BYTE)vol, &fs->sobj)) return FR_INT_ERR;
 #endif
@@ -2691,6 +2887,11 @@ FRESULT f_read (
 					if (fp->cltbl)
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					else
+#endif
+#if _USE_EXPAND && !_FS_READONLY
+					if (fp->flag & FA__CONTIG)
+						clst = fp->clust + 1;				/* Contiguous chain needs no FAT access */
+					else
 #endif
 						clst = get_fat(fp->fs, fp->clust);	/* Follow cluster chain on the FAT */
 				}
@@ -2795,7 +2996,17 @@ FRESULT f_write (
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					else
 #endif
+#if _USE_EXPAND
+					if ((fp->flag & FA__CONTIG) && fp->fptr < fp->fsize)
+						clst = fp->clust + 1;	/* Inside the contiguous block, no FAT access */
+					else
+#endif
+					{
 						clst = create_chain(fp->fs, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+#if _USE_EXPAND
+						fp->flag &= ~FA__CONTIG;	/* A stretched chain may no longer be contiguous */
+#endif
+					}
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
 				if (clst == 1) ABORT(fp->fs, FR_INT_ERR);
@@ -2910,6 +3121,9 @@ FRESULT f_sync (
 				ST_WORD(dir + DIR_LstAccDate, 0);
 				fp->flag &= ~FA__WRITTEN;
 				fp->fs->wflag = 1;
+#if _FS_LAZY_FSINFO
+				fp->fs->fsi_flag |= 4;						/* Defer the free cluster count to f_close() */
+#endif
 				res = sync_fs(fp->fs);
 			}
 		}
@@ -2940,6 +3154,10 @@ FRESULT f_close (
 #endif
 	{
 		res = validate(fp);				/* Lock volume */
+#if !_FS_READONLY && _FS_LAZY_FSINFO
+		if (res == FR_OK && (fp->fs->fsi_flag & 2))
+			res = sync_fs(fp->fs);		/* Write the free cluster count deferred by f_sync() */
+#endif
 		if (res == FR_OK) {
 #if _FS_REENTRANT
 			FATFS *fs = fp->fs;
@@ -3243,6 +3461,9 @@ FRESULT f_lseek (
 		if (fp->fptr > fp->fsize) {			/* Set file change flag if the file size is extended */
 			fp->fsize = fp->fptr;
 			fp->flag |= FA__WRITTEN;
+#if _USE_EXPAND
+			fp->flag &= ~FA__CONTIG;		/* The chain was stretched and may no longer be contiguous */
+#endif
 		}
 #endif
 	}
@@ -3498,13 +3719,21 @@ FRESULT f_getfree (
 			/* Get number of free clusters */
 			fat = fs->fs_type;
 			n = 0;
+#if _FS_FREEMAP
+			mem_set(fs->fmap, 0, _FS_FREEMAP);	/* Rebuild the free cluster map */
+#endif
 			if (fat == FS_FAT12) {
 				clst = 2;
 				do {
 					stat = get_fat(fs, clst);
 					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
 					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) n++;
+					if (stat == 0) {
+						n++;
+#if _FS_FREEMAP
+						FMAP_SET(fs, clst);
+#endif
+					}
 				} while (++clst < fs->n_fatent);
 			} else {
 				clst = fs->n_fatent;
@@ -3518,14 +3747,24 @@ FRESULT f_getfree (
 						i = SS(fs);
 					}
 					if (fat == FS_FAT16) {
-						if (LD_WORD(p) == 0) n++;
+						stat = LD_WORD(p);
 						p += 2; i -= 2;
 					} else {
-						if ((LD_DWORD(p) & 0x0FFFFFFF) == 0) n++;
+						stat = LD_DWORD(p) & 0x0FFFFFFF;
 						p += 4; i -= 4;
 					}
+					if (stat == 0) {
+						n++;
+#if _FS_FREEMAP
+						FMAP_SET(fs, fs->n_fatent - clst);
+#endif
+					}
 				} while (--clst);
 			}
+#if _FS_FREEMAP
+			if (res != FR_OK)
+				mem_set(fs->fmap, 0xFF, _FS_FREEMAP);	/* Map is not reliable */
+#endif
 			fs->free_clust = n;
 			fs->fsi_flag |= 1;
 			*nclst = n;
@@ -3537,6 +3776,68 @@ FRESULT f_getfree (
 
 
 
+#if _USE_TRIM
+/*-----------------------------------------------------------------------*/
+/* Trim Free Clusters                                                    */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_trimfree (
+	const TCHAR* path,	/* Path name of the logical drive number */
+	DWORD* clst,		/* Cluster# to start from (0:first one), next cluster# to scan on return (0:end of the volume) */
+	DWORD ncl			/* Number of clusters to scan */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD cl, scl, stat, rt[2];
+
+
+	/* Get logical drive number */
+	res = find_volume(&fs, &path, 1);
+	if (res == FR_OK) {
+		cl = *clst;
+		if (cl < 2 || cl >= fs->n_fatent) cl = 2;
+		scl = 0;
+		for ( ; ncl && cl < fs->n_fatent; ncl--, cl++) {
+#if _FS_FREEMAP
+			if (!FMAP_TEST(fs, cl)) {	/* A group known to be full ends the free block */
+				stat = 2;
+			} else
+#endif
+			stat = get_fat(fs, cl);			/* Get the cluster status */
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) {				/* Free cluster */
+				if (!scl) scl = cl;			/* Start of a contiguous free block */
+				continue;
+			}
+			if (scl) {						/* End of a contiguous free block */
+				rt[0] = clust2sect(fs, scl);					/* Start sector */
+				rt[1] = clust2sect(fs, cl - 1) + fs->csize - 1;	/* End sector */
+#if _FS_CACHE_SECTORS
+				cache_invalidate(fs, rt[0], rt[1] - rt[0] + 1);
+#endif
+				disk_ioctl(fs->drv, CTRL_TRIM, rt);				/* Erase the block */
+				scl = 0;
+			}
+		}
+		if (res == FR_OK && scl) {			/* Free block at the end of the scanned range */
+			rt[0] = clust2sect(fs, scl);
+			rt[1] = clust2sect(fs, cl - 1) + fs->csize - 1;
+#if _FS_CACHE_SECTORS
+			cache_invalidate(fs, rt[0], rt[1] - rt[0] + 1);
+#endif
+			disk_ioctl(fs->drv, CTRL_TRIM, rt);
+		}
+		*clst = (cl < fs->n_fatent) ? cl : 0;
+	}
+	LEAVE_FF(fs, res);
+}
+#endif /* _USE_TRIM */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -3593,6 +3894,437 @@ FRESULT f_truncate (
 
 
 
+#if _USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Block to the File                               */
+/*-----------------------------------------------------------------------*/
+/* The file must be empty. With opt=1 the clusters are linked to the file
+/  and its size is set to fsz, so that following writes inside the block
+/  only write data sectors: no FAT access is needed to cross a cluster
+/  boundary. Truncate the file at its final length before closing it.
+/  With opt=0 the block is only set as the start point of the next
+/  allocation. */
+
+FRESULT f_expand (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD fsz,		/* File size to be expanded to */
+	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->err)							/* Check error */
+		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+	if (fsz == 0 || fp->fsize != 0 || !(fp->flag & FA_WRITE))
+		LEAVE_FF(fp->fs, FR_DENIED);
+	fs = fp->fs;
+
+	n = (DWORD)fs->csize * SS(fs);			/* Cluster size */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	stcl = fs->last_clust;
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	lclst = 0;
+
+	scl = clst = stcl; ncl = 0;
+	for (;;) {								/* Find a contiguous free block */
+#if _FS_FREEMAP
+		if (!FMAP_TEST(fs, clst)) {			/* Skip a group known to be full */
+			n = (FMAP_BIT(fs, clst) + 1) << fs->fmshift;
+			if (n > fs->n_fatent) n = fs->n_fatent;
+			if (stcl - clst - 1 < n - clst) { res = FR_DENIED; break; }	/* Start point skipped */
+			clst = (n >= fs->n_fatent) ? 2 : n;
+			scl = clst; ncl = 0;
+			if (clst == stcl) { res = FR_DENIED; break; }
+			continue;
+		}
+#endif
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (++clst >= fs->n_fatent) {		/* Wrap around, a block cannot span the end of the FAT */
+			clst = 2;
+			if (n != 0 || ncl + 1 < tcl) {
+				scl = clst; ncl = 0;
+				if (clst == stcl) { res = FR_DENIED; break; }
+				continue;
+			}
+		}
+		if (n == 0) {						/* Is it a free cluster? */
+			if (++ncl == tcl) break;		/* Break if a contiguous block is found */
+		} else {
+			scl = clst; ncl = 0;			/* Restart after the used cluster */
+		}
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous block? */
+	}
+
+	if (res == FR_OK) {						/* A contiguous free block is found */
+		if (opt) {							/* Allocate it now */
+			for (clst = scl, n = tcl; n; clst++, n--) {	/* Create a cluster chain on the FAT */
+				res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+				if (res != FR_OK) break;
+				lclst = clst;
+			}
+		} else {							/* Set it as the start point of the next allocation */
+			lclst = scl - 1;
+		}
+	}
+
+	if (res == FR_OK) {
+		fs->last_clust = lclst;				/* Set suggested start cluster of the next allocation */
+		if (opt) {							/* Is it allocated now? */
+			fp->sclust = scl;				/* Update object allocation information */
+			fp->fsize = fsz;
+			fp->flag |= FA__WRITTEN | FA__CONTIG;
+			if (fs->free_clust <= fs->n_fatent - 2) {	/* Update FSINFO */
+				fs->free_clust -= tcl;
+				fs->fsi_flag |= 1;
+			}
+		}
+	} else {
+		if (res != FR_DENIED) fp->err = (FRESULT)res;
+	}
+
+	LEAVE_FF(fp->fs, res);
+}
+#endif /* _USE_EXPAND */
+
+
+
+
+#if _USE_STREAM
+/*-----------------------------------------------------------------------*/
+/* Streaming Writer                                                      */
+/*-----------------------------------------------------------------------*/
+/* The streaming writer appends to a file allocated by f_expand() without
+/  going through f_write(). The extent of the file is resolved once, the
+/  application fills the sector buffer in place and every full buffer is
+/  passed to disk_write() as one multi-sector write. The size in the
+/  directory entry is only updated by f_stream_sync(). Any other access
+/  to the file is prohibited between f_stream_open() and f_stream_close().
+/  In append-only use, f_stream_flush() makes the data durable without any
+/  directory update; the directory entry keeps the size of the whole extent
+/  and, after an interruption, f_stream_recover() finds the end of the data
+/  written so far from the content of the sectors. With _USE_STREAM_ASYNC,
+/  each half of the sector buffer is written in the background while the
+/  other one is filled. */
+
+static
+UINT stream_capacity (	/* Number of bytes the sector buffer can take */
+	FSTREAM* st
+)
+{
+	DWORD n = st->nsect;
+
+	if (st->sect + n > st->esect) n = st->esect - st->sect;	/* Clip at the end of the extent */
+	return (UINT)n * SS(st->fp->fs);
+}
+
+
+static
+FRESULT stream_wait (	/* Wait for the end of the background write, if any */
+	FSTREAM* st
+)
+{
+#if _USE_STREAM_ASYNC
+	if (st->busy) {
+		st->busy = 0;
+		if (disk_ioctl(st->fp->fs->drv, CTRL_WRITE_WAIT, 0) != RES_OK)
+			return FR_DISK_ERR;
+	}
+#endif
+	return FR_OK;
+}
+
+
+static
+FRESULT stream_write (	/* Write the full sector buffer */
+	FSTREAM* st,
+	UINT nsect		/* Number of sectors to write */
+)
+{
+#if _USE_STREAM_ASYNC
+	DWRITE wr;
+	BYTE *buf;
+
+
+	if (stream_wait(st) != FR_OK) return FR_DISK_ERR;	/* The other half is free again */
+	wr.buff = st->buf;
+	wr.sector = st->sect;
+	wr.count = nsect;
+	if (disk_ioctl(st->fp->fs->drv, CTRL_WRITE_START, &wr) != RES_OK)
+		return FR_DISK_ERR;
+	st->busy = 1;
+	buf = st->buf; st->buf = st->wbuf; st->wbuf = buf;	/* Fill the other half meanwhile */
+#else
+	if (disk_write(st->fp->fs->drv, st->buf, st->sect, nsect) != RES_OK)
+		return FR_DISK_ERR;
+#endif
+	return FR_OK;
+}
+
+
+FRESULT f_stream_open (
+	FSTREAM* st,	/* Pointer to the blank stream object */
+	FIL* fp,		/* Pointer to the file object, contiguous and open for writing */
+	void* buff,		/* Sector buffer, word aligned */
+	UINT nsect		/* Size of the sector buffer in sectors */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD sect, ncl;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->err)							/* Check error */
+		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+	fs = fp->fs;
+	if (!(fp->flag & FA_WRITE) || !(fp->flag & FA__CONTIG) || (fp->fptr % SS(fs)))
+		LEAVE_FF(fs, FR_DENIED);
+#if _USE_STREAM_ASYNC
+	nsect /= 2;								/* Two halves */
+#endif
+	if (!nsect) LEAVE_FF(fs, FR_DENIED);
+
+#if !_FS_TINY
+	if (fp->flag & FA__DIRTY) {				/* Write-back the file sector buffer, the stream bypasses it */
+		if (disk_write(fs->drv, fp->buf.d8, fp->dsect, 1) != RES_OK)
+			ABORT(fs, FR_DISK_ERR);
+		fp->flag &= ~FA__DIRTY;
+	}
+#endif
+
+	sect = clust2sect(fs, fp->sclust);		/* Resolve the extent of the file */
+	if (!sect) ABORT(fs, FR_INT_ERR);
+	ncl = (fp->fsize + (DWORD)fs->csize * SS(fs) - 1) / ((DWORD)fs->csize * SS(fs));
+
+	st->fp = fp;
+	st->buf = (BYTE*)buff;
+	st->nsect = nsect;
+	st->fill = 0;
+	st->ofs = fp->fptr;
+	st->sect = sect + fp->fptr / SS(fs);
+	st->esect = sect + ncl * fs->csize;
+#if _USE_STREAM_ASYNC
+	st->wbuf = st->buf + nsect * SS(fs);
+	st->busy = 0;
+#endif
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+BYTE* f_stream_buffer (	/* Pointer to the free part of the sector buffer */
+	FSTREAM* st,	/* Pointer to the stream object */
+	UINT* space		/* Pointer to return the number of free bytes (0: end of the extent) */
+)
+{
+	*space = stream_capacity(st) - st->fill;
+	return st->buf + st->fill;
+}
+
+
+FRESULT f_stream_commit (
+	FSTREAM* st,	/* Pointer to the stream object */
+	UINT nbytes		/* Number of bytes filled at f_stream_buffer() */
+)
+{
+	FATFS *fs = st->fp->fs;
+	UINT cap = stream_capacity(st);
+
+
+	if (nbytes > cap - st->fill) LEAVE_FF(fs, FR_DENIED);
+	st->fill += nbytes;
+
+	if (st->fill == cap && cap) {			/* Write the full buffer in one go */
+		if (stream_write(st, cap / SS(fs)) != FR_OK)
+			LEAVE_FF(fs, FR_DISK_ERR);
+		st->sect += cap / SS(fs);
+		st->ofs += cap;
+		st->fill = 0;
+	}
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+FRESULT f_stream_sync (
+	FSTREAM* st		/* Pointer to the stream object */
+)
+{
+	FRESULT res;
+	FIL *fp = st->fp;
+	FATFS *fs = fp->fs;
+	DWORD tm;
+	BYTE *dir;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	if (stream_wait(st) != FR_OK)			/* Let the background write end */
+		LEAVE_FF(fs, FR_DISK_ERR);
+	if (st->fill) {							/* Write the filled sectors, the last one is written again once complete */
+		if (disk_write(fs->drv, st->buf, st->sect, (st->fill + SS(fs) - 1) / SS(fs)) != RES_OK)
+			LEAVE_FF(fs, FR_DISK_ERR);
+	}
+
+	/* Commit the streamed length to the directory entry */
+	res = move_window(fs, fp->dir_sect);
+	if (res == FR_OK) {
+		dir = fp->dir_ptr;
+		dir[DIR_Attr] |= AM_ARC;					/* Set archive bit */
+		ST_DWORD(dir + DIR_FileSize, st->ofs + st->fill);	/* Update file size */
+		st_clust(dir, fp->sclust);					/* Update start cluster */
+		tm = GET_FATTIME();							/* Update updated time */
+		ST_DWORD(dir + DIR_WrtTime, tm);
+		ST_WORD(dir + DIR_LstAccDate, 0);
+		fs->wflag = 1;
+#if _FS_LAZY_FSINFO
+		fs->fsi_flag |= 4;							/* Defer the free cluster count to f_close() */
+#endif
+		res = sync_fs(fs);
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+FRESULT f_stream_flush (
+	FSTREAM* st		/* Pointer to the stream object */
+)
+{
+	FRESULT res;
+	FATFS *fs = st->fp->fs;
+
+
+	res = validate(st->fp);					/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	if (stream_wait(st) != FR_OK)			/* Let the background write end */
+		LEAVE_FF(fs, FR_DISK_ERR);
+	if (st->fill) {							/* Write the filled sectors, the last one is written again once complete */
+		if (disk_write(fs->drv, st->buf, st->sect, (st->fill + SS(fs) - 1) / SS(fs)) != RES_OK)
+			LEAVE_FF(fs, FR_DISK_ERR);
+	}
+	/* The directory entry is left as it is, the data is only found back by its content */
+	if (disk_ioctl(fs->drv, CTRL_SYNC, 0) != RES_OK)
+		res = FR_DISK_ERR;
+
+	LEAVE_FF(fs, res);
+}
+
+
+FRESULT f_stream_close (
+	FSTREAM* st		/* Pointer to the stream object */
+)
+{
+	FRESULT res;
+	FIL *fp = st->fp;
+	FATFS *fs = fp->fs;
+	DWORD csz;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	if (stream_wait(st) != FR_OK)			/* Let the background write end */
+		ABORT(fs, FR_DISK_ERR);
+	if (st->fill) {							/* Write the remaining data */
+		if (disk_write(fs->drv, st->buf, st->sect, (st->fill + SS(fs) - 1) / SS(fs)) != RES_OK)
+			ABORT(fs, FR_DISK_ERR);
+	}
+
+	/* Move the file pointer to the end of the streamed data */
+	csz = (DWORD)fs->csize * SS(fs);
+	fp->fptr = st->ofs + st->fill;
+	fp->clust = fp->fptr ? fp->sclust + (fp->fptr - 1) / csz : 0;
+	fp->dsect = 0;
+	if (fp->fptr % SS(fs)) {				/* Load the partial sector into the file sector buffer */
+		fp->dsect = st->sect + st->fill / SS(fs);
+#if !_FS_TINY
+		mem_cpy(fp->buf.d8, st->buf + (st->fill / SS(fs)) * SS(fs), SS(fs));
+#endif
+	}
+	fp->flag |= FA__WRITTEN;
+
+	LEAVE_FF(fs, FR_OK);
+}
+
+
+FRESULT f_stream_recover (
+	FIL* fp,		/* Pointer to the file object */
+	void* buff,		/* Sector buffer, word aligned */
+	UINT nsect,		/* Size of the sector buffer in sectors */
+	int (*valid)(const BYTE*,DWORD),	/* Pointer to the function telling if the sector at a file offset was written */
+	DWORD* len		/* Pointer to return the length of the valid data */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, sect, ofs, csz, n;
+	UINT i;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->err)							/* Check error */
+		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+	fs = fp->fs;
+	if (!nsect || (fp->fptr % SS(fs)))
+		LEAVE_FF(fs, FR_DENIED);
+
+#if !_FS_TINY
+	if (fp->flag & FA__DIRTY) {				/* Write-back the file sector buffer, the scan bypasses it */
+		if (disk_write(fs->drv, fp->buf.d8, fp->dsect, 1) != RES_OK)
+			ABORT(fs, FR_DISK_ERR);
+		fp->flag &= ~FA__DIRTY;
+	}
+#endif
+
+	csz = (DWORD)fs->csize * SS(fs);
+	ofs = fp->fptr;
+	clst = fp->sclust;
+	for (n = ofs / csz; n && ofs < fp->fsize; n--) {	/* Follow the chain to the cluster of the file pointer */
+		clst = get_fat(fs, clst);
+		if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+		if (clst < 2 || clst >= fs->n_fatent) ABORT(fs, FR_INT_ERR);
+	}
+
+	/* Read the file forward in runs of up to nsect sectors until a sector is not valid */
+	while (ofs < fp->fsize) {
+		sect = clust2sect(fs, clst);
+		if (!sect) ABORT(fs, FR_INT_ERR);
+		sect += (ofs % csz) / SS(fs);
+		n = (csz - ofs % csz) / SS(fs);		/* Sectors left in this cluster */
+		if (n > nsect) n = nsect;
+		if (n > (fp->fsize - ofs + SS(fs) - 1) / SS(fs)) n = (fp->fsize - ofs + SS(fs) - 1) / SS(fs);
+		if (disk_read(fs->drv, (BYTE*)buff, sect, (UINT)n) != RES_OK)
+			ABORT(fs, FR_DISK_ERR);
+		for (i = 0; i < n && valid((BYTE*)buff + i * SS(fs), ofs); i++)
+			ofs += SS(fs);
+		if (i < n) break;					/* End of the written data */
+		if (ofs % csz == 0 && ofs < fp->fsize) {	/* Next cluster */
+			clst = get_fat(fs, clst);
+			if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+			if (clst < 2 || clst >= fs->n_fatent) ABORT(fs, FR_INT_ERR);
+		}
+	}
+	*len = (ofs < fp->fsize) ? ofs : fp->fsize;
+
+	LEAVE_FF(fs, FR_OK);
+}
+#endif /* _USE_STREAM */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -3711,7 +4443,7 @@ FRESULT f_mkdir (
 					dj.fs->winsect = dsc++;
 					dj.fs->wflag = 1;
 					res = sync_window(dj.fs);
-					if (res != FR_OK) break;
+					if (res != FR_OK || n == 1) break;	/* Leave the window matching the last sector */
 					mem_set(dir, 0, SS(dj.fs));
 				}
 			}
@@ -4132,7 +4864,10 @@ FRESULT f_forward (
 /* Create file system on the logical drive                               */
 /*-----------------------------------------------------------------------*/
 #define N_ROOTDIR	512		/* Number of root directory entries for FAT12/16 */
-#define N_FATS		1		/* Number of FATs (1 or 2) */
+#define N_FATS		_MKFS_NFATS	/* Number of FATs (1 or 2) */
+#if N_FATS != 1 && N_FATS != 2
+#error Wrong _MKFS_NFATS setting
+#endif
 
 
 FRESULT f_mkfs (
@@ -4149,11 +4884,11 @@ FRESULT f_mkfs (
 	UINT i;
 	DWORD b_vol, b_fat, b_dir, b_data;	/* LBA */
 	DWORD n_vol, n_rsv, n_fat, n_dir;	/* Size */
+	DWORD n_blk;						/* Erase block size */
 	FATFS *fs;
 	DSTATUS stat;
-#if _USE_TRIM
+	BYTE ez;
 	DWORD eb[2];
-#endif
 
 
 	/* Check mounted drive and clear work area */
@@ -4190,11 +4925,15 @@ FRESULT f_mkfs (
 		n_vol -= b_vol;				/* Volume size */
 	}
 
+	/* Get erase block size (allocation unit of SD cards) */
+	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &n_blk) != RES_OK || !n_blk || n_blk > 32768 || (n_blk & (n_blk - 1))) n_blk = 1;
+
 	if (au & (au - 1)) au = 0;
 	if (!au) {						/* AU auto selection */
 		vs = n_vol / (2000 / (SS(fs) / 512));
 		for (i = 0; vs < vst[i]; i++) ;
 		au = cst[i];
+		if (n_blk > 1 && au > n_blk * SS(fs)) au = n_blk * SS(fs);	/* Do not let a cluster straddle erase blocks */
 	}
 	if (au >= _MIN_SS) au /= SS(fs);	/* Number of sectors per cluster */
 	if (!au) au = 1;
@@ -4223,15 +4962,18 @@ FRESULT f_mkfs (
 	if (n_vol < b_data + au - b_vol) return FR_MKFS_ABORTED;	/* Too small volume */
 
 	/* Align data start sector to erase block boundary (for flash memory media) */
-	if (disk_ioctl(pdrv, GET_BLOCK_SIZE, &n) != RES_OK || !n || n > 32768) n = 1;
-	n = (b_data + n - 1) & ~(n - 1);	/* Next nearest erase block from current data start */
-	n = (n - b_data) / N_FATS;
+	n = (b_data + n_blk - 1) & ~(n_blk - 1);	/* Next nearest erase block from current data start */
+	n -= b_data;
 	if (fmt == FS_FAT32) {		/* FAT32: Move FAT offset */
 		n_rsv += n;
 		b_fat += n;
-	} else {					/* FAT12/16: Expand FAT size */
-		n_fat += n;
+	} else {					/* FAT12/16: Expand FAT size, move FAT offset by the remainder */
+		n_fat += n / N_FATS;
+		n_rsv += n % N_FATS;
+		b_fat += n % N_FATS;
 	}
+	b_dir = b_fat + n_fat * N_FATS;
+	b_data = b_dir + n_dir;
 
 	/* Determine number of clusters and final check of validity of the FAT sub-type */
 	n_clst = (n_vol - n_rsv - n_fat * N_FATS - n_dir) / au;
@@ -4323,6 +5065,15 @@ FRESULT f_mkfs (
 	if (fmt == FS_FAT32)					/* Write backup VBR if needed (VBR + 6) */
 		disk_write(pdrv, tbl, b_vol + 6, 1);
 
+	/* Erase FAT area and root directory in a single operation if the device
+	   supports it. The sectors are written only if they do not read back as zero. */
+	ez = 0;
+	eb[0] = b_fat; eb[1] = b_data + ((fmt == FS_FAT32) ? au : 0) - 1;
+	if (disk_ioctl(pdrv, CTRL_ERASE, eb) == RES_OK && disk_read(pdrv, tbl, eb[1], 1) == RES_OK) {
+		for (i = 0; i < SS(fs) && !tbl[i]; i++) ;
+		ez = (i == SS(fs)) ? 1 : 0;
+	}
+
 	/* Initialize FAT area */
 	wsect = b_fat;
 	for (i = 0; i < N_FATS; i++) {		/* Initialize each FAT copy */
@@ -4340,6 +5091,10 @@ FRESULT f_mkfs (
 		if (disk_write(pdrv, tbl, wsect++, 1) != RES_OK)
 			return FR_DISK_ERR;
 		mem_set(tbl, 0, SS(fs));			/* Fill following FAT entries with zero */
+		if (ez) {							/* Already zero after the erase */
+			wsect += n_fat - 1;
+			continue;
+		}
 		for (n = 1; n < n_fat; n++) {		/* This loop may take a time on FAT32 volume due to many single sector writes */
 			if (disk_write(pdrv, tbl, wsect++, 1) != RES_OK)
 				return FR_DISK_ERR;
@@ -4348,10 +5103,14 @@ FRESULT f_mkfs (
 
 	/* Initialize root directory */
 	i = (fmt == FS_FAT32) ? au : (UINT)n_dir;
-	do {
-		if (disk_write(pdrv, tbl, wsect++, 1) != RES_OK)
-			return FR_DISK_ERR;
-	} while (--i);
+	if (ez) {
+		wsect += i;
+	} else {
+		do {
+			if (disk_write(pdrv, tbl, wsect++, 1) != RES_OK)
+				return FR_DISK_ERR;
+		} while (--i);
+	}
 
 #if _USE_TRIM	/* Erase data area if needed */
 	{
@@ -108,6 +108,17 @@ typedef struct {
 	DWORD	dirbase;		/* Root directory start sector (FAT32:Cluster#) */
 	DWORD	database;		/* Data start sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
+#if _FS_CACHE_SECTORS
+	UINT*	cbuf;			/* Sector cache buffers, _FS_CACHE_SECTORS * _MAX_SS bytes */
+	DWORD	csect[_FS_CACHE_SECTORS];	/* Sector held by each cache slot (0xFFFFFFFF:Empty) */
+	DWORD	cstamp[_FS_CACHE_SECTORS];	/* Last use of each cache slot */
+	BYTE	cflag[_FS_CACHE_SECTORS];	/* Cache slot flags (b0:dirty) */
+	DWORD	ctick;			/* Cache use counter */
+#endif
+#if _FS_FREEMAP
+	BYTE	fmshift;		/* Clusters per free map bit (log2) */
+	BYTE	fmap[_FS_FREEMAP];	/* Free cluster map (1:group may have a free cluster, 0:group is full) */
+#endif
 	
 } FATFS;
 
@@ -146,6 +157,26 @@ typedef struct {
 
 
 
+#if _USE_STREAM
+/* Streaming writer object structure (FSTREAM) */
+
+typedef struct {
+	FIL*	fp;				/* File being streamed */
+	BYTE*	buf;			/* Sector buffer provided by the application */
+	UINT	nsect;			/* Size of the sector buffer in sectors */
+	UINT	fill;			/* Number of bytes filled in the sector buffer */
+	DWORD	sect;			/* Sector where the sector buffer is written */
+	DWORD	esect;			/* Sector following the contiguous extent of the file */
+	DWORD	ofs;			/* File offset of the sector buffer */
+#if _USE_STREAM_ASYNC
+	BYTE*	wbuf;			/* Other half of the sector buffer, written while this one is filled */
+	BYTE	busy;			/* A write of the other half is running */
+#endif
+} FSTREAM;
+#endif
+
+
+
 /* Directory object structure (DIR) */
 
 typedef struct {
@@ -230,6 +261,14 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT f_lseek (FIL* fp, DWORD ofs);								/* Move file pointer of a file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
+FRESULT f_expand (FIL* fp, DWORD fsz, BYTE opt);					/* Allocate a contiguous block to the file */
+FRESULT f_stream_open (FSTREAM* st, FIL* fp, void* buff, UINT nsect);	/* Start streaming to a contiguous file */
+BYTE* f_stream_buffer (FSTREAM* st, UINT* space);					/* Get the free part of the stream buffer */
+FRESULT f_stream_commit (FSTREAM* st, UINT nbytes);					/* Commit data filled in the stream buffer */
+FRESULT f_stream_sync (FSTREAM* st);								/* Flush the stream and commit its size */
+FRESULT f_stream_flush (FSTREAM* st);								/* Flush the stream without updating the directory */
+FRESULT f_stream_close (FSTREAM* st);								/* Stop streaming */
+FRESULT f_stream_recover (FIL* fp, void* buff, UINT nsect, int (*valid)(const BYTE*,DWORD), DWORD* len);	/* Find the end of streamed data */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
@@ -246,6 +285,7 @@ FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT f_trimfree (const TCHAR* path, DWORD* clst, DWORD ncl);	/* Trim free clusters on the drive */
 FRESULT f_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
@@ -315,6 +355,7 @@ int ff_del_syncobj (_SYNC_t sobj);				/* Delete a sync object */
 #define	FA_OPEN_ALWAYS		0x10
 #define FA__WRITTEN			0x20
 #define FA__DIRTY			0x40
+#define FA__CONTIG			0x80	/* Cluster chain is contiguous (set by f_expand) */
 #endif
 
 
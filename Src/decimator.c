@@ -0,0 +1,286 @@
+/**
+ ******************************************************************************
+ * @file    decimator.c
+ * @brief   Decimation stage between the ADC and the storage stage.
+ *          The stream is acquired above the stored rate and low-pass
+ *          filtered before it is decimated, so the stored frames carry the
+ *          averaged signal without aliased noise, and optionally more bits
+ *          than the ADC codes. Filtering uses the CMSIS-DSP polyphase q15
+ *          FIR decimator, which only computes the output samples kept.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "decimator.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+/* Cutoff of the windowed sinc designs, as a fraction of the output Nyquist
+ * frequency: the transition band ends close to it */
+#define DECIMATOR_CUTOFF                0.8f
+
+/* Unity gain in q15 coefficients */
+#define DECIMATOR_UNITY                 32768
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void Decimator_Design(q15_t *pCoeffs, uint32_t NumTaps, uint32_t Ratio,
+		Decimator_DesignTypeDef Design);
+static float32_t Decimator_Tap(uint32_t n, uint32_t NumTaps, float32_t Cutoff,
+		Decimator_DesignTypeDef Design);
+static void Decimator_Filter(Decimator_TypeDef *dec);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Designs the filter and initializes a decimator on top of a
+ *         caller-provided work buffer.
+ * @param  dec: decimator handle
+ * @param  Init: decimator configuration
+ * @param  pBuffer: work buffer
+ * @param  BufferSize: entries of pBuffer, at least DECIMATOR_BUFFER_SIZE()
+ *         of the configuration
+ * @retval HAL_OK, HAL_ERROR for an invalid configuration
+ */
+HAL_StatusTypeDef Decimator_Init(Decimator_TypeDef *dec,
+		const Decimator_InitTypeDef *Init, q15_t *pBuffer, uint32_t BufferSize) {
+	uint32_t numTaps, ch;
+	q15_t *pCoeffs;
+
+	numTaps = Init->Ratio * Init->TapsPerPhase;
+	if ((Init->Channels == 0) || (Init->Channels > DECIMATOR_MAX_CHANNELS)
+			|| (Init->Ratio == 0) || (Init->Ratio > 255)
+			|| (numTaps < 2) || (numTaps > 0xFFFF)
+			|| (Init->BlockFrames == 0)
+			|| (Init->BlockFrames % Init->Ratio != 0)
+			|| (Init->ExtraBits > DECIMATOR_MAX_EXTRA_BITS)
+			|| (BufferSize < DECIMATOR_BUFFER_SIZE(Init->Channels, Init->Ratio,
+					Init->TapsPerPhase, Init->BlockFrames))) {
+		return HAL_ERROR;
+	}
+
+	dec->Channels = Init->Channels;
+	dec->BlockFrames = Init->BlockFrames;
+	dec->OutputFrames = Init->BlockFrames / Init->Ratio;
+	dec->Ratio = Init->Ratio;
+	dec->Fill = 0;
+	dec->Skip = 0;
+	dec->Prime = 0;
+	dec->Shift = DECIMATOR_MAX_EXTRA_BITS - Init->ExtraBits;
+	dec->Fast = Init->Fast;
+
+	/* Coefficients, shared by the channels, then one state per channel */
+	pCoeffs = pBuffer;
+	Decimator_Design(pCoeffs, numTaps, Init->Ratio, Init->Design);
+	pBuffer += numTaps;
+
+	for (ch = 0; ch < dec->Channels; ch++) {
+		if (arm_fir_decimate_init_q15(&dec->aFilter[ch], (uint16_t) numTaps,
+				(uint8_t) Init->Ratio, pCoeffs, pBuffer, dec->BlockFrames)
+				!= ARM_MATH_SUCCESS) {
+			return HAL_ERROR;
+		}
+		pBuffer += numTaps + dec->BlockFrames - 1;
+	}
+
+	dec->pInput = pBuffer;
+	pBuffer += dec->Channels * dec->BlockFrames;
+	dec->pFiltered = pBuffer;
+	pBuffer += dec->OutputFrames;
+	dec->pOutput = (uint16_t *) pBuffer;
+
+	return HAL_OK;
+}
+
+/**
+ * @brief  Restarts a decimator after a gap in its input. The staged frames
+ *         and the filter histories are discarded, so no output frame mixes
+ *         codes from both sides of the gap, and the input frames that follow
+ *         are dropped up to the next output period, so the output frames
+ *         stay on the grid of the input frames.
+ * @param  dec: decimator handle
+ * @param  Missed: input frames lost in the gap
+ * @retval Output frames lost, the gap included
+ */
+uint32_t Decimator_Reset(Decimator_TypeDef *dec, uint32_t Missed) {
+	uint32_t lost;
+
+	/* The staged frames start on an output period: blocks are whole periods */
+	Missed += dec->Fill;
+	lost = (Missed + dec->Ratio - 1) / dec->Ratio;
+
+	dec->Fill = 0;
+	dec->Skip = lost * dec->Ratio - Missed;
+	dec->Prime = 1;
+
+	return lost;
+}
+
+/**
+ * @brief  Hands a block of input frames to a decimator. Output frames are
+ *         returned each time a block of BlockFrames input frames is
+ *         complete; they stay valid until the next call.
+ * @param  dec: decimator handle
+ * @param  pData: input codes, whole frames
+ * @param  Count: number of input samples
+ * @param  ppOutput: set to the output frames, if any
+ * @param  pOutputCount: set to the number of output samples, 0 if none
+ * @retval Number of input samples consumed, call again with the rest
+ */
+uint32_t Decimator_Process(Decimator_TypeDef *dec, const uint16_t *pData,
+		uint32_t Count, const uint16_t **ppOutput, uint32_t *pOutputCount) {
+	uint32_t frames, i, ch;
+	q15_t *pInput, *pState;
+
+	frames = Count / dec->Channels;
+	*pOutputCount = 0;
+
+	/* Back in phase after a gap */
+	if (dec->Skip != 0) {
+		if (frames > dec->Skip) {
+			frames = dec->Skip;
+		}
+		dec->Skip -= frames;
+		return frames * dec->Channels;
+	}
+
+	/* The histories hold the first frame after a gap rather than zeros, so
+	 * the filter does not ramp up from zero */
+	if (dec->Prime && (frames != 0)) {
+		for (ch = 0; ch < dec->Channels; ch++) {
+			pState = dec->aFilter[ch].pState;
+			arm_fill_q15((q15_t) (pData[ch] << DECIMATOR_MAX_EXTRA_BITS),
+					pState, dec->aFilter[ch].numTaps - 1);
+		}
+		dec->Prime = 0;
+	}
+
+	if (frames > dec->BlockFrames - dec->Fill) {
+		frames = dec->BlockFrames - dec->Fill;
+	}
+
+	/* De-interleave the codes into q15 */
+	for (ch = 0; ch < dec->Channels; ch++) {
+		pInput = &dec->pInput[ch * dec->BlockFrames + dec->Fill];
+		for (i = 0; i < frames; i++) {
+			pInput[i] = (q15_t) (pData[i * dec->Channels + ch]
+					<< DECIMATOR_MAX_EXTRA_BITS);
+		}
+	}
+	dec->Fill += frames;
+
+	if (dec->Fill == dec->BlockFrames) {
+		Decimator_Filter(dec);
+		dec->Fill = 0;
+		*ppOutput = dec->pOutput;
+		*pOutputCount = dec->OutputFrames * dec->Channels;
+	}
+
+	return frames * dec->Channels;
+}
+
+/**
+ * @brief  Filters and decimates the staged block of every channel into
+ *         interleaved output codes.
+ * @param  dec: decimator handle
+ * @retval None
+ */
+static void Decimator_Filter(Decimator_TypeDef *dec) {
+	uint32_t i, ch;
+	int32_t max, round, value;
+
+	max = (1 << (15 - dec->Shift)) - 1;
+	round = (dec->Shift != 0) ? (1 << (dec->Shift - 1)) : 0;
+
+	for (ch = 0; ch < dec->Channels; ch++) {
+		if (dec->Fast) {
+			arm_fir_decimate_fast_q15(&dec->aFilter[ch],
+					&dec->pInput[ch * dec->BlockFrames], dec->pFiltered,
+					dec->BlockFrames);
+		} else {
+			arm_fir_decimate_q15(&dec->aFilter[ch],
+					&dec->pInput[ch * dec->BlockFrames], dec->pFiltered,
+					dec->BlockFrames);
+		}
+
+		/* The ripple of the filter may leave the code range */
+		for (i = 0; i < dec->OutputFrames; i++) {
+			value = (dec->pFiltered[i] + round) >> dec->Shift;
+			if (value < 0) {
+				value = 0;
+			} else if (value > max) {
+				value = max;
+			}
+			dec->pOutput[i * dec->Channels + ch] = (uint16_t) value;
+		}
+	}
+}
+
+/**
+ * @brief  Computes the coefficients of a unity gain low-pass filter.
+ * @param  pCoeffs: coefficients output, NumTaps entries
+ * @param  NumTaps: filter length
+ * @param  Ratio: decimation ratio, sets the cutoff of the windowed sinc
+ * @param  Design: DECIMATOR_DESIGN_xxx
+ * @retval None
+ */
+static void Decimator_Design(q15_t *pCoeffs, uint32_t NumTaps, uint32_t Ratio,
+		Decimator_DesignTypeDef Design) {
+	float32_t cutoff, sum, tap;
+	int32_t total;
+	uint32_t n;
+
+	/* Cutoff in cycles per input sample */
+	cutoff = DECIMATOR_CUTOFF * 0.5f / Ratio;
+
+	sum = 0.0f;
+	for (n = 0; n < NumTaps; n++) {
+		sum += Decimator_Tap(n, NumTaps, cutoff, Design);
+	}
+
+	/* Scale to unity gain and quantize, the rounding residue goes to the
+	 * center tap so the DC gain is exact */
+	total = 0;
+	for (n = 0; n < NumTaps; n++) {
+		tap = Decimator_Tap(n, NumTaps, cutoff, Design) / sum * DECIMATOR_UNITY;
+		pCoeffs[n] = (q15_t) (tap + ((tap < 0.0f) ? -0.5f : 0.5f));
+		total += pCoeffs[n];
+	}
+	pCoeffs[NumTaps / 2] += (q15_t) (DECIMATOR_UNITY - total);
+}
+
+/**
+ * @brief  Computes one tap of a filter design, before scaling.
+ * @param  n: tap index
+ * @param  NumTaps: filter length, at least 2
+ * @param  Cutoff: cutoff in cycles per input sample
+ * @param  Design: DECIMATOR_DESIGN_xxx
+ * @retval Tap value
+ */
+static float32_t Decimator_Tap(uint32_t n, uint32_t NumTaps, float32_t Cutoff,
+		Decimator_DesignTypeDef Design) {
+	float32_t t, phase, window;
+
+	phase = 2.0f * PI * n / (NumTaps - 1);
+	switch (Design) {
+	case DECIMATOR_DESIGN_HAMMING:
+		window = 0.54f - 0.46f * arm_cos_f32(phase);
+		break;
+	case DECIMATOR_DESIGN_BLACKMAN:
+		window = 0.42f - 0.5f * arm_cos_f32(phase)
+				+ 0.08f * arm_cos_f32(2.0f * phase);
+		break;
+	default:
+		/* Moving average */
+		return 1.0f;
+	}
+
+	/* Sinc centered on the filter */
+	t = n - (NumTaps - 1) * 0.5f;
+	if (t == 0.0f) {
+		return 2.0f * Cutoff * window;
+	}
+	return arm_sin_f32(2.0f * PI * Cutoff * t) / (PI * t) * window;
+}
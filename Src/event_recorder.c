@@ -0,0 +1,241 @@
+/**
+ ******************************************************************************
+ * @file    event_recorder.c
+ * @brief   Pre/post-trigger event recorder.
+ *          While armed, the last Size samples acquired are kept in a
+ *          circular window. A trigger, e.g. from an ADC analog watchdog,
+ *          marks the frame that caused it; PostCount more samples are kept
+ *          from that frame on and the window is then frozen until the main
+ *          loop has stored it and armed the recorder again.
+ *          Samples are located by their acquisition index, the number of
+ *          samples handed to the recorder or skipped since it was
+ *          initialized.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "event_recorder.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+static void EventRecorder_Copy(EventRecorder_TypeDef *rec,
+		const uint16_t *pData, uint32_t Count);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Initializes a disarmed recorder on top of a caller-provided
+ *         buffer.
+ * @param  rec: recorder handle
+ * @param  pBuffer: storage for Size samples
+ * @param  Size: window length in samples, a multiple of FrameSize
+ * @param  FrameSize: samples per frame, 1 for a single channel
+ * @param  PostCount: samples kept from the trigger frame on, a multiple of
+ *         FrameSize less than Size
+ * @retval None
+ */
+void EventRecorder_Init(EventRecorder_TypeDef *rec, uint16_t *pBuffer,
+		uint32_t Size, uint32_t FrameSize, uint32_t PostCount) {
+	assert_param((FrameSize != 0) && (Size % FrameSize == 0));
+	assert_param((PostCount % FrameSize == 0) && (PostCount < Size));
+
+	rec->pBuffer = pBuffer;
+	rec->Size = Size;
+	rec->FrameSize = FrameSize;
+	rec->PostCount = PostCount;
+	rec->Position = 0;
+	rec->Head = 0;
+	rec->ArmIndex = 0;
+	rec->TriggerIndex = 0;
+	rec->pTrigger = NULL;
+	rec->TriggerPending = 0;
+	rec->TriggerSource = 0;
+	rec->TriggerTick = 0;
+	rec->State = EVENT_RECORDER_DISARMED;
+}
+
+/**
+ * @brief  Starts keeping the pre-trigger history and accepting a trigger.
+ *         Consumer side, also releases a complete window.
+ * @param  rec: recorder handle
+ * @retval None
+ */
+void EventRecorder_Arm(EventRecorder_TypeDef *rec) {
+	rec->TriggerPending = 0;
+	rec->State = EVENT_RECORDER_ARMED;
+
+	/* A block put before this point may not be in the window */
+	__DMB();
+	rec->ArmIndex = rec->Head;
+}
+
+/**
+ * @brief  Stops keeping samples, a trigger is then ignored.
+ * @param  rec: recorder handle
+ * @retval None
+ */
+void EventRecorder_Disarm(EventRecorder_TypeDef *rec) {
+	rec->State = EVENT_RECORDER_DISARMED;
+}
+
+/**
+ * @brief  Hands a block of acquired samples to the recorder. Producer side,
+ *         safe to call from an interrupt.
+ * @param  rec: recorder handle
+ * @param  pData: samples, whole frames
+ * @param  Count: number of samples
+ * @retval None
+ */
+void EventRecorder_Put(EventRecorder_TypeDef *rec, const uint16_t *pData,
+		uint32_t Count) {
+	uint32_t head = rec->Head;
+	uint32_t offset, end;
+
+	switch (rec->State) {
+	case EVENT_RECORDER_ARMED:
+		EventRecorder_Copy(rec, pData, Count);
+		break;
+
+	case EVENT_RECORDER_TRIGGERED:
+		if (rec->TriggerPending) {
+			/* The trigger sample is normally in this block, otherwise the
+			 * block is the closest one after it */
+			offset = 0;
+			if ((rec->pTrigger >= pData) && (rec->pTrigger < pData + Count)) {
+				offset = rec->pTrigger - pData;
+				offset -= offset % rec->FrameSize;
+			}
+			rec->TriggerIndex = head + offset;
+			rec->TriggerPending = 0;
+		}
+
+		/* Keep the samples up to the end of the post-trigger part */
+		end = rec->TriggerIndex + rec->PostCount;
+		if (Count >= end - head) {
+			EventRecorder_Copy(rec, pData, end - head);
+			rec->State = EVENT_RECORDER_COMPLETE;
+		} else {
+			EventRecorder_Copy(rec, pData, Count);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	rec->Head = head + Count;
+}
+
+/**
+ * @brief  Accounts samples that were not acquired, e.g. while the ADC was
+ *         used for something else. The history before the gap is no longer
+ *         part of the window. Producer side.
+ * @note   Must not be called while the recorder is triggered.
+ * @param  rec: recorder handle
+ * @param  Count: number of samples missed
+ * @retval None
+ */
+void EventRecorder_Skip(EventRecorder_TypeDef *rec, uint32_t Count) {
+	rec->Head += Count;
+	rec->ArmIndex = rec->Head;
+}
+
+/**
+ * @brief  Triggers an armed recorder, ignored otherwise. Safe to call from
+ *         an interrupt of the same priority as the producer.
+ * @param  rec: recorder handle
+ * @param  pSample: sample that caused the trigger, in the block that will
+ *         be put next; NULL or a sample outside that block triggers on the
+ *         first frame of the block
+ * @param  Source: tag of the trigger source, returned with the window
+ * @retval None
+ */
+void EventRecorder_Trigger(EventRecorder_TypeDef *rec,
+		const uint16_t *pSample, uint32_t Source) {
+	if (rec->State != EVENT_RECORDER_ARMED) {
+		return;
+	}
+
+	rec->pTrigger = pSample;
+	rec->TriggerPending = 1;
+	rec->TriggerSource = Source;
+	rec->TriggerTick = HAL_GetTick();
+	rec->State = EVENT_RECORDER_TRIGGERED;
+}
+
+/**
+ * @brief  Returns the state of a recorder.
+ * @param  rec: recorder handle
+ * @retval EVENT_RECORDER_xxx
+ */
+EventRecorder_StateTypeDef EventRecorder_GetState(EventRecorder_TypeDef *rec) {
+	return rec->State;
+}
+
+/**
+ * @brief  Describes the window of a complete recorder. Consumer side, the
+ *         window stays frozen until EventRecorder_Arm() is called.
+ * @param  rec: recorder handle
+ * @param  pWindow: window output
+ * @retval 1 if the recorder is complete, 0 otherwise
+ */
+uint8_t EventRecorder_GetWindow(EventRecorder_TypeDef *rec,
+		EventRecorder_WindowTypeDef *pWindow) {
+	uint32_t end, count;
+
+	if (rec->State != EVENT_RECORDER_COMPLETE) {
+		return 0;
+	}
+
+	/* The window ends with the post-trigger part and reaches back at most
+	 * to the first sample kept since the recorder was armed */
+	end = rec->TriggerIndex + rec->PostCount;
+	count = end - rec->ArmIndex;
+	if (count > rec->Size) {
+		count = rec->Size;
+	}
+
+	pWindow->First = (rec->Position + rec->Size - count) % rec->Size;
+	pWindow->Count = count;
+	pWindow->FirstIndex = end - count;
+	pWindow->TriggerIndex = rec->TriggerIndex;
+	pWindow->TriggerSource = rec->TriggerSource;
+	pWindow->TriggerTick = rec->TriggerTick;
+
+	return 1;
+}
+
+/**
+ * @brief  Writes samples to the circular window.
+ * @param  rec: recorder handle
+ * @param  pData: samples
+ * @param  Count: number of samples
+ * @retval None
+ */
+static void EventRecorder_Copy(EventRecorder_TypeDef *rec,
+		const uint16_t *pData, uint32_t Count) {
+	uint32_t first;
+
+	if (Count > rec->Size) {
+		/* Only the last Size samples remain in the window */
+		rec->Position = (rec->Position + Count - rec->Size) % rec->Size;
+		pData += Count - rec->Size;
+		Count = rec->Size;
+	}
+
+	first = rec->Size - rec->Position;
+	if (first > Count) {
+		first = Count;
+	}
+	memcpy(&rec->pBuffer[rec->Position], pData, first * sizeof(uint16_t));
+	memcpy(rec->pBuffer, pData + first, (Count - first) * sizeof(uint16_t));
+
+	rec->Position += Count;
+	if (rec->Position >= rec->Size) {
+		rec->Position -= rec->Size;
+	}
+}
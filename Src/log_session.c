@@ -0,0 +1,316 @@
+/**
+ ******************************************************************************
+ * @file    log_session.c
+ * @brief   Boot sequence of the sample logger.
+ *          Mounts the card as it is, formatting it only when it holds no FAT
+ *          volume or when asked to, and names each recording session
+ *          LOGnnnnn.BIN. The number of the next session is kept in a small
+ *          index file, so the directory is only enumerated when that file
+ *          is missing or damaged.
+ *          The index file also records the session in progress: if the
+ *          logger stopped without closing it, its file is cut to the data
+ *          actually written before the next session starts.
+ *          Once a session is closed, the free space of the card is erased a
+ *          few clusters at a time, so that the next session writes to blocks
+ *          the card does not have to erase first.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stddef.h>
+#include "log_session.h"
+#include "log_storage.h"
+
+/* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief  Content of the index file
+ */
+typedef struct {
+	uint32_t NextIndex; /*!< Number of the next session                     */
+	uint32_t OpenIndex; /*!< Session not closed yet, 0 if none              */
+	uint32_t Check; /*!< ~(NextIndex ^ OpenIndex), detects a torn or foreign
+	 file                                                            */
+} LogSession_IndexTypeDef;
+
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+static FIL IndexFile; /* Index file object */
+static uint32_t NextIndex; /* Content of the index file */
+static DWORD EraseCluster; /* Next cluster to erase, 0 before the first one */
+
+/* Private function prototypes -----------------------------------------------*/
+static FRESULT LogSession_ReadIndex(uint32_t *pIndex, uint32_t *pOpenIndex);
+static FRESULT LogSession_WriteIndex(uint32_t Index, uint32_t OpenIndex);
+static FRESULT LogSession_ScanIndex(uint32_t *pIndex);
+static void LogSession_FormatName(TCHAR *name, uint32_t Index);
+static int32_t LogSession_ParseName(const TCHAR *name);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Mounts the volume, formatting the card only when needed.
+ *         The volume is mounted immediately so that a card without a valid
+ *         FAT volume is detected here; the free cluster count is taken from
+ *         FSINFO rather than from a FAT scan.
+ * @param  fs: file system object
+ * @param  path: logical drive path
+ * @param  Format: non-zero to format the card even if it holds a volume
+ * @retval FatFs result code
+ */
+FRESULT LogSession_Mount(FATFS *fs, const TCHAR *path, uint8_t Format) {
+	FRESULT res;
+
+	res = f_mount(fs, path, 1);
+	if ((res == FR_NO_FILESYSTEM) || ((res == FR_OK) && Format)) {
+		/* WARNING: Formatting the uSD card will delete all content on the device */
+		res = f_mkfs(path, 0, 0);
+		if (res == FR_OK) {
+			res = f_mount(fs, path, 1);
+		}
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Picks the name of a new session file.
+ *         A previous session that was not closed is recovered first. The
+ *         new session number is claimed in the index file before returning,
+ *         so a session that is interrupted before its file is closed never
+ *         has its number reused.
+ * @param  name: name output, LOG_SESSION_NAME_SIZE characters
+ * @param  pIndex: session number output, may be NULL
+ * @retval FatFs result code, FR_DENIED when all session numbers are used
+ */
+FRESULT LogSession_NextName(TCHAR *name, uint32_t *pIndex) {
+	FILINFO info;
+	uint32_t index, open;
+	FRESULT res;
+
+	res = LogSession_ReadIndex(&index, &open);
+	if (res == FR_NO_FILE) {
+		/* First boot on this card, or the index file is not usable: the
+		 * last session found may not have been closed */
+		res = LogSession_ScanIndex(&index);
+		open = index - 1;
+	}
+	if (res != FR_OK) {
+		return res;
+	}
+
+	if (open != 0) {
+		LogSession_FormatName(name, open);
+		res = LogStorage_Recover(name, NULL);
+		if ((res != FR_OK) && (res != FR_NO_FILE)) {
+			return res;
+		}
+	}
+
+	/* Step over names already taken, e.g. if the index file was restored */
+	for (;;) {
+		if (index > LOG_SESSION_MAX_INDEX) {
+			return FR_DENIED;
+		}
+		LogSession_FormatName(name, index);
+		res = f_stat(name, &info);
+		if (res == FR_NO_FILE) {
+			break;
+		}
+		if (res != FR_OK) {
+			return res;
+		}
+		index++;
+	}
+
+	res = LogSession_WriteIndex(index + 1, index);
+	if ((res == FR_OK) && (pIndex != NULL)) {
+		*pIndex = index;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Records that the current session file was closed, so it is not
+ *         scanned at the next boot.
+ * @retval FatFs result code
+ */
+FRESULT LogSession_Close(void) {
+	return LogSession_WriteIndex(NextIndex, 0);
+}
+
+/**
+ * @brief  Erases part of the free space of the volume.
+ *         Each call scans the next Clusters clusters and erases the free
+ *         ones, so the whole volume is covered by calling it until pDone is
+ *         set, e.g. from the idle loop.
+ * @param  Clusters: number of clusters scanned by this call
+ * @param  pDone: set to 1 once the end of the volume is reached
+ * @retval FatFs result code
+ */
+FRESULT LogSession_EraseFree(uint32_t Clusters, uint8_t *pDone) {
+#if _USE_TRIM
+	FRESULT res;
+
+	res = f_trimfree("", &EraseCluster, Clusters);
+	*pDone = ((res == FR_OK) && (EraseCluster == 0));
+	return res;
+#else
+	(void) Clusters;
+	*pDone = 1;
+	return FR_OK;
+#endif
+}
+
+/**
+ * @brief  Reads the index file.
+ * @param  pIndex: next session number output
+ * @param  pOpenIndex: number of the session not closed output, 0 if none
+ * @retval FatFs result code, FR_NO_FILE when the file is missing or invalid
+ */
+static FRESULT LogSession_ReadIndex(uint32_t *pIndex, uint32_t *pOpenIndex) {
+	LogSession_IndexTypeDef record;
+	UINT count = 0;
+	FRESULT res;
+
+	res = f_open(&IndexFile, LOG_SESSION_INDEX_FILE, FA_READ);
+	if (res != FR_OK) {
+		return res;
+	}
+	res = f_read(&IndexFile, &record, sizeof(record), &count);
+	f_close(&IndexFile);
+	if (res != FR_OK) {
+		return res;
+	}
+
+	if ((count != sizeof(record))
+			|| (record.Check != ~(record.NextIndex ^ record.OpenIndex))
+			|| (record.NextIndex == 0) || (record.OpenIndex >= record.NextIndex)) {
+		return FR_NO_FILE;
+	}
+
+	*pIndex = record.NextIndex;
+	*pOpenIndex = record.OpenIndex;
+	return FR_OK;
+}
+
+/**
+ * @brief  Writes the index file.
+ *         The record is rewritten in place, so once the file exists this
+ *         costs one data sector and one directory sector write.
+ * @param  Index: number of the next session
+ * @param  OpenIndex: number of the session in progress, 0 if none
+ * @retval FatFs result code
+ */
+static FRESULT LogSession_WriteIndex(uint32_t Index, uint32_t OpenIndex) {
+	LogSession_IndexTypeDef record;
+	UINT count = 0;
+	FRESULT res;
+
+	NextIndex = Index;
+	record.NextIndex = Index;
+	record.OpenIndex = OpenIndex;
+	record.Check = ~(Index ^ OpenIndex);
+
+	res = f_open(&IndexFile, LOG_SESSION_INDEX_FILE, FA_OPEN_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		return res;
+	}
+	res = f_write(&IndexFile, &record, sizeof(record), &count);
+	if ((res == FR_OK) && (count != sizeof(record))) {
+		/* Volume full */
+		res = FR_DENIED;
+	}
+	if (f_close(&IndexFile) != FR_OK) {
+		res = FR_INT_ERR;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Rebuilds the next session number from the session files present
+ *         in the root directory.
+ * @param  pIndex: session number output
+ * @retval FatFs result code
+ */
+static FRESULT LogSession_ScanIndex(uint32_t *pIndex) {
+	DIR dir;
+	FILINFO info;
+	int32_t index;
+	uint32_t last = 0;
+	FRESULT res;
+
+	res = f_opendir(&dir, "");
+	if (res != FR_OK) {
+		return res;
+	}
+
+	for (;;) {
+		res = f_readdir(&dir, &info);
+		if ((res != FR_OK) || (info.fname[0] == 0)) {
+			break;
+		}
+		index = LogSession_ParseName(info.fname);
+		if ((index > 0) && ((uint32_t) index > last)) {
+			last = index;
+		}
+	}
+	f_closedir(&dir);
+
+	*pIndex = last + 1;
+	return res;
+}
+
+/**
+ * @brief  Builds the file name of a session.
+ * @param  name: name output, LOG_SESSION_NAME_SIZE characters
+ * @param  Index: session number
+ * @retval None
+ */
+static void LogSession_FormatName(TCHAR *name, uint32_t Index) {
+	uint32_t i;
+
+	name[0] = 'L';
+	name[1] = 'O';
+	name[2] = 'G';
+	for (i = 7; i >= 3; i--) {
+		name[i] = (TCHAR) ('0' + Index % 10);
+		Index /= 10;
+	}
+	name[8] = '.';
+	name[9] = 'B';
+	name[10] = 'I';
+	name[11] = 'N';
+	name[12] = 0;
+}
+
+/**
+ * @brief  Extracts the session number from a file name.
+ * @param  name: 8.3 file name
+ * @retval Session number, or -1 if the name is not a session file name
+ */
+static int32_t LogSession_ParseName(const TCHAR *name) {
+	static const TCHAR suffix[] = ".BIN";
+	int32_t index = 0;
+	uint32_t i;
+
+	if ((name[0] != 'L') || (name[1] != 'O') || (name[2] != 'G')) {
+		return -1;
+	}
+	for (i = 3; i < 8; i++) {
+		if ((name[i] < '0') || (name[i] > '9')) {
+			return -1;
+		}
+		index = index * 10 + (name[i] - '0');
+	}
+	for (i = 0; i < sizeof(suffix); i++) {
+		if (name[8 + i] != suffix[i]) {
+			return -1;
+		}
+	}
+
+	return index;
+}
@@ -0,0 +1,661 @@
+/**
+ ******************************************************************************
+ * @file    log_storage.c
+ * @brief   Storage stage of the sample logger.
+ *          Drains the sample ring filled by the ADC DMA callbacks from the
+ *          main loop and writes it to the log file as fixed-size binary
+ *          blocks (see log_format.h), so the interrupts never wait on the
+ *          SD card. Multi-channel frames are stored interleaved; a frame may
+ *          span two blocks, the FirstSample index of each block locates it.
+ *          While the file is inside its pre-allocated extent the blocks are
+ *          built directly in the buffer of a FatFs streaming writer and
+ *          reach the card as multi-block writes; past it, or without
+ *          pre-allocation, they go through f_write.
+ *          Written data is committed to the directory entry in groups, after
+ *          a number of bytes, a time limit or an external request, so that
+ *          a power failure loses at most one group.
+ *          In append-only mode the directory entry covers the whole
+ *          pre-allocated extent from the start and commits only flush the
+ *          data; the length of a log cut short is found back from the
+ *          sequence and session tag of its blocks by LogStorage_Recover().
+ *          Records queued by the acquisition, burst captures and events,
+ *          are written between two stream blocks, one block per call
+ *          whenever the ring has no full block waiting, so they never hold
+ *          back the stream.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "log_storage.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+
+/* Progress of the queued record */
+#define LOG_RECORD_NONE                 0 /* No record queued             */
+#define LOG_RECORD_INFO                 1 /* Description block to write   */
+#define LOG_RECORD_SAMPLES              2 /* Sample blocks to write       */
+
+#if _FS_NORTC
+#define LOG_FATTIME()   ((DWORD)(_NORTC_YEAR - 1980) << 25 | (DWORD)_NORTC_MON << 21 | (DWORD)_NORTC_MDAY << 16)
+#else
+#define LOG_FATTIME()   get_fattime()
+#endif
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+static FIL LogFile; /* Log file object */
+static SampleRing_TypeDef *pLogRing; /* Ring drained by the storage stage */
+static uint64_t LogSampleIndex; /* Stream index of the next sample to store */
+static uint32_t LogSequence; /* Sequence number of the block being filled */
+
+/* Samples of the block being filled, packed when the block is sealed */
+static uint16_t aBlockSamples[LOG_BLOCK_SAMPLES];
+static uint32_t BlockFill;
+static uint32_t BlockSamples; /* Samples of a full stream block */
+
+/* Block image handed to f_write, also used for the file header */
+static LogBlock_TypeDef LogBlock;
+
+/* Streaming writer and its buffer, used while the file is inside its
+ * pre-allocated extent */
+static FSTREAM LogStream;
+static uint8_t LogStreaming;
+static uint32_t aStreamBuffer[LOG_STREAM_BLOCKS * LOG_BLOCK_SIZE / 4];
+
+static LogStorage_StatsTypeDef LogStats;
+
+/* Group commit policy, see LogStorage_InitTypeDef */
+static uint32_t LogSyncBytes;
+static uint32_t LogSyncPeriod;
+static uint32_t LogDirtyTick; /* Tick of the oldest uncommitted write */
+static __IO uint8_t LogSyncRequest; /* Set by LogStorage_RequestSync() */
+
+static uint16_t LogSession; /* Session tag of the open file */
+static uint8_t LogAppendOnly;
+
+/* Set when the file was pre-allocated and must be truncated on close */
+static uint8_t LogPreallocated;
+
+/* Record being written, see LogStorage_QueueRecord() */
+static LogStorage_RecordTypeDef LogRecord;
+static uint8_t LogRecordState; /* LOG_RECORD_xxx */
+static uint32_t LogRecordIndex; /* Next record sample to store */
+
+/* Private function prototypes -----------------------------------------------*/
+static FRESULT LogStorage_WriteHeader(const LogStorage_InitTypeDef *Init);
+static FRESULT LogStorage_WriteBlock(void);
+static FRESULT LogStorage_WriteRecordBlock(void);
+static FRESULT LogStorage_GetBlock(void **ppBlock);
+static FRESULT LogStorage_Write(const void *pData, uint32_t Size);
+static FRESULT LogStorage_CheckSync(void);
+static int LogStorage_IsBlockValid(const BYTE *pSector, DWORD Offset);
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Creates the log file, writes its header and attaches the storage
+ *         stage to a ring.
+ * @param  ring: sample ring filled by the acquisition
+ * @param  path: log file name
+ * @param  Init: description of the logged stream
+ * @retval FatFs result code, FR_INVALID_PARAMETER if the channel count does
+ *         not match the frames of the ring
+ */
+FRESULT LogStorage_Open(SampleRing_TypeDef *ring, const TCHAR *path,
+		const LogStorage_InitTypeDef *Init) {
+	FRESULT res;
+
+	if ((Init->ChannelCount == 0) || (Init->ChannelCount > LOG_MAX_CHANNELS)
+			|| (Init->ChannelCount != ring->FrameSize)
+			|| (Init->Resolution == 0) || (Init->Resolution > 16)) {
+		return FR_INVALID_PARAMETER;
+	}
+
+	res = f_open(&LogFile, path, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		return res;
+	}
+
+	/* Reserve the file as one contiguous cluster run, so that streaming
+	 * writes never have to allocate clusters. Without enough contiguous
+	 * free space the file simply grows as usual. */
+	LogPreallocated = 0;
+	LogStreaming = 0;
+	LogAppendOnly = 0;
+	if (Init->PreallocSize != 0) {
+		res = f_expand(&LogFile, Init->PreallocSize, 1);
+		if (res == FR_OK) {
+			LogPreallocated = 1;
+			if (Init->AppendOnly) {
+				/* Commit the size of the whole extent now, once */
+				res = f_sync(&LogFile);
+				LogAppendOnly = (res == FR_OK);
+			}
+		}
+		if (res == FR_OK) {
+			res = f_stream_open(&LogStream, &LogFile, aStreamBuffer,
+					LOG_STREAM_BLOCKS);
+			LogStreaming = (res == FR_OK);
+		}
+		if ((res != FR_OK) && (res != FR_DENIED)) {
+			f_close(&LogFile);
+			return res;
+		}
+	}
+
+	pLogRing = ring;
+	LogSampleIndex = 0;
+	LogSequence = 0;
+	BlockFill = 0;
+	BlockSamples = (Init->Resolution > 12) ?
+			LOG_BLOCK_SAMPLES16 : LOG_BLOCK_SAMPLES;
+	memset(&LogStats, 0, sizeof(LogStats));
+	LogSyncBytes = Init->SyncBytes;
+	LogSyncPeriod = Init->SyncPeriod;
+	LogSyncRequest = 0;
+	LogSession = Init->Session;
+	LogRecordState = LOG_RECORD_NONE;
+
+	res = LogStorage_WriteHeader(Init);
+	if (res != FR_OK) {
+		f_close(&LogFile);
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Moves queued samples to the log file.
+ *         Fills at most one data block per call and writes it once complete,
+ *         then commits the file if the group commit policy asks for it, so
+ *         the main loop is never held for more than one block write and one
+ *         commit. When the ring is drained, one block of a queued record is
+ *         written instead.
+ * @retval FatFs result code
+ */
+FRESULT LogStorage_Process(void) {
+	uint32_t count;
+	FRESULT res = FR_OK;
+
+	count = SampleRing_Get(pLogRing, &aBlockSamples[BlockFill],
+			BlockSamples - BlockFill);
+	BlockFill += count;
+
+	if (BlockFill == BlockSamples) {
+		res = LogStorage_WriteBlock();
+	} else if (LogRecordState != LOG_RECORD_NONE) {
+		res = LogStorage_WriteRecordBlock();
+	}
+
+	if (res == FR_OK) {
+		res = LogStorage_CheckSync();
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Checkpoint: flushes the blocks written so far to the card and
+ *         commits the file size to its directory entry.
+ * @note   The block being filled is not written.
+ * @retval FatFs result code
+ */
+FRESULT LogStorage_Sync(void) {
+	uint32_t start, elapsed;
+	FRESULT res;
+
+	LogSyncRequest = 0;
+
+	start = HAL_GetTick();
+	if (LogStreaming && LogAppendOnly) {
+		/* Data only, the directory entry already covers the extent */
+		res = f_stream_flush(&LogStream);
+	} else if (LogStreaming) {
+		res = f_stream_sync(&LogStream);
+	} else {
+		res = f_sync(&LogFile);
+	}
+	elapsed = HAL_GetTick() - start;
+
+	LogStats.Syncs++;
+	LogStats.SyncTime += elapsed;
+	if (elapsed > LogStats.MaxSyncTime) {
+		LogStats.MaxSyncTime = elapsed;
+	}
+	if (res == FR_OK) {
+		LogStats.UnsyncedBytes = 0;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Requests a commit from the next LogStorage_Process() call, e.g. on
+ *         an external event. Safe to call from an interrupt.
+ * @retval None
+ */
+void LogStorage_RequestSync(void) {
+	LogSyncRequest = 1;
+}
+
+/**
+ * @brief  Queues a record, written to the log file by the following
+ *         LogStorage_Process() calls.
+ * @note   The descriptor is copied, the description and the samples are
+ *         not: they must stay untouched until LogStorage_IsRecordPending()
+ *         returns 0.
+ * @param  Record: record to write
+ * @retval FatFs result code, FR_DENIED while a previous record is still
+ *         being written, FR_INVALID_PARAMETER for an invalid descriptor
+ */
+FRESULT LogStorage_QueueRecord(const LogStorage_RecordTypeDef *Record) {
+	if (LogRecordState != LOG_RECORD_NONE) {
+		return FR_DENIED;
+	}
+	if ((Record->InfoSize > LOG_BLOCK_DATA_SIZE)
+			|| (Record->First >= Record->BufferSize)
+			|| (Record->SampleCount > Record->BufferSize)) {
+		return FR_INVALID_PARAMETER;
+	}
+
+	LogRecord = *Record;
+	LogRecordIndex = 0;
+	LogRecordState = LOG_RECORD_INFO;
+
+	return FR_OK;
+}
+
+/**
+ * @brief  Tells whether a queued record is still being written.
+ * @retval 1 while the description and samples of the record are in use,
+ *         0 otherwise
+ */
+uint8_t LogStorage_IsRecordPending(void) {
+	return (LogRecordState != LOG_RECORD_NONE);
+}
+
+/**
+ * @brief  Writes the partially filled block and closes the log file.
+ * @retval FatFs result code
+ */
+FRESULT LogStorage_Close(void) {
+	FRESULT res = FR_OK;
+
+	while ((res == FR_OK) && (LogRecordState != LOG_RECORD_NONE)) {
+		res = LogStorage_WriteRecordBlock();
+	}
+	LogRecordState = LOG_RECORD_NONE;
+
+	if ((res == FR_OK) && (BlockFill != 0)) {
+		res = LogStorage_WriteBlock();
+	}
+
+	if (LogStreaming) {
+		LogStreaming = 0;
+		if (f_stream_close(&LogStream) != FR_OK) {
+			res = FR_INT_ERR;
+		}
+	}
+
+	/* Release the unused part of the reserved space */
+	if (LogPreallocated && (f_truncate(&LogFile) != FR_OK)) {
+		res = FR_INT_ERR;
+	}
+
+	if (f_close(&LogFile) != FR_OK) {
+		res = FR_INT_ERR;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Returns the number of samples stored so far.
+ * @retval Sample count
+ */
+uint32_t LogStorage_GetSampleCount(void) {
+	return (uint32_t) (LogSampleIndex + BlockFill);
+}
+
+/**
+ * @brief  Takes a snapshot of the storage stage counters.
+ * @param  pStats: statistics output
+ * @retval None
+ */
+void LogStorage_GetStats(LogStorage_StatsTypeDef *pStats) {
+	*pStats = LogStats;
+}
+
+/**
+ * @brief  Cuts a log file that was not closed to the length of the data
+ *         blocks actually written.
+ *         The blocks following the header are read forward until one does
+ *         not carry the expected sequence number and session tag; the file
+ *         is truncated there. A file that was closed normally is left as it
+ *         is.
+ * @note   Must not be called while a log file is open.
+ * @param  path: log file name
+ * @param  pBlocks: number of valid data blocks output, may be NULL
+ * @retval FatFs result code, FR_NO_FILE if the file is not a sample log
+ */
+FRESULT LogStorage_Recover(const TCHAR *path, uint32_t *pBlocks) {
+	LogFileHeader_TypeDef *header = (LogFileHeader_TypeDef *) aStreamBuffer;
+	UINT count = 0;
+	DWORD length;
+	FRESULT res;
+
+	res = f_open(&LogFile, path, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+	if (res != FR_OK) {
+		return res;
+	}
+
+	res = f_read(&LogFile, header, LOG_BLOCK_SIZE, &count);
+	if ((res == FR_OK)
+			&& ((count != LOG_BLOCK_SIZE) || (header->Magic != LOG_FILE_MAGIC))) {
+		res = FR_NO_FILE;
+	}
+
+	if (res == FR_OK) {
+		LogSession = header->Session;
+		res = f_stream_recover(&LogFile, aStreamBuffer, LOG_STREAM_BLOCKS,
+				LogStorage_IsBlockValid, &length);
+	}
+	if ((res == FR_OK) && (length < f_size(&LogFile))) {
+		res = f_lseek(&LogFile, length);
+		if (res == FR_OK) {
+			res = f_truncate(&LogFile);
+		}
+	}
+	if ((res == FR_OK) && (pBlocks != NULL)) {
+		*pBlocks = length / LOG_BLOCK_SIZE - 1;
+	}
+
+	if (f_close(&LogFile) != FR_OK) {
+		res = FR_INT_ERR;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Writes the file header block.
+ * @param  Init: description of the logged stream
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_WriteHeader(const LogStorage_InitTypeDef *Init) {
+	LogFileHeader_TypeDef *header;
+	FRESULT res;
+
+	res = LogStorage_GetBlock((void **) &header);
+	if (res != FR_OK) {
+		return res;
+	}
+
+	memset(header, 0, sizeof(*header));
+	header->Magic = LOG_FILE_MAGIC;
+	header->Version = LOG_FILE_VERSION;
+	header->HeaderSize = sizeof(LogFileHeader_TypeDef);
+	header->BlockSize = LOG_BLOCK_SIZE;
+	header->SamplesPerBlock = BlockSamples;
+	header->SampleRateHz = Init->SampleRateHz;
+	header->StartTick = HAL_GetTick();
+	header->StartTime = LOG_FATTIME();
+	header->Resolution = Init->Resolution;
+	header->ChannelCount = Init->ChannelCount;
+	header->Session = Init->Session;
+	memcpy(header->ChannelMap, Init->ChannelMap, sizeof(header->ChannelMap));
+	memcpy(header->Gain, Init->Gain, sizeof(header->Gain));
+	memcpy(header->Offset, Init->Offset, sizeof(header->Offset));
+	header->Flags = Init->Flags;
+	header->Decimation = Init->Decimation;
+
+	return LogStorage_Write(header, LOG_BLOCK_SIZE);
+}
+
+/**
+ * @brief  Packs the samples of the current block and writes it.
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_WriteBlock(void) {
+	SampleRing_StatsTypeDef ringStats;
+	LogBlock_TypeDef *block;
+	uint8_t *pData;
+	uint32_t i;
+	FRESULT res;
+
+	res = LogStorage_GetBlock((void **) &block);
+	if (res != FR_OK) {
+		return res;
+	}
+	pData = block->Data;
+
+	SampleRing_GetStats(pLogRing, &ringStats);
+
+	block->Sync = LOG_BLOCK_SYNC;
+	block->Type = LOG_BLOCK_TYPE_SAMPLES;
+	block->Count = BlockFill;
+	block->Sequence = LogSequence;
+	block->Dropped = ringStats.Overflows;
+	block->FirstSample = LogSampleIndex;
+
+	/* Pad a partial block with zeros so it packs as whole pairs */
+	for (i = BlockFill; i < BlockSamples; i++) {
+		aBlockSamples[i] = 0;
+	}
+	if (BlockSamples == LOG_BLOCK_SAMPLES16) {
+		for (i = 0; i < BlockSamples; i++) {
+			LOG_PACK16(pData, aBlockSamples[i]);
+			pData += 2;
+		}
+	} else {
+		for (i = 0; i < BlockSamples; i += 2) {
+			LOG_PACK12(pData, aBlockSamples[i], aBlockSamples[i + 1]);
+			pData += 3;
+		}
+	}
+	block->Session = LogSession;
+
+	res = LogStorage_Write(block, LOG_BLOCK_SIZE);
+
+	LogStats.SamplesWritten += BlockFill;
+	LogSampleIndex += BlockFill;
+	LogSequence++;
+	BlockFill = 0;
+
+	return res;
+}
+
+/**
+ * @brief  Writes the next block of the queued record: its description
+ *         first, then its samples.
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_WriteRecordBlock(void) {
+	SampleRing_StatsTypeDef ringStats;
+	LogBlock_TypeDef *block;
+	uint8_t *pData;
+	uint16_t s0, s1;
+	uint32_t i, count, pos;
+	FRESULT res;
+
+	res = LogStorage_GetBlock((void **) &block);
+	if (res != FR_OK) {
+		return res;
+	}
+	pData = block->Data;
+
+	SampleRing_GetStats(pLogRing, &ringStats);
+
+	block->Sync = LOG_BLOCK_SYNC;
+	block->Sequence = LogSequence;
+	block->Dropped = ringStats.Overflows;
+
+	if (LogRecordState == LOG_RECORD_INFO) {
+		block->Type = LogRecord.InfoType;
+		block->Count = 0;
+		block->FirstSample = 0;
+
+		memset(pData, 0, LOG_BLOCK_DATA_SIZE);
+		memcpy(pData, LogRecord.pInfo, LogRecord.InfoSize);
+
+		LogRecordState = LOG_RECORD_SAMPLES;
+	} else {
+		count = LogRecord.SampleCount - LogRecordIndex;
+		if (count > LOG_BLOCK_SAMPLES) {
+			count = LOG_BLOCK_SAMPLES;
+		}
+		pos = LogRecord.First + LogRecordIndex;
+		if (pos >= LogRecord.BufferSize) {
+			pos -= LogRecord.BufferSize;
+		}
+
+		block->Type = LogRecord.DataType;
+		block->Count = count;
+		block->FirstSample = LogRecordIndex;
+
+		/* A partial block is padded with zeros */
+		s0 = 0;
+		for (i = 0; i < count; i++) {
+			s1 = LogRecord.pBuffer[pos];
+			if (++pos == LogRecord.BufferSize) {
+				pos = 0;
+			}
+			if (i & 1) {
+				LOG_PACK12(pData, s0, s1);
+				pData += 3;
+			} else {
+				s0 = s1;
+			}
+		}
+		if (count & 1) {
+			LOG_PACK12(pData, s0, 0);
+			pData += 3;
+		}
+		memset(pData, 0, block->Data + LOG_BLOCK_DATA_SIZE - pData);
+
+		LogRecordIndex += count;
+	}
+	block->Session = LogSession;
+
+	res = LogStorage_Write(block, LOG_BLOCK_SIZE);
+
+	LogSequence++;
+	if ((LogRecordState == LOG_RECORD_SAMPLES)
+			&& (LogRecordIndex == LogRecord.SampleCount)) {
+		LogRecordState = LOG_RECORD_NONE;
+		LogStats.Records++;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Returns where the next block is to be built: in place in the
+ *         streaming buffer, or in LogBlock when writing through f_write.
+ * @param  ppBlock: block pointer output
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_GetBlock(void **ppBlock) {
+	UINT space;
+	BYTE *p;
+
+	if (LogStreaming) {
+		p = f_stream_buffer(&LogStream, &space);
+		if (space >= LOG_BLOCK_SIZE) {
+			*ppBlock = p;
+			return FR_OK;
+		}
+
+		/* End of the pre-allocated extent, the file grows from here on */
+		LogStreaming = 0;
+		if (f_stream_close(&LogStream) != FR_OK) {
+			return FR_INT_ERR;
+		}
+	}
+
+	*ppBlock = &LogBlock;
+	return FR_OK;
+}
+
+/**
+ * @brief  Writes a block obtained from LogStorage_GetBlock() and updates the
+ *         statistics.
+ * @param  pData: bytes to write
+ * @param  Size: number of bytes
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_Write(const void *pData, uint32_t Size) {
+	uint32_t start, elapsed;
+	UINT written = 0;
+	FRESULT res;
+
+	start = HAL_GetTick();
+	if (LogStreaming) {
+		/* The block was built in place, this only queues it */
+		res = f_stream_commit(&LogStream, Size);
+		if (res == FR_OK) {
+			written = Size;
+		}
+	} else {
+		res = f_write(&LogFile, pData, Size, &written);
+	}
+	elapsed = HAL_GetTick() - start;
+
+	if ((res == FR_OK) && (written != Size)) {
+		/* Volume full */
+		res = FR_DENIED;
+	}
+
+	if ((LogStats.UnsyncedBytes == 0) && (written != 0)) {
+		LogDirtyTick = start;
+	}
+	LogStats.Writes++;
+	LogStats.BytesWritten += written;
+	LogStats.UnsyncedBytes += written;
+	if (elapsed > LogStats.MaxWriteTime) {
+		LogStats.MaxWriteTime = elapsed;
+	}
+
+	return res;
+}
+
+/**
+ * @brief  Applies the group commit policy: commits the file when requested,
+ *         when enough bytes were written or when the oldest uncommitted
+ *         write is too old.
+ * @retval FatFs result code
+ */
+static FRESULT LogStorage_CheckSync(void) {
+	if (LogStats.UnsyncedBytes == 0) {
+		/* Nothing to commit */
+		LogSyncRequest = 0;
+		return FR_OK;
+	}
+
+	if (LogSyncRequest
+			|| ((LogSyncBytes != 0) && (LogStats.UnsyncedBytes >= LogSyncBytes))
+			|| ((LogSyncPeriod != 0)
+					&& (HAL_GetTick() - LogDirtyTick >= LogSyncPeriod))) {
+		return LogStorage_Sync();
+	}
+
+	return FR_OK;
+}
+
+/**
+ * @brief  Tells whether a sector of a log file holds the data block expected
+ *         at its offset. Callback of f_stream_recover().
+ * @param  pSector: sector content
+ * @param  Offset: offset of the sector in the file
+ * @retval Non-zero if the block is valid
+ */
+static int LogStorage_IsBlockValid(const BYTE *pSector, DWORD Offset) {
+	const LogBlock_TypeDef *block = (const LogBlock_TypeDef *) pSector;
+
+	return (block->Sync == LOG_BLOCK_SYNC)
+			&& (block->Sequence == Offset / LOG_BLOCK_SIZE - 1)
+			&& (block->Session == LogSession)
+			&& (block->Count <= LOG_BLOCK_SAMPLES);
+}
@@ -27,28 +27,60 @@
  */
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "main.h"
 
 /* Private typedef -----------------------------------------------------------*/
+
+/**
+ * @brief  Progress of a burst capture, see ADC_BurstProcess()
+ */
+typedef enum {
+	BURST_IDLE = 0, /*!< Stream running, no burst in progress             */
+	BURST_REQUESTED, /*!< Burst asked for, started from the main loop      */
+	BURST_RUNNING, /*!< ADC converting continuously into aBurstBuffer     */
+	BURST_COMPLETE, /*!< aBurstBuffer full, the stream is to be restarted */
+	BURST_PENDING, /*!< Stream running, burst waiting for the storage stage */
+	BURST_STORING /*!< Stream running, burst being written to the card    */
+} BurstState_TypeDef;
+
 /* Private define ------------------------------------------------------------*/
+
+/* Number of entries of aAdcEventWatch */
+#define ADC_EVENT_WATCHES               (sizeof(aAdcEventWatch) / sizeof(aAdcEventWatch[0]))
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 FATFS SDFatFs; /* File system object for SD card logical drive */
-FIL MyFile; /* File object */
 char SDPath[4]; /* SD card logical drive path */
+uint32_t adcTick = 0;
+
+/* File name and number of the current recording session */
+static TCHAR LogName[LOG_SESSION_NAME_SIZE];
+uint32_t LogIndex;
+static uint8_t formatRequest;
+static uint8_t eraseFinished;
+
+/* ADC to storage stage sample ring */
+static uint16_t aSampleRingBuffer[SAMPLE_RING_SIZE];
+
+#if ADC_DECIMATION > 1
+/* Decimation stage between the ADC interrupt and the sample ring */
+static Decimator_TypeDef Decimator;
+static Decimator_InitTypeDef DecimatorInit;
+static q15_t aDecimatorBuffer[ADC_DECIMATION_BUFFER_SIZE];
+#endif
+SampleRing_TypeDef SampleRing;
 
-FRESULT res; /* FatFs function common result code */
-uint32_t byteswritten, bytesread, adcTick = 0; /* File write/read counts */
-uint8_t wtext[] = "This is STM32 working with FatFs"; /* File write buffer */
-uint8_t rtext[100]; /* File read buffer */
-
-#define dataBufferSize 13
-uint8_t dataBuffer[dataBufferSize] = { 0 };
+/* Description of the logged stream */
+static LogStorage_InitTypeDef LogInit;
 
-uint32_t SDWriteFinished = 1;
+__IO uint32_t SDWriteFinished = 1;
 
 /* ADC handler declaration */
 ADC_HandleTypeDef AdcHandle;
+#if ADC_DUAL_MODE
+ADC_HandleTypeDef AdcSlaveHandle;
+#endif
 
 DAC_HandleTypeDef DacHandle;
 static DAC_ChannelConfTypeDef sConfig;
@@ -62,11 +94,90 @@ static TIM_HandleTypeDef htim;
 /* Variable used to get converted value */
 __IO uint16_t uhADCxConvertedValue = 0;
 
+/* Channels converted at each TIM trigger, in rank order. One scan is one
+ frame of the log, the samples of a frame are stored in this order. In dual
+ mode even entries are converted by ADCx and odd ones by ADCx_SLAVE, both
+ entries of a rank at the same instant and with the same sampling time */
+static const ADC_ScanChannelTypeDef aAdcScanTable[ADC_SCAN_CHANNELS] = {
+	/* Pack voltage, through the divider */
+	{ ADCx_VBAT_CHANNEL, ADC_SAMPLETIME_19CYCLES_5,
+	  ADC_VBAT_DIVIDER * ADC_VREF_VOLTS / ADC_FULL_SCALE, 0.0f },
+	/* Charge current, from the current sense amplifier */
+	{ ADCx_IBAT_CHANNEL, ADC_SAMPLETIME_19CYCLES_5,
+	  ADC_VREF_VOLTS / ADC_FULL_SCALE / ADC_IBAT_VOLTS_PER_AMP,
+	  -ADC_IBAT_ZERO_VOLTS / ADC_IBAT_VOLTS_PER_AMP },
+	/* Cell temperature, thermistor divider voltage (high impedance) */
+	{ ADCx_TEMP_CHANNEL, ADC_SAMPLETIME_181CYCLES_5,
+	  ADC_VREF_VOLTS / ADC_FULL_SCALE, 0.0f },
+#if ADC_DUAL_MODE
+	/* Internal reference, tracks the supply used as ADC reference */
+	{ ADC_CHANNEL_VREFINT, ADC_SAMPLETIME_181CYCLES_5,
+	  ADC_VREF_VOLTS / ADC_FULL_SCALE, 0.0f },
+#endif
+};
+
+/* Analog watchdogs triggering the event recorder, each on the ADC that
+ converts the watched entry of the scan table */
+static const ADC_EventWatchTypeDef aAdcEventWatch[] = {
+	/* Pack overvoltage */
+	{ 0, ADC_ANALOGWATCHDOG_1, EVENT_VBAT_LOW_VOLTS, EVENT_VBAT_HIGH_VOLTS },
+#if ADC_DUAL_MODE
+	/* Charge current spike */
+	{ 1, ADC_ANALOGWATCHDOG_1, EVENT_IBAT_LOW_AMPS, EVENT_IBAT_HIGH_AMPS },
+#else
+	/* Charge current spike, watchdog 2 only compares the 8 MSBs */
+	{ 1, ADC_ANALOGWATCHDOG_2, EVENT_IBAT_LOW_AMPS, EVENT_IBAT_HIGH_AMPS },
+#endif
+};
+
+/* Circular buffer filled by the ADC DMA, processed one half at a time.
+ Word-sized so that the dual mode DMA can store a pair of samples per
+ transfer; the samples are read as half-words */
+static uint32_t aADCxConvertedData[ADC_DMA_BUFFER_SIZE / 2];
+
+/* First sample of aADCxConvertedData not processed yet: the start of the
+ half the DMA is filling */
+static uint32_t AdcStreamNext;
+
+/* Burst capture buffer, word-sized for the dual mode DMA like
+ aADCxConvertedData. It is only written by the DMA during a burst and only
+ read by the storage stage until the burst is on the card; the DMA cannot
+ reach the CCM RAM, so it is reserved in the main SRAM */
+static uint32_t aBurstBuffer[ADC_BURST_SAMPLES / 2];
+static __IO BurstState_TypeDef BurstState = BURST_IDLE;
+static LogBurstInfo_TypeDef BurstInfo;
+static LogStorage_RecordTypeDef BurstRecord;
+static uint32_t BurstStopCycles; /* Cycle counter when the stream stopped */
+
+/* Event recorder, fed with the acquired frames before decimation, and the
+ record of its window */
+static uint16_t aEventBuffer[EVENT_WINDOW_SAMPLES];
+EventRecorder_TypeDef EventRecorder;
+static LogEventInfo_TypeDef EventInfo;
+static LogStorage_RecordTypeDef EventRecord;
+static uint8_t EventStoring;
+
+/* Number of DMA transfer errors reported by the ADC, and of burst captures
+ that did not complete */
+__IO uint32_t AdcErrorCount = 0;
+
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void Error_Handler(void);
 static void ADC_Config(void);
+static void ADC_StartStream(void);
+static void ADC_StopStream(void);
+static void ADC_BurstConfig(void);
+static void ADC_BurstEnd(void);
+static void ADC_BurstProcess(void);
+static uint32_t ADC_GetDmaPosition(void);
+static void ADC_EventConfig(void);
+static void ADC_EventArm(FunctionalState State);
+static void ADC_EventTrigger(ADC_HandleTypeDef *hadc, uint32_t WatchdogNumber);
+static void ADC_EventProcess(void);
 static void TIM_Config(void);
+static void ADC_ProcessBlock(const uint16_t *pData, uint32_t Count);
+static uint8_t KEY_Pressed(void);
 
 static void DAC_Ch1_TriangleConfig(void);
 static void DAC_Ch1_EscalatorConfig(void);
@@ -80,6 +191,8 @@ static void TIM6_Config(void);
  * @retval None
  */
 int main(void) {
+	uint32_t i;
+
 	/* STM32F3xx HAL library initialization:
 	 - Configure the Flash prefetch
 	 - Systick timer is configured by default as source of time base, but user
@@ -99,17 +212,38 @@ int main(void) {
 	/* Configure the system clock to 72 MHz */
 	SystemClock_Config();
 
+	/* Sample ring between the ADC interrupt and the storage stage */
+	SampleRing_Init(&SampleRing, aSampleRingBuffer, SAMPLE_RING_SIZE,
+			ADC_SCAN_CHANNELS);
+#if ADC_DECIMATION > 1
+	DecimatorInit.Channels = ADC_SCAN_CHANNELS;
+	DecimatorInit.Ratio = ADC_DECIMATION;
+	DecimatorInit.TapsPerPhase = ADC_DECIMATION_TAPS;
+	DecimatorInit.BlockFrames = ADC_DECIMATION_BLOCK_FRAMES;
+	DecimatorInit.Design = ADC_DECIMATION_DESIGN;
+	DecimatorInit.ExtraBits = ADC_DECIMATION_EXTRA_BITS;
+	DecimatorInit.Fast = ADC_DECIMATION_FAST;
+	if (Decimator_Init(&Decimator, &DecimatorInit, aDecimatorBuffer,
+			ADC_DECIMATION_BUFFER_SIZE) != HAL_OK) {
+		Error_Handler();
+	}
+#endif
+	EventRecorder_Init(&EventRecorder, aEventBuffer, EVENT_WINDOW_SAMPLES,
+			ADC_SCAN_CHANNELS, EVENT_POST_FRAMES * ADC_SCAN_CHANNELS);
+
 	/*##-1- TIM Peripheral Configuration ######################################*/
 	TIM_Config();
 
 	/*##-2- Configure the ADC peripheral ######################################*/
 	ADC_Config();
 
-	/*##-4- Start the conversion process and enable interrupt ##################*/
-	if (HAL_ADC_Start_IT(&AdcHandle) != HAL_OK) {
-		/* Start Conversation Error */
-		Error_Handler();
-	}
+	/*##-4- Start the conversion process and enable DMA #######################*/
+	ADC_StartStream();
+
+	/* Cycle counter, measures how long a burst interrupts the stream */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 
 	/*##-3- TIM counter enable ################################################*/
 	if (HAL_TIM_Base_Start(&htim) != HAL_OK) {
@@ -127,80 +261,130 @@ int main(void) {
 	DAC_Ch1_TriangleConfig();
 //	DAC_Ch1_EscalatorConfig();
 
+	/* Holding KEY at reset starts from a freshly formatted card */
+	BSP_PB_Init(BUTTON_KEY, BUTTON_MODE_GPIO);
+	formatRequest = (BSP_PB_GetState(BUTTON_KEY) == KEY_PRESSED);
+
 	/*##-1- Link the micro SD disk I/O driver ##################################*/
-	if (FATFS_LinkDriver(&SD_Driver, SDPath) == 0) {
-		/*##-2- Register the file system object to the FatFs module ##############*/
-		if (f_mount(&SDFatFs, (TCHAR const*) SDPath, 0) != FR_OK) {
-			/* FatFs Initialization Error */
-			Error_Handler();
-		} else {
-			/*##-3- Create a FAT file system (format) on the logical drive #########*/
-			/* WARNING: Formatting the uSD card will delete all content on the device */
-			if (f_mkfs((TCHAR const*) SDPath, 0, 0) != FR_OK) {
-				/* FatFs Format Error */
-				Error_Handler();
-			} else {
-				/*##-4- Create and Open a new text file object with write access #####*/
-				if (f_open(&MyFile, "STM32.TXT", FA_CREATE_ALWAYS | FA_WRITE)
-						!= FR_OK) {
-					/* 'STM32.TXT' file Open for write Error */
-					Error_Handler();
-				} else {
-					/*##-5- Write data to the text file ################################*/
-					res = f_write(&MyFile, wtext, sizeof(wtext),
-							(void *) &byteswritten);
-
-					/*##-6- Close the open text file #################################*/
-					if (f_close(&MyFile) != FR_OK) {
-						Error_Handler();
-					}
-
-					if ((byteswritten == 0) || (res != FR_OK)) {
-						/* 'STM32.TXT' file Write or EOF Error */
-						Error_Handler();
-					} else {
-						/*##-7- Open the text file object with read access ###############*/
-						if (f_open(&MyFile, "STM32.TXT", FA_READ) != FR_OK) {
-							/* 'STM32.TXT' file Open for read Error */
-							Error_Handler();
-						} else {
-							/*##-8- Read data from the text file ###########################*/
-							res = f_read(&MyFile, rtext, sizeof(rtext),
-									(UINT*) &bytesread);
-
-							if ((bytesread == 0) || (res != FR_OK)) {
-								/* 'STM32.TXT' file Read or EOF Error */
-								Error_Handler();
-							} else {
-								/*##-9- Close the open text file #############################*/
-								f_close(&MyFile);
-
-								/*##-10- Compare read data with the expected data ############*/
-								if ((bytesread != byteswritten)) {
-									/* Read data is different from the expected data */
-									Error_Handler();
-								} else {
-									/* Success of the demo: no error occurrence */
-									BSP_LED_On(LED2);
-								}
-							}
-						}
-					}
-				}
-			}
-		}
+	if (FATFS_LinkDriver(&SD_Driver, SDPath) != 0) {
+		Error_Handler();
+	}
+
+	/*##-2- Mount the volume, format the card only if it holds none ##########*/
+	if (LogSession_Mount(&SDFatFs, (TCHAR const*) SDPath, formatRequest)
+			!= FR_OK) {
+		/* FatFs Initialization or Format Error */
+		Error_Handler();
 	}
 
-	if (f_open(&MyFile, "DATA.TXT", FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
-		/* 'STM32.TXT' file Open for write Error */
+	/*##-3- Name the file of this recording session ##########################*/
+	if (LogSession_NextName(LogName, &LogIndex) != FR_OK) {
+		Error_Handler();
+	}
+	BSP_LED_On(LED2);
+
+	/* Describe the logged stream in the file header */
+	memset(&LogInit, 0, sizeof(LogInit));
+	LogInit.SampleRateHz = LOG_SAMPLE_RATE_HZ;
+	LogInit.Resolution = LOG_RESOLUTION;
+	LogInit.ChannelCount = ADC_SCAN_CHANNELS;
+	for (i = 0; i < ADC_SCAN_CHANNELS; i++) {
+		LogInit.ChannelMap[i] = (uint8_t) aAdcScanTable[i].Channel;
+		/* One LSB of the stream is a fraction of an ADC LSB */
+		LogInit.Gain[i] = aAdcScanTable[i].Gain / (1 << (LOG_RESOLUTION - 12));
+		LogInit.Offset[i] = aAdcScanTable[i].Offset;
+	}
+	LogInit.Decimation = ADC_DECIMATION;
+#if ADC_DUAL_MODE
+	LogInit.Flags = LOG_FLAG_PAIRED;
+#endif
+	LogInit.PreallocSize = LOG_PREALLOC_SIZE;
+	LogInit.SyncBytes = LOG_SYNC_BYTES;
+	LogInit.SyncPeriod = LOG_SYNC_PERIOD_MS;
+	LogInit.Session = (uint16_t) LogIndex;
+	LogInit.AppendOnly = LOG_APPEND_ONLY;
+
+	/* Describe the burst records, the channels of the first rank */
+	memset(&BurstInfo, 0, sizeof(BurstInfo));
+	BurstInfo.SampleRateHz = ADC_BURST_RATE_HZ;
+	BurstInfo.SampleCount = ADC_BURST_SAMPLES;
+	BurstInfo.ChannelCount = ADC_BURST_CHANNELS;
+	for (i = 0; i < ADC_BURST_CHANNELS; i++) {
+		BurstInfo.ChannelMap[i] = LogInit.ChannelMap[i];
+		BurstInfo.Gain[i] = aAdcScanTable[i].Gain;
+		BurstInfo.Offset[i] = aAdcScanTable[i].Offset;
+	}
+	BurstInfo.Flags = LogInit.Flags;
+
+	BurstRecord.InfoType = LOG_BLOCK_TYPE_BURST_INFO;
+	BurstRecord.DataType = LOG_BLOCK_TYPE_BURST;
+	BurstRecord.pInfo = &BurstInfo;
+	BurstRecord.InfoSize = sizeof(BurstInfo);
+	BurstRecord.pBuffer = (const uint16_t *) aBurstBuffer;
+	BurstRecord.BufferSize = ADC_BURST_SAMPLES;
+	BurstRecord.First = 0;
+	BurstRecord.SampleCount = ADC_BURST_SAMPLES;
+
+	/* Event records hold the acquired frames, laid out as in the header */
+	memset(&EventInfo, 0, sizeof(EventInfo));
+	EventRecord.InfoType = LOG_BLOCK_TYPE_EVENT_INFO;
+	EventRecord.DataType = LOG_BLOCK_TYPE_EVENT;
+	EventRecord.pInfo = &EventInfo;
+	EventRecord.InfoSize = sizeof(EventInfo);
+	EventRecord.pBuffer = aEventBuffer;
+	EventRecord.BufferSize = EVENT_WINDOW_SAMPLES;
+
+	if (LogStorage_Open(&SampleRing, LogName, &LogInit) != FR_OK) {
+		/* Session file Open for write Error */
 		Error_Handler();
 	}
 
-	/*##-11- Unlink the RAM disk I/O driver ####################################*/
-//	FATFS_UnLinkDriver(SDPath);
+	/* From now on the ADC interrupt queues samples for the storage stage */
 	SDWriteFinished = 0;
+
+	/* Watch for events */
+	EventRecorder_Arm(&EventRecorder);
+	ADC_EventArm(ENABLE);
+
 	/* Infinite loop */
 	while (1) {
+		/* KEY press while logging: capture a burst */
+		if (KEY_Pressed() && !SDWriteFinished && (BurstState == BURST_IDLE)) {
+			BurstState = BURST_REQUESTED;
+		}
+		ADC_BurstProcess();
+		ADC_EventProcess();
+
+		if (SDWriteFinished) {
+			/* Session closed: erase the free space of the card step by step,
+			 * so the next session writes at full speed */
+			if (!eraseFinished) {
+				if (LogSession_EraseFree(LOG_ERASE_CLUSTERS, &eraseFinished)
+						!= FR_OK) {
+					Error_Handler();
+				}
+				if (eraseFinished) {
+					/*##-11- Unlink the RAM disk I/O driver ####################################*/
+					FATFS_UnLinkDriver(SDPath);
+					BSP_LED_On(LED1);
+				}
+			}
+			continue;
+		}
+
+		/* Drain the sample ring to the card, one sector at a time */
+		if (LogStorage_Process() != FR_OK) {
+			Error_Handler();
+		}
+
+		if (LogStorage_GetSampleCount() >= LOG_SAMPLE_LIMIT) {
+			ADC_EventArm(DISABLE);
+			EventRecorder_Disarm(&EventRecorder);
+			SDWriteFinished = 1;
+			if ((LogStorage_Close() != FR_OK) || (LogSession_Close() != FR_OK)) {
+				Error_Handler();
+			}
+		}
 	}
 }
 
@@ -281,6 +465,11 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
  */
 static void ADC_Config(void) {
 	ADC_ChannelConfTypeDef sConfig;
+	ADC_HandleTypeDef *hadc;
+#if ADC_DUAL_MODE
+	ADC_MultiModeTypeDef sMultiMode;
+#endif
+	uint32_t i;
 
 	/* ADC Initialization */
 	AdcHandle.Instance = ADCx;
@@ -288,13 +477,13 @@ static void ADC_Config(void) {
 	AdcHandle.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
 	AdcHandle.Init.Resolution = ADC_RESOLUTION_12B;
 	AdcHandle.Init.DataAlign = ADC_DATAALIGN_RIGHT;
-	AdcHandle.Init.ScanConvMode = DISABLE; /* Sequencer disabled (ADC conversion on only 1 channel: channel set on rank 1) */
+	AdcHandle.Init.ScanConvMode = ENABLE; /* Sequencer enabled: each trigger converts the channels of the scan table in rank order */
 	AdcHandle.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
 	AdcHandle.Init.LowPowerAutoWait = DISABLE;
 	AdcHandle.Init.ContinuousConvMode = DISABLE; /* Continuous mode disabled to have only 1 conversion at each conversion trig */
-	AdcHandle.Init.NbrOfConversion = 1; /* Parameter discarded because sequencer is disabled */
-	AdcHandle.Init.DiscontinuousConvMode = DISABLE; /* Parameter discarded because sequencer is disabled */
-	AdcHandle.Init.NbrOfDiscConversion = 1; /* Parameter discarded because sequencer is disabled */
+	AdcHandle.Init.NbrOfConversion = ADC_SCAN_RANKS; /* Ranks of the scan table converted by this ADC */
+	AdcHandle.Init.DiscontinuousConvMode = DISABLE; /* The whole sequence is converted at each trigger */
+	AdcHandle.Init.NbrOfDiscConversion = 1; /* Parameter discarded because discontinuous mode is disabled */
 	AdcHandle.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T2_TRGO; /* Conversion start trigged at each external event */
 	AdcHandle.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
 	AdcHandle.Init.DMAContinuousRequests = ENABLE;
@@ -305,16 +494,491 @@ static void ADC_Config(void) {
 		Error_Handler();
 	}
 
-	/* Configure ADC regular channel */
-	sConfig.Channel = ADCx_CHANNEL;
-	sConfig.Rank = ADC_REGULAR_RANK_1;
-	sConfig.SamplingTime = ADC_SAMPLETIME_19CYCLES_5;
-	sConfig.SingleDiff = ADC_SINGLE_ENDED;
-	sConfig.OffsetNumber = ADC_OFFSET_NONE;
-	sConfig.Offset = 0;
+#if ADC_DUAL_MODE
+	/* The slave converts when the master is triggered, its results are
+	 transferred by the DMA of the master */
+	AdcSlaveHandle.Instance = ADCx_SLAVE;
+	AdcSlaveHandle.Init = AdcHandle.Init;
+	AdcSlaveHandle.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+	AdcSlaveHandle.Init.DMAContinuousRequests = DISABLE;
+
+	if (HAL_ADC_Init(&AdcSlaveHandle) != HAL_OK) {
+		/* ADC initialization Error */
+		Error_Handler();
+	}
+#endif
+
+	/* Configure ADC regular channels, ranks follow the scan table */
+	for (i = 0; i < ADC_SCAN_CHANNELS; i++) {
+#if ADC_DUAL_MODE
+		hadc = (i & 1) ? &AdcSlaveHandle : &AdcHandle;
+#else
+		hadc = &AdcHandle;
+#endif
+		sConfig.Channel = aAdcScanTable[i].Channel;
+		sConfig.Rank = ADC_REGULAR_RANK_1 + i * ADC_SCAN_RANKS / ADC_SCAN_CHANNELS;
+		sConfig.SamplingTime = aAdcScanTable[i].SamplingTime;
+		sConfig.SingleDiff = ADC_SINGLE_ENDED;
+		sConfig.OffsetNumber = ADC_OFFSET_NONE;
+		sConfig.Offset = 0;
+
+		if (HAL_ADC_ConfigChannel(hadc, &sConfig) != HAL_OK) {
+			/* Channel Configuration Error */
+			Error_Handler();
+		}
+	}
+
+#if ADC_DUAL_MODE
+	/* Dual regular simultaneous mode, one DMA transfer per pair of 12-bit
+	 results */
+	sMultiMode.Mode = ADC_DUALMODE_REGSIMULT;
+	sMultiMode.DMAAccessMode = ADC_DMAACCESSMODE_12_10_BITS;
+	sMultiMode.TwoSamplingDelay = ADC_TWOSAMPLINGDELAY_1CYCLE;
+
+	if (HAL_ADCEx_MultiModeConfigChannel(&AdcHandle, &sMultiMode) != HAL_OK) {
+		/* Multimode Configuration Error */
+		Error_Handler();
+	}
+#endif
+
+	ADC_EventConfig();
+}
+
+/**
+ * @brief  Starts the background stream: TIM triggered conversions of the
+ *         scan table into the circular DMA buffer.
+ * @param  None
+ * @retval None
+ */
+static void ADC_StartStream(void) {
+	AdcStreamNext = 0;
+#if ADC_DUAL_MODE
+	if (HAL_ADCEx_MultiModeStart_DMA(&AdcHandle, aADCxConvertedData,
+			ADC_DMA_BUFFER_SIZE / 2) != HAL_OK) {
+#else
+	if (HAL_ADC_Start_DMA(&AdcHandle, aADCxConvertedData,
+			ADC_DMA_BUFFER_SIZE) != HAL_OK) {
+#endif
+		/* Start Conversation Error */
+		Error_Handler();
+	}
+}
+
+/**
+ * @brief  Stops the background stream. The whole frames converted since the
+ *         last DMA callback are queued, including a half completed while
+ *         the stream was being stopped.
+ * @param  None
+ * @retval None
+ */
+static void ADC_StopStream(void) {
+	uint32_t filled, next;
+
+	/* The DMA callbacks are held off, so a half completing from here on is
+	 * only queued below */
+	HAL_NVIC_DisableIRQ(ADCx_DMA_IRQn);
+
+	/* Read before the stop, which rewinds the DMA counter */
+	filled = ADC_GetDmaPosition();
+#if ADC_DUAL_MODE
+	if (HAL_ADCEx_MultiModeStop_DMA(&AdcHandle) != HAL_OK) {
+#else
+	if (HAL_ADC_Stop_DMA(&AdcHandle) != HAL_OK) {
+#endif
+		Error_Handler();
+	}
+	BurstStopCycles = DWT->CYCCNT;
+
+	__HAL_DMA_CLEAR_FLAG(AdcHandle.DMA_Handle,
+			__HAL_DMA_GET_HT_FLAG_INDEX(AdcHandle.DMA_Handle)
+					| __HAL_DMA_GET_TC_FLAG_INDEX(AdcHandle.DMA_Handle));
+	HAL_NVIC_ClearPendingIRQ(ADCx_DMA_IRQn);
+	HAL_NVIC_EnableIRQ(ADCx_DMA_IRQn);
+
+	/* From the first sample not processed to the last whole frame, across
+	 * the end of the buffer if the DMA wrapped meanwhile */
+	filled -= filled % ADC_SCAN_CHANNELS;
+	next = AdcStreamNext;
+	if (filled < next) {
+		ADC_ProcessBlock((const uint16_t *) aADCxConvertedData + next,
+				ADC_DMA_BUFFER_SIZE - next);
+		next = 0;
+	}
+	if (filled > next) {
+		ADC_ProcessBlock((const uint16_t *) aADCxConvertedData + next,
+				filled - next);
+	}
+}
+
+/**
+ * @brief  Burst profile: the channels of the first rank of the scan table,
+ *         converted continuously from the HCLK ADC clock at the minimum
+ *         sampling time. The DMA requests stop with the last transfer of the
+ *         burst buffer, so it is not overwritten.
+ * @note   The ADCs must be stopped. ADC_Config() restores the stream
+ *         profile.
+ * @param  None
+ * @retval None
+ */
+static void ADC_BurstConfig(void) {
+	ADC_ChannelConfTypeDef sConfig;
+	ADC_HandleTypeDef *hadc;
+#if ADC_DUAL_MODE
+	ADC_MultiModeTypeDef sMultiMode;
+#endif
+	uint32_t i;
+
+	AdcHandle.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV1;
+	AdcHandle.Init.ScanConvMode = DISABLE;
+	AdcHandle.Init.ContinuousConvMode = ENABLE;
+	AdcHandle.Init.NbrOfConversion = 1;
+	AdcHandle.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+	AdcHandle.Init.DMAContinuousRequests = DISABLE;
+
+	if (HAL_ADC_Init(&AdcHandle) != HAL_OK) {
+		/* ADC initialization Error */
+		Error_Handler();
+	}
+
+#if ADC_DUAL_MODE
+	AdcSlaveHandle.Init = AdcHandle.Init;
+
+	if (HAL_ADC_Init(&AdcSlaveHandle) != HAL_OK) {
+		/* ADC initialization Error */
+		Error_Handler();
+	}
+#endif
+
+	for (i = 0; i < ADC_BURST_CHANNELS; i++) {
+#if ADC_DUAL_MODE
+		hadc = (i & 1) ? &AdcSlaveHandle : &AdcHandle;
+#else
+		hadc = &AdcHandle;
+#endif
+		sConfig.Channel = aAdcScanTable[i].Channel;
+		sConfig.Rank = ADC_REGULAR_RANK_1;
+		sConfig.SamplingTime = ADC_BURST_SAMPLETIME;
+		sConfig.SingleDiff = ADC_SINGLE_ENDED;
+		sConfig.OffsetNumber = ADC_OFFSET_NONE;
+		sConfig.Offset = 0;
+
+		if (HAL_ADC_ConfigChannel(hadc, &sConfig) != HAL_OK) {
+			/* Channel Configuration Error */
+			Error_Handler();
+		}
+	}
+
+#if ADC_DUAL_MODE
+	/* Same pairing as the stream, the DMA mode follows the master */
+	sMultiMode.Mode = ADC_DUALMODE_REGSIMULT;
+	sMultiMode.DMAAccessMode = ADC_DMAACCESSMODE_12_10_BITS;
+	sMultiMode.TwoSamplingDelay = ADC_TWOSAMPLINGDELAY_1CYCLE;
+
+	if (HAL_ADCEx_MultiModeConfigChannel(&AdcHandle, &sMultiMode) != HAL_OK) {
+		/* Multimode Configuration Error */
+		Error_Handler();
+	}
+#endif
+}
+
+/**
+ * @brief  Ends a burst: stops the continuous conversions, restores the
+ *         stream profile and restarts the stream. The frames missed since
+ *         the stream stopped, to within one, are accounted as dropped.
+ * @param  None
+ * @retval None
+ */
+static void ADC_BurstEnd(void) {
+	uint32_t missed;
+
+#if ADC_DUAL_MODE
+	if (HAL_ADCEx_MultiModeStop_DMA(&AdcHandle) != HAL_OK) {
+#else
+	if (HAL_ADC_Stop_DMA(&AdcHandle) != HAL_OK) {
+#endif
+		Error_Handler();
+	}
+	ADC_Config();
+
+	/* TIMx runs from the core clock and triggers a frame every TIMx_PERIOD
+	 cycles */
+	missed = (DWT->CYCCNT - BurstStopCycles) / TIMx_PERIOD;
+	if (!SDWriteFinished) {
+		EventRecorder_Skip(&EventRecorder, missed * ADC_SCAN_CHANNELS);
+	}
+#if ADC_DECIMATION > 1
+	/* The frames staged in the decimator are lost with the gap */
+	missed = Decimator_Reset(&Decimator, missed);
+#endif
+	if (!SDWriteFinished) {
+		SampleRing_Skip(&SampleRing, missed * ADC_SCAN_CHANNELS);
+	}
+
+	ADC_StartStream();
+
+	/* The watchdogs were disarmed for the burst */
+	if (EventRecorder_GetState(&EventRecorder) == EVENT_RECORDER_ARMED) {
+		ADC_EventArm(ENABLE);
+	}
+}
+
+/**
+ * @brief  Runs the burst capture from the main loop: switches the ADC to
+ *         the burst profile when a burst is requested, back to the stream
+ *         once the burst buffer is full, and hands the burst to the storage
+ *         stage.
+ * @param  None
+ * @retval None
+ */
+static void ADC_BurstProcess(void) {
+	FRESULT res;
+
+	switch (BurstState) {
+	case BURST_REQUESTED:
+		/* An event window being completed is not cut short */
+		if (EventRecorder_GetState(&EventRecorder) == EVENT_RECORDER_TRIGGERED) {
+			break;
+		}
+		ADC_EventArm(DISABLE);
+		ADC_StopStream();
+		ADC_BurstConfig();
+
+		/* First stream sample after the gap */
+		BurstInfo.StreamSample = SampleRing.Head;
+		BurstInfo.StartTick = HAL_GetTick();
+		BurstState = BURST_RUNNING;
+
+#if ADC_DUAL_MODE
+		if (HAL_ADCEx_MultiModeStart_DMA(&AdcHandle, aBurstBuffer,
+				ADC_BURST_SAMPLES / 2) != HAL_OK) {
+#else
+		if (HAL_ADC_Start_DMA(&AdcHandle, aBurstBuffer, ADC_BURST_SAMPLES)
+				!= HAL_OK) {
+#endif
+			/* Start Conversation Error */
+			Error_Handler();
+		}
+		/* The conversions go on past the end of the burst buffer: the
+		 * overrun that follows is expected */
+		__HAL_ADC_DISABLE_IT(&AdcHandle, ADC_IT_OVR);
+		break;
+
+	case BURST_RUNNING:
+		/* An overrun stops the DMA requests and the burst never completes */
+		if (HAL_GetTick() - BurstInfo.StartTick >= ADC_BURST_TIMEOUT_MS) {
+			ADC_BurstEnd();
+			AdcErrorCount++;
+			BurstState = BURST_IDLE;
+		}
+		break;
+
+	case BURST_COMPLETE:
+		ADC_BurstEnd();
+		/* Session closed meanwhile, the burst has nowhere to go */
+		BurstState = SDWriteFinished ? BURST_IDLE : BURST_PENDING;
+		break;
+
+	case BURST_PENDING:
+		/* The storage stage takes one record at a time, an event record may
+		 * be in the way */
+		if (SDWriteFinished) {
+			BurstState = BURST_IDLE;
+			break;
+		}
+		res = LogStorage_QueueRecord(&BurstRecord);
+		if (res == FR_OK) {
+			BurstInfo.Id++;
+			BurstState = BURST_STORING;
+		} else if (res != FR_DENIED) {
+			Error_Handler();
+		}
+		break;
+
+	case BURST_STORING:
+		/* The burst buffer is free once the record is written */
+		if (!LogStorage_IsRecordPending()) {
+			BurstState = BURST_IDLE;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * @brief  Returns the position of the stream DMA in the ADC DMA buffer.
+ * @param  None
+ * @retval Samples written since the DMA last wrapped to the buffer start
+ */
+static uint32_t ADC_GetDmaPosition(void) {
+#if ADC_DUAL_MODE
+	/* One DMA transfer per pair of samples */
+	return ADC_DMA_BUFFER_SIZE - 2 * AdcHandle.DMA_Handle->Instance->CNDTR;
+#else
+	return ADC_DMA_BUFFER_SIZE - AdcHandle.DMA_Handle->Instance->CNDTR;
+#endif
+}
+
+/**
+ * @brief  Configures the analog watchdogs of aAdcEventWatch, their
+ *         interrupts left disabled until ADC_EventArm().
+ * @note   The ADCs must be stopped.
+ * @param  None
+ * @retval None
+ */
+static void ADC_EventConfig(void) {
+	ADC_AnalogWDGConfTypeDef sWatchdog;
+	const ADC_EventWatchTypeDef *watch;
+	const ADC_ScanChannelTypeDef *channel;
+	ADC_HandleTypeDef *hadc;
+	float low, high;
+	uint32_t i;
+
+	for (i = 0; i < ADC_EVENT_WATCHES; i++) {
+		watch = &aAdcEventWatch[i];
+		channel = &aAdcScanTable[watch->ScanIndex];
+#if ADC_DUAL_MODE
+		hadc = (watch->ScanIndex & 1) ? &AdcSlaveHandle : &AdcHandle;
+#else
+		hadc = &AdcHandle;
+#endif
+		/* Physical window to raw codes, within the converter range */
+		low = (watch->Low - channel->Offset) / channel->Gain;
+		high = (watch->High - channel->Offset) / channel->Gain;
+		low = (low < 0.0f) ? 0.0f : low;
+		high = (high > ADC_FULL_SCALE - 1) ? ADC_FULL_SCALE - 1 : high;
+
+		sWatchdog.WatchdogNumber = watch->WatchdogNumber;
+		sWatchdog.WatchdogMode = ADC_ANALOGWATCHDOG_SINGLE_REG;
+		sWatchdog.Channel = channel->Channel;
+		sWatchdog.ITMode = DISABLE;
+		sWatchdog.HighThreshold = (uint32_t) high;
+		sWatchdog.LowThreshold = (uint32_t) low;
+
+		if (HAL_ADC_AnalogWDGConfig(hadc, &sWatchdog) != HAL_OK) {
+			/* Analog watchdog Configuration Error */
+			Error_Handler();
+		}
+	}
+}
+
+/**
+ * @brief  Enables or disables the interrupts of the analog watchdogs of
+ *         aAdcEventWatch. A conversion outside a window while they were
+ *         disabled does not trigger.
+ * @param  State: ENABLE or DISABLE
+ * @retval None
+ */
+static void ADC_EventArm(FunctionalState State) {
+	ADC_HandleTypeDef *hadc;
+	uint32_t i, it, flag;
+
+	for (i = 0; i < ADC_EVENT_WATCHES; i++) {
+#if ADC_DUAL_MODE
+		hadc = (aAdcEventWatch[i].ScanIndex & 1) ? &AdcSlaveHandle : &AdcHandle;
+#else
+		hadc = &AdcHandle;
+#endif
+		if (aAdcEventWatch[i].WatchdogNumber == ADC_ANALOGWATCHDOG_2) {
+			it = ADC_IT_AWD2;
+			flag = ADC_FLAG_AWD2;
+		} else {
+			it = ADC_IT_AWD1;
+			flag = ADC_FLAG_AWD1;
+		}
+		if (State == ENABLE) {
+			__HAL_ADC_CLEAR_FLAG(hadc, flag);
+			__HAL_ADC_ENABLE_IT(hadc, it);
+		} else {
+			__HAL_ADC_DISABLE_IT(hadc, it);
+		}
+	}
+}
 
-	if (HAL_ADC_ConfigChannel(&AdcHandle, &sConfig) != HAL_OK) {
-		/* Channel Configuration Error */
+/**
+ * @brief  Triggers the event recorder from an analog watchdog interrupt.
+ * @param  hadc: ADC whose watchdog fired
+ * @param  WatchdogNumber: ADC_ANALOGWATCHDOG_x that fired
+ * @retval None
+ */
+static void ADC_EventTrigger(ADC_HandleTypeDef *hadc, uint32_t WatchdogNumber) {
+	ADC_HandleTypeDef *watched;
+	uint32_t i, last;
+
+	/* One record at a time, and the condition may persist */
+	ADC_EventArm(DISABLE);
+	if (BurstState == BURST_RUNNING) {
+		return;
+	}
+
+	for (i = 0; i < ADC_EVENT_WATCHES; i++) {
+#if ADC_DUAL_MODE
+		watched = (aAdcEventWatch[i].ScanIndex & 1) ?
+				&AdcSlaveHandle : &AdcHandle;
+#else
+		watched = &AdcHandle;
+#endif
+		if ((watched == hadc)
+				&& (aAdcEventWatch[i].WatchdogNumber == WatchdogNumber)) {
+			break;
+		}
+	}
+
+	/* The conversion that fired is the last one transferred */
+	last = (ADC_GetDmaPosition() + ADC_DMA_BUFFER_SIZE - 1)
+			% ADC_DMA_BUFFER_SIZE;
+	EventRecorder_Trigger(&EventRecorder,
+			(const uint16_t *) aADCxConvertedData + last,
+			(i < ADC_EVENT_WATCHES) ? aAdcEventWatch[i].ScanIndex : 0);
+}
+
+/**
+ * @brief  Runs the event recorder from the main loop: hands a complete
+ *         window to the storage stage and arms the recorder and the
+ *         watchdogs again once it is on the card.
+ * @param  None
+ * @retval None
+ */
+static void ADC_EventProcess(void) {
+	EventRecorder_WindowTypeDef window;
+	FRESULT res;
+
+	if (EventStoring) {
+		/* The window is frozen until the record is written */
+		if (LogStorage_IsRecordPending()) {
+			return;
+		}
+		EventStoring = 0;
+		if (SDWriteFinished) {
+			return;
+		}
+		EventRecorder_Arm(&EventRecorder);
+		if (BurstState != BURST_RUNNING) {
+			ADC_EventArm(ENABLE);
+		}
+		return;
+	}
+
+	if (SDWriteFinished || !EventRecorder_GetWindow(&EventRecorder, &window)) {
+		return;
+	}
+
+	EventInfo.SampleCount = window.Count;
+	EventInfo.FirstSample = window.FirstIndex;
+	EventInfo.TriggerSample = window.TriggerIndex;
+	EventInfo.TriggerTick = window.TriggerTick;
+	EventInfo.Channel = (uint8_t) window.TriggerSource;
+	EventRecord.First = window.First;
+	EventRecord.SampleCount = window.Count;
+
+	/* The storage stage takes one record at a time, a burst may be in the
+	 * way */
+	res = LogStorage_QueueRecord(&EventRecord);
+	if (res == FR_OK) {
+		EventInfo.Id++;
+		EventStoring = 1;
+	} else if (res != FR_DENIED) {
 		Error_Handler();
 	}
 }
@@ -330,7 +994,7 @@ static void TIM_Config(void) {
 	/* Time Base configuration */
 	htim.Instance = TIMx;
 
-	htim.Init.Period = 7200;
+	htim.Init.Period = TIMx_PERIOD;
 	htim.Init.Prescaler = 0;
 	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
 	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
@@ -354,42 +1018,126 @@ static void TIM_Config(void) {
 }
 
 /**
- * @brief  Conversion complete callback in non blocking mode
- * @param  AdcHandle : AdcHandle handle
- * @note   This example shows a simple way to report end of conversion, and
- *         you can add your own implementation.
+ * @brief  Hands one half of the ADC DMA buffer to the event recorder and,
+ *         through the decimation stage, to the storage stage.
+ * @param  pData: first sample of the completed half
+ * @param  Count: number of samples in the half, whole frames
  * @retval None
- */void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *AdcHandle) {
-	/* Get the converted value of regular channel */
-	uhADCxConvertedValue = HAL_ADC_GetValue(AdcHandle);
-	adcTick += 1;
+ */
+static void ADC_ProcessBlock(const uint16_t *pData, uint32_t Count) {
+#if ADC_DECIMATION > 1
+	const uint16_t *pOutput;
+	uint32_t used, outputCount;
+#endif
+
+	/* First channel of the last frame */
+	uhADCxConvertedValue = pData[Count - ADC_SCAN_CHANNELS];
+	adcTick += Count;
 	if (!SDWriteFinished) {
-		int i;
-		for (i = 0; i < dataBufferSize; i++) {
-			dataBuffer[i] = 32;
-		}
-		sprintf(dataBuffer, "%d, %d", HAL_GetTick(), uhADCxConvertedValue);
-		for (i = 0; i < dataBufferSize; i++) {
-			if (dataBuffer[i] == 0) {
-				dataBuffer[i] = 32;
-			}
-		}
-		dataBuffer[dataBufferSize - 1] = 13;
-		res = f_write(&MyFile, dataBuffer, sizeof(dataBuffer),
-				(void *) &byteswritten);
-		if (adcTick >= 100000) {
-			SDWriteFinished = 1;
-			if (f_close(&MyFile) != FR_OK) {
-				Error_Handler();
-			} else {
-				/*##-11- Unlink the RAM disk I/O driver ####################################*/
-				FATFS_UnLinkDriver(SDPath);
-				BSP_LED_On(LED1);
+		EventRecorder_Put(&EventRecorder, pData, Count);
+#if ADC_DECIMATION > 1
+		/* The stream is stored once decimated */
+		while (Count != 0) {
+			used = Decimator_Process(&Decimator, pData, Count, &pOutput,
+					&outputCount);
+			if (outputCount != 0) {
+				SampleRing_Put(&SampleRing, pOutput, outputCount);
 			}
+			pData += used;
+			Count -= used;
 		}
+#else
+		SampleRing_Put(&SampleRing, pData, Count);
+#endif
 	}
 }
 
+/**
+ * @brief  Conversion half complete callback in non blocking mode
+ * @param  AdcHandle : AdcHandle handle
+ * @note   The DMA is now filling the second half of the buffer, the first
+ *         half can be processed.
+ * @retval None
+ */
+void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *AdcHandle) {
+	if (BurstState == BURST_RUNNING) {
+		/* Half of the burst buffer, nothing to do before it is full */
+		return;
+	}
+	AdcStreamNext = ADC_DMA_BUFFER_SIZE / 2;
+	ADC_ProcessBlock((const uint16_t *) aADCxConvertedData,
+			ADC_DMA_BUFFER_SIZE / 2);
+}
+
+/**
+ * @brief  Conversion complete callback in non blocking mode
+ * @param  AdcHandle : AdcHandle handle
+ * @note   The DMA has wrapped to the first half of the buffer, the second
+ *         half can be processed. SD access is left to the storage stage in
+ *         the main loop, so this callback stays short whatever the card is
+ *         doing. During a burst this is the end of the burst buffer instead.
+ * @retval None
+ */
+void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *AdcHandle) {
+	if (BurstState == BURST_RUNNING) {
+		BurstState = BURST_COMPLETE;
+		return;
+	}
+	AdcStreamNext = 0;
+	ADC_ProcessBlock(
+			(const uint16_t *) aADCxConvertedData + ADC_DMA_BUFFER_SIZE / 2,
+			ADC_DMA_BUFFER_SIZE / 2);
+}
+
+/**
+ * @brief  ADC error callback in non blocking mode
+ * @param  AdcHandle : AdcHandle handle
+ * @retval None
+ */
+void HAL_ADC_ErrorCallback(ADC_HandleTypeDef *AdcHandle) {
+	AdcErrorCount++;
+}
+
+/**
+ * @brief  Analog watchdog 1 callback in non blocking mode
+ * @param  AdcHandle : AdcHandle handle
+ * @retval None
+ */
+void HAL_ADC_LevelOutOfWindowCallback(ADC_HandleTypeDef *AdcHandle) {
+	ADC_EventTrigger(AdcHandle, ADC_ANALOGWATCHDOG_1);
+}
+
+/**
+ * @brief  Analog watchdog 2 callback in non blocking mode
+ * @param  AdcHandle : AdcHandle handle
+ * @retval None
+ */
+void HAL_ADCEx_LevelOutOfWindow2Callback(ADC_HandleTypeDef *AdcHandle) {
+	ADC_EventTrigger(AdcHandle, ADC_ANALOGWATCHDOG_2);
+}
+
+/**
+ * @brief  Polls the KEY button.
+ * @note   A press held since reset, i.e. a format request, is not reported.
+ * @param  None
+ * @retval 1 once per press, 0 otherwise
+ */
+static uint8_t KEY_Pressed(void) {
+	static uint8_t wasPressed = 1;
+	static uint32_t changeTick;
+	uint8_t pressed, event = 0;
+
+	pressed = (BSP_PB_GetState(BUTTON_KEY) == KEY_PRESSED);
+	if ((pressed != wasPressed)
+			&& (HAL_GetTick() - changeTick >= KEY_DEBOUNCE_MS)) {
+		event = pressed;
+		wasPressed = pressed;
+		changeTick = HAL_GetTick();
+	}
+
+	return event;
+}
+
 static void DAC_Ch1_EscalatorConfig(void) {
 	/*##-1- Initialize the DAC peripheral ######################################*/
 	if (HAL_DAC_Init(&DacHandle) != HAL_OK) {
@@ -0,0 +1,170 @@
+/**
+ ******************************************************************************
+ * @file    sample_ring.c
+ * @brief   Lock-free single-producer/single-consumer ring used to hand ADC
+ *          samples from interrupt context to the storage stage.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <string.h>
+#include "sample_ring.h"
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Initializes a sample ring on top of a caller-provided buffer.
+ * @param  ring: ring handle
+ * @param  pBuffer: storage for Size samples
+ * @param  Size: number of samples, must be a power of two
+ * @param  FrameSize: samples per frame (channels converted together), 1 for
+ *         a single channel
+ * @retval None
+ */
+void SampleRing_Init(SampleRing_TypeDef *ring, uint16_t *pBuffer,
+		uint32_t Size, uint32_t FrameSize) {
+	assert_param((Size != 0) && ((Size & (Size - 1)) == 0));
+	assert_param((FrameSize != 0) && (FrameSize <= Size));
+
+	ring->pBuffer = pBuffer;
+	ring->Size = Size;
+	ring->FrameSize = FrameSize;
+	ring->Head = 0;
+	ring->Tail = 0;
+	ring->Overflows = 0;
+	ring->HighWater = 0;
+}
+
+/**
+ * @brief  Queues samples. Producer side, safe to call from an interrupt.
+ * @note   When the ring is full the frames that do not fit are dropped and
+ *         accounted in the Overflows counter; the call never blocks. Only
+ *         whole frames are queued, so the ring always holds a whole number
+ *         of frames and the channels stay interleaved across a loss.
+ * @param  ring: ring handle
+ * @param  pData: samples to queue
+ * @param  Count: number of samples, a multiple of the frame size
+ * @retval Number of samples actually queued
+ */
+uint32_t SampleRing_Put(SampleRing_TypeDef *ring, const uint16_t *pData,
+		uint32_t Count) {
+	uint32_t head = ring->Head;
+	uint32_t level = head - ring->Tail;
+	uint32_t space = ring->Size - level;
+	uint32_t index, first;
+
+	space -= space % ring->FrameSize;
+	if (Count > space) {
+		ring->Overflows += Count - space;
+		Count = space;
+	}
+
+	if (Count != 0) {
+		index = head & (ring->Size - 1);
+		first = ring->Size - index;
+		if (first > Count) {
+			first = Count;
+		}
+		memcpy(&ring->pBuffer[index], pData, first * sizeof(uint16_t));
+		memcpy(ring->pBuffer, pData + first, (Count - first) * sizeof(uint16_t));
+
+		/* Publish the data before the new head */
+		__DMB();
+		ring->Head = head + Count;
+
+		level += Count;
+		if (level > ring->HighWater) {
+			ring->HighWater = level;
+		}
+	}
+
+	return Count;
+}
+
+/**
+ * @brief  Accounts samples that were never acquired, e.g. while the
+ *         acquisition was paused, as dropped. Producer side.
+ * @param  ring: ring handle
+ * @param  Count: number of samples missed
+ * @retval None
+ */
+void SampleRing_Skip(SampleRing_TypeDef *ring, uint32_t Count) {
+	ring->Overflows += Count;
+}
+
+/**
+ * @brief  Dequeues samples. Consumer side, called from thread context.
+ * @param  ring: ring handle
+ * @param  pData: destination buffer
+ * @param  Count: maximum number of samples to dequeue
+ * @retval Number of samples actually dequeued
+ */
+uint32_t SampleRing_Get(SampleRing_TypeDef *ring, uint16_t *pData,
+		uint32_t Count) {
+	uint32_t tail = ring->Tail;
+	uint32_t level = ring->Head - tail;
+	uint32_t index, first;
+
+	if (Count > level) {
+		Count = level;
+	}
+
+	if (Count != 0) {
+		/* Do not read the samples before the head that published them */
+		__DMB();
+
+		index = tail & (ring->Size - 1);
+		first = ring->Size - index;
+		if (first > Count) {
+			first = Count;
+		}
+		memcpy(pData, &ring->pBuffer[index], first * sizeof(uint16_t));
+		memcpy(pData + first, ring->pBuffer, (Count - first) * sizeof(uint16_t));
+
+		/* Release the slots only once they have been copied out */
+		__DMB();
+		ring->Tail = tail + Count;
+	}
+
+	return Count;
+}
+
+/**
+ * @brief  Returns the number of samples currently queued.
+ * @param  ring: ring handle
+ * @retval Fill level in samples
+ */
+uint32_t SampleRing_Level(SampleRing_TypeDef *ring) {
+	return ring->Head - ring->Tail;
+}
+
+/**
+ * @brief  Takes a snapshot of the ring counters.
+ * @param  ring: ring handle
+ * @param  pStats: statistics output
+ * @retval None
+ */
+void SampleRing_GetStats(SampleRing_TypeDef *ring,
+		SampleRing_StatsTypeDef *pStats) {
+	pStats->Size = ring->Size;
+	pStats->Level = ring->Head - ring->Tail;
+	pStats->Overflows = ring->Overflows;
+	pStats->HighWater = ring->HighWater;
+}
+
+/**
+ * @brief  Clears the overflow counter and high-water mark.
+ * @note   The producer updates both counters, call this with the producer
+ *         stopped or accept that a concurrent update may be lost.
+ * @param  ring: ring handle
+ * @retval None
+ */
+void SampleRing_ResetStats(SampleRing_TypeDef *ring) {
+	ring->Overflows = 0;
+	ring->HighWater = ring->Head - ring->Tail;
+}
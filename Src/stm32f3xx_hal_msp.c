@@ -69,29 +69,67 @@ void HAL_MspInit(void) {
  *        This function configures the hardware resources used in this example:
  *           - Peripheral's clock enable
  *           - Peripheral's GPIO Configuration
+ *           - DMA configuration for transmission request by peripheral
+ *           - NVIC configuration for DMA interrupt request enable
  * @param hadc: ADC handle pointer
  * @retval None
  */
 void HAL_ADC_MspInit(ADC_HandleTypeDef *hadc) {
 	GPIO_InitTypeDef GPIO_InitStruct;
+	static DMA_HandleTypeDef hdma_adc;
 
 	/*##-1- Enable peripherals and GPIO Clocks #################################*/
 	/* Enable GPIO clock ****************************************/
 	ADCx_CHANNEL_GPIO_CLK_ENABLE();
 	/* ADC3 Periph clock enable */
 	ADCx_CLK_ENABLE();
+	/* DMA1 clock enable */
+	ADCx_DMA_CLK_ENABLE();
 
 	/*##-2- Configure peripheral GPIO ##########################################*/
 	/* ADC Channel GPIO pin configuration */
-	GPIO_InitStruct.Pin = ADCx_CHANNEL_PIN;
+	GPIO_InitStruct.Pin = ADCx_CHANNEL_PINS;
 	GPIO_InitStruct.Mode = GPIO_MODE_ANALOG;
 	GPIO_InitStruct.Pull = GPIO_NOPULL;
 	HAL_GPIO_Init(ADCx_CHANNEL_GPIO_PORT, &GPIO_InitStruct);
 
-	/*##-3- Configure the NVIC #################################################*/
-	/* NVIC configuration for DMA transfer complete interrupt (USART1_TX) */
-	HAL_NVIC_SetPriority(ADCx_IRQn, 0, 0);
-	HAL_NVIC_EnableIRQ(ADCx_IRQn);
+	/* The slave ADC of the dual mode has no DMA, its results are read by the
+	 DMA of the master */
+	if (hadc->Instance == ADCx) {
+		/*##-3- Configure the DMA ##############################################*/
+		/* Set the parameters to be configured for ADCx_DMA1_CHANNEL1 */
+		hdma_adc.Instance = ADCx_DMA_INSTANCE;
+
+		hdma_adc.Init.Direction = DMA_PERIPH_TO_MEMORY;
+		hdma_adc.Init.PeriphInc = DMA_PINC_DISABLE;
+		hdma_adc.Init.MemInc = DMA_MINC_ENABLE;
+#if ADC_DUAL_MODE
+		/* One word per pair of results from the common data register */
+		hdma_adc.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+		hdma_adc.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+#else
+		hdma_adc.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+		hdma_adc.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+#endif
+		hdma_adc.Init.Mode = DMA_CIRCULAR;
+		hdma_adc.Init.Priority = DMA_PRIORITY_HIGH;
+
+		HAL_DMA_DeInit(&hdma_adc);
+		HAL_DMA_Init(&hdma_adc);
+
+		/* Associate the initialized DMA handle to the the ADC handle */
+		__HAL_LINKDMA(hadc, DMA_Handle, hdma_adc);
+
+		/*##-4- Configure the NVIC #############################################*/
+		/* NVIC configuration for DMA half/full transfer interrupt */
+		HAL_NVIC_SetPriority(ADCx_DMA_IRQn, 1, 0);
+		HAL_NVIC_EnableIRQ(ADCx_DMA_IRQn);
+
+		/* NVIC configuration for the analog watchdogs, same priority as the
+		 DMA so a trigger and a block of samples are not interleaved */
+		HAL_NVIC_SetPriority(ADCx_IRQn, 1, 0);
+		HAL_NVIC_EnableIRQ(ADCx_IRQn);
+	}
 }
 
 /**
@@ -109,8 +147,18 @@ void HAL_ADC_MspDeInit(ADC_HandleTypeDef *hadc) {
 	ADCx_RELEASE_RESET();
 
 	/*##-2- Disable peripherals and GPIO Clocks ################################*/
-	/* De-initialize the ADC Channel GPIO pin */
-	HAL_GPIO_DeInit(ADCx_CHANNEL_GPIO_PORT, ADCx_CHANNEL_PIN);
+	/* De-initialize the ADC Channel GPIO pins */
+	HAL_GPIO_DeInit(ADCx_CHANNEL_GPIO_PORT, ADCx_CHANNEL_PINS);
+
+	/*##-3- Disable the DMA Channel ############################################*/
+	/* De-Initialize the DMA Channel associated to the ADC */
+	if (hadc->DMA_Handle != NULL) {
+		HAL_DMA_DeInit(hadc->DMA_Handle);
+	}
+
+	/*##-4- Disable the NVIC for DMA and ADC ###################################*/
+	HAL_NVIC_DisableIRQ(ADCx_DMA_IRQn);
+	HAL_NVIC_DisableIRQ(ADCx_IRQn);
 }
 
 /**
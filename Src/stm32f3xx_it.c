@@ -34,7 +34,12 @@
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 extern ADC_HandleTypeDef AdcHandle;
+#if ADC_DUAL_MODE
+extern ADC_HandleTypeDef AdcSlaveHandle;
+#endif
 extern DAC_HandleTypeDef DacHandle;
+extern DMA_HandleTypeDef heval_SpiDmaTx;
+extern DMA_HandleTypeDef heval_SpiDmaRx;
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 
@@ -143,12 +148,24 @@ void EXTI9_5_IRQHandler() {
 }
 
 /**
- * @brief  This function handles ADC interrupt request.
+ * @brief  This function handles ADC DMA interrupt request.
+ * @param  None
+ * @retval None
+ */
+void ADCx_DMA_IRQHandler(void) {
+	HAL_DMA_IRQHandler(AdcHandle.DMA_Handle);
+}
+
+/**
+ * @brief  This function handles ADC interrupt request (analog watchdogs).
  * @param  None
  * @retval None
  */
 void ADCx_IRQHandler(void) {
 	HAL_ADC_IRQHandler(&AdcHandle);
+#if ADC_DUAL_MODE
+	HAL_ADC_IRQHandler(&AdcSlaveHandle);
+#endif
 }
 
 /**
@@ -160,6 +177,33 @@ void DACx_DMA_IRQHandler(void) {
 	HAL_DMA_IRQHandler(DacHandle.DMA_Handle1);
 }
 
+/**
+ * @brief  This function handles SD SPI transmit DMA interrupt request.
+ * @param  None
+ * @retval None
+ */
+void EVAL_SPIx_DMA_TX_IRQHandler(void) {
+	HAL_DMA_IRQHandler(&heval_SpiDmaTx);
+}
+
+/**
+ * @brief  This function handles SD SPI receive DMA interrupt request.
+ * @param  None
+ * @retval None
+ */
+void EVAL_SPIx_DMA_RX_IRQHandler(void) {
+	HAL_DMA_IRQHandler(&heval_SpiDmaRx);
+}
+
+/**
+ * @brief  This function handles SD busy poll timer interrupt request.
+ * @param  None
+ * @retval None
+ */
+void EVAL_SD_BUSY_TIM_IRQHandler(void) {
+	BSP_SD_BusyPoll_IRQHandler();
+}
+
 /**
  * @brief  This function handles PPP interrupt request.
  * @param  None
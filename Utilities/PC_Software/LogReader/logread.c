@@ -0,0 +1,276 @@
+/**
+ ******************************************************************************
+ * @file    logread.c
+ * @brief   Host-side reader for the binary sample logs written by the
+ *          firmware (see Inc/log_format.h). Converts a log file to CSV:
+ *
+ *            frame,time_s,channel,raw,value
+ *
+ *          Build with any C99 host compiler, e.g.
+ *            cc -std=c99 -O2 -I../../../Inc -o logread logread.c
+ *
+ *          Usage: logread LOG.BIN [OUT.CSV [PREFIX]]
+ *          Header information, sequence gaps and overflow losses are
+ *          reported on stderr. Burst and event records are listed on stderr
+ *          and, if PREFIX is given, written in the same format to
+ *          PREFIXburstn.csv, frames counted from the start of the burst, and
+ *          PREFIXeventn.csv, frames counted from the start of the
+ *          acquisition, before decimation. OUT.CSV may be - for the standard
+ *          output.
+ ******************************************************************************
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log_format.h"
+
+/* Private functions ---------------------------------------------------------*/
+
+/**
+ * @brief  Prints the file header.
+ */
+static void print_header(const LogFileHeader_TypeDef *h) {
+	unsigned int ch;
+
+	fprintf(stderr, "version        : %u\n", h->Version);
+	fprintf(stderr, "sample rate    : %lu Hz\n", (unsigned long) h->SampleRateHz);
+	fprintf(stderr, "resolution     : %u bits\n", h->Resolution);
+	if (h->Decimation > 1) {
+		fprintf(stderr, "decimation     : 1 in %u, acquired at %lu Hz\n",
+				h->Decimation, (unsigned long) h->SampleRateHz * h->Decimation);
+	}
+	fprintf(stderr, "start tick     : %lu ms\n", (unsigned long) h->StartTick);
+	fprintf(stderr, "start time     : %04u-%02u-%02u %02u:%02u:%02u\n",
+			(unsigned int) ((h->StartTime >> 25) + 1980),
+			(unsigned int) ((h->StartTime >> 21) & 0x0F),
+			(unsigned int) ((h->StartTime >> 16) & 0x1F),
+			(unsigned int) ((h->StartTime >> 11) & 0x1F),
+			(unsigned int) ((h->StartTime >> 5) & 0x3F),
+			(unsigned int) ((h->StartTime & 0x1F) * 2));
+	for (ch = 0; ch < h->ChannelCount; ch++) {
+		fprintf(stderr, "channel %u      : ADC_IN%u gain %g offset %g\n", ch,
+				h->ChannelMap[ch], h->Gain[ch], h->Offset[ch]);
+	}
+	if (h->Flags & LOG_FLAG_PAIRED) {
+		fprintf(stderr, "paired         : channels 2n and 2n+1 sampled together\n");
+	}
+}
+
+/**
+ * @brief  Prints the description of a burst record.
+ */
+static void print_burst(const LogBurstInfo_TypeDef *info) {
+	unsigned int ch;
+
+	fprintf(stderr, "burst %lu        : %lu samples at %lu Hz, tick %lu ms, "
+			"stream resumes at sample %llu\n", (unsigned long) info->Id,
+			(unsigned long) info->SampleCount, (unsigned long) info->SampleRateHz,
+			(unsigned long) info->StartTick,
+			(unsigned long long) info->StreamSample);
+	for (ch = 0; ch < info->ChannelCount; ch++) {
+		fprintf(stderr, "  channel %u    : ADC_IN%u gain %g offset %g\n", ch,
+				info->ChannelMap[ch], info->Gain[ch], info->Offset[ch]);
+	}
+}
+
+/**
+ * @brief  Prints the description of an event record.
+ */
+static void print_event(const LogEventInfo_TypeDef *info,
+		const LogFileHeader_TypeDef *h) {
+	fprintf(stderr, "event %lu        : %lu samples from sample %lu, "
+			"ADC_IN%u tripped at sample %lu, tick %lu ms\n",
+			(unsigned long) info->Id, (unsigned long) info->SampleCount,
+			(unsigned long) info->FirstSample, h->ChannelMap[info->Channel],
+			(unsigned long) info->TriggerSample,
+			(unsigned long) info->TriggerTick);
+}
+
+/**
+ * @brief  Writes the samples of one stream or record block as CSV rows,
+ *         base is the index of the first sample of the record and wide is
+ *         set for 16-bit samples.
+ */
+static void dump_samples(FILE *out, uint32_t rate, unsigned int channels,
+		const float *gain, const float *offset, uint64_t base, int wide,
+		const LogBlock_TypeDef *b) {
+	const uint8_t *p = b->Data;
+	uint16_t raw;
+	uint64_t index, frame;
+	unsigned int i, ch;
+
+	for (i = 0; i < b->Count; i++) {
+		if (wide) {
+			raw = LOG_UNPACK16(p);
+			p += 2;
+		} else {
+			raw = (i & 1) ? LOG_UNPACK12_1(p) : LOG_UNPACK12_0(p);
+			if (i & 1) {
+				p += 3;
+			}
+		}
+		index = base + b->FirstSample + i;
+		frame = index / channels;
+		ch = (unsigned int) (index % channels);
+		fprintf(out, "%llu,%.9f,%u,%u,%g\n", (unsigned long long) frame,
+				(double) frame / rate, ch, raw, raw * gain[ch] + offset[ch]);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	LogFileHeader_TypeDef header;
+	LogBlock_TypeDef block;
+	LogBurstInfo_TypeDef burst;
+	LogEventInfo_TypeDef event;
+	char name[FILENAME_MAX];
+	FILE *in, *out = stdout, *recordOut = NULL;
+	uint16_t recordType = 0;
+	float recordGain[LOG_MAX_CHANNELS];
+	uint32_t acquiredRate;
+	unsigned int ch;
+	int wide;
+	uint32_t expected = 0, dropped = 0;
+	unsigned long blocks = 0, bad = 0;
+
+	if ((argc < 2) || (argc > 4)) {
+		fprintf(stderr, "usage: %s LOG.BIN [OUT.CSV [PREFIX]]\n", argv[0]);
+		return 2;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	if ((argc >= 3) && (strcmp(argv[2], "-") != 0)) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	if ((fread(&header, sizeof(header), 1, in) != 1)
+			|| (header.Magic != LOG_FILE_MAGIC)) {
+		fprintf(stderr, "%s: not a sample log\n", argv[1]);
+		return 1;
+	}
+	if ((header.Version != LOG_FILE_VERSION)
+			|| (header.BlockSize != LOG_BLOCK_SIZE)
+			|| (header.ChannelCount == 0)
+			|| (header.ChannelCount > LOG_MAX_CHANNELS)) {
+		fprintf(stderr, "%s: unsupported log version %u\n", argv[1],
+				header.Version);
+		return 1;
+	}
+	print_header(&header);
+
+	/* Stream samples above 12 bits are stored in 16 bits; records hold the
+	 * acquired 12-bit codes */
+	wide = (header.Resolution > 12);
+	acquiredRate = header.SampleRateHz
+			* ((header.Decimation > 1) ? header.Decimation : 1);
+	for (ch = 0; ch < LOG_MAX_CHANNELS; ch++) {
+		recordGain[ch] = wide ?
+				header.Gain[ch] * (float) (1 << (header.Resolution - 12)) :
+				header.Gain[ch];
+	}
+	memset(&burst, 0, sizeof(burst));
+	memset(&event, 0, sizeof(event));
+
+	fprintf(out, "frame,time_s,channel,raw,value\n");
+	while (fread(&block, sizeof(block), 1, in) == 1) {
+		if ((block.Sync != LOG_BLOCK_SYNC) || (block.Count > LOG_BLOCK_SAMPLES)
+				|| (block.Session != header.Session)) {
+			/* Unwritten, stale or corrupted block */
+			bad++;
+			continue;
+		}
+		if (block.Sequence != expected) {
+			fprintf(stderr, "block %lu: sequence %lu, expected %lu\n", blocks,
+					(unsigned long) block.Sequence, (unsigned long) expected);
+		}
+		expected = block.Sequence + 1;
+		blocks++;
+
+		if (block.Type == LOG_BLOCK_TYPE_SAMPLES) {
+			if (wide && (block.Count > LOG_BLOCK_SAMPLES16)) {
+				bad++;
+				continue;
+			}
+			if (block.Dropped != dropped) {
+				fprintf(stderr, "block %lu: %lu samples lost before sample %llu\n",
+						blocks - 1, (unsigned long) (block.Dropped - dropped),
+						(unsigned long long) block.FirstSample);
+				dropped = block.Dropped;
+			}
+			dump_samples(out, header.SampleRateHz, header.ChannelCount,
+					header.Gain, header.Offset, 0, wide, &block);
+			continue;
+		}
+
+		if (block.Type == LOG_BLOCK_TYPE_BURST_INFO) {
+			memcpy(&burst, block.Data, sizeof(burst));
+			if ((burst.ChannelCount == 0)
+					|| (burst.ChannelCount > LOG_MAX_CHANNELS)) {
+				recordType = 0;
+				continue;
+			}
+			print_burst(&burst);
+			snprintf(name, sizeof(name), "%sburst%lu.csv",
+					(argc == 4) ? argv[3] : "", (unsigned long) burst.Id);
+		} else if (block.Type == LOG_BLOCK_TYPE_EVENT_INFO) {
+			memcpy(&event, block.Data, sizeof(event));
+			if (event.Channel >= header.ChannelCount) {
+				recordType = 0;
+				continue;
+			}
+			print_event(&event, &header);
+			snprintf(name, sizeof(name), "%sevent%lu.csv",
+					(argc == 4) ? argv[3] : "", (unsigned long) event.Id);
+		} else {
+			/* Samples of the current record, whose type follows the type of
+			 * its description */
+			if ((recordOut == NULL) || (block.Type != recordType + 1)) {
+				continue;
+			}
+			if (recordType == LOG_BLOCK_TYPE_BURST_INFO) {
+				dump_samples(recordOut, burst.SampleRateHz, burst.ChannelCount,
+						burst.Gain, burst.Offset, 0, 0, &block);
+			} else {
+				dump_samples(recordOut, acquiredRate, header.ChannelCount,
+						recordGain, header.Offset, event.FirstSample, 0,
+						&block);
+			}
+			continue;
+		}
+
+		/* Start of a record */
+		recordType = block.Type;
+		if (argc == 4) {
+			if (recordOut != NULL) {
+				fclose(recordOut);
+			}
+			recordOut = fopen(name, "w");
+			if (recordOut == NULL) {
+				perror(name);
+				return 1;
+			}
+			fprintf(recordOut, "frame,time_s,channel,raw,value\n");
+		}
+	}
+
+	fprintf(stderr, "%lu blocks, %lu invalid, %lu samples lost\n", blocks, bad,
+			(unsigned long) dropped);
+
+	fclose(in);
+	if (recordOut != NULL) {
+		fclose(recordOut);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}